@@ -0,0 +1,619 @@
+//------------------------------------------------------------------------
+//  Benchmarks
+//------------------------------------------------------------------------
+//
+//  ELFBSP  Copyright (C) 2025  Guilherme Miranda
+//
+//  This program is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU General Public License
+//  as published by the Free Software Foundation; either version 2
+//  of the License, or (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//------------------------------------------------------------------------
+//
+//  Each map made by the generator is written into a temporary wad in
+//  the UDMF format (the large ones do not fit the DOOM format), then
+//  the parts of the node builder are run on it, keeping the best time
+//  of several runs:
+//
+//     udmf      : loading the level, mostly ParseUDMF()
+//     eval      : EvalPartition() without any early-out, for a sample
+//                 of the segs, against all the segs of the level
+//     nodes     : CreateSegs() and BuildNodes() for the whole level
+//     blockmap  : PutBlockmap()
+//     reject    : PutReject()
+//
+//  The results are shown as tables, one for each benchmark, with the
+//  throughput and the scaling exponent between consecutive sizes of
+//  the same style (1.0 is linear, 2.0 is quadratic).
+//
+//------------------------------------------------------------------------
+
+#include <algorithm>
+#include <cstdarg>
+#include <string>
+#include <vector>
+
+#include "elfbsp.hpp"
+#include "local.hpp"
+#include "system.hpp"
+#include "utility.hpp"
+#include "wad.hpp"
+
+#include "mapgen.hpp"
+
+using namespace elfbsp;
+
+
+// number of segs tried as partitions in the 'eval' benchmark
+#define EVAL_SAMPLE  256
+
+// the reject table takes (sectors^2 / 8) bytes, skip it above this
+#define REJECT_MAX_SECTORS  32768
+
+#define TEMP_WAD  "elfbsp_bench.tmp.wad"
+
+
+class benchinfo_t : public buildinfo_t
+{
+public:
+	void Print(const char *fmt, ...)
+	{ }
+
+	void Print_Verbose(const char *fmt, ...)
+	{ }
+
+	void Debug(const char *fmt, ...)
+	{ }
+
+	void ShowMap(const char *name)
+	{ }
+
+	void FatalError(const char *fmt, ...)
+	{
+		va_list arg_ptr;
+
+		char buffer[MSG_BUF_LEN];
+
+		va_start(arg_ptr, fmt);
+		vsnprintf(buffer, MSG_BUF_LEN-1, fmt, arg_ptr);
+		va_end(arg_ptr);
+
+		buffer[MSG_BUF_LEN-1] = 0;
+
+		CloseWad();
+		FileDelete(TEMP_WAD);
+
+		fprintf(stderr, "\nFATAL ERROR: %s", buffer);
+
+		exit(3);
+	}
+};
+
+static benchinfo_t config;
+
+
+//------------------------------------------------------------------------
+
+typedef enum
+{
+	BENCH_UDMF = 0,
+	BENCH_Eval,
+	BENCH_Nodes,
+	BENCH_Blockmap,
+	BENCH_Reject,
+
+	NUM_BENCHES
+}
+bench_e;
+
+static const char *bench_names[NUM_BENCHES] =
+{
+	"udmf", "eval", "nodes", "blockmap", "reject"
+};
+
+static const char *bench_titles[NUM_BENCHES] =
+{
+	"ParseUDMF (loading the level)",
+	"EvalPartition (full evaluation, no early-out)",
+	"BuildNodes (including CreateSegs)",
+	"PutBlockmap",
+	"PutReject"
+};
+
+
+struct result_t
+{
+	int style;
+
+	int lines;
+	int sectors;
+	int segs;
+
+	// best time of each benchmark, negative when skipped
+	double secs[NUM_BENCHES];
+
+	// how much work each benchmark did, see Throughput()
+	double work[NUM_BENCHES];
+};
+
+static std::vector<result_t> results;
+
+
+// options
+static std::vector<int> opt_sizes;
+static std::vector<int> opt_styles;
+
+static int opt_repeat = 3;
+
+static std::string opt_csv;
+
+
+static void Keep(double *best, double secs)
+{
+	if (*best < 0 || secs < *best)
+		*best = secs;
+}
+
+
+static void RunBenchmarks(result_t *res)
+{
+	for (int b = 0 ; b < NUM_BENCHES ; b++)
+	{
+		res->secs[b] = -1;
+		res->work[b] = 0;
+	}
+
+	OpenWad(TEMP_WAD);
+
+	for (int r = 0 ; r < opt_repeat ; r++)
+	{
+		level_t level;
+
+		/* udmf */
+
+		BeginLevel(0, &level);
+
+		Keep(&res->secs[BENCH_UDMF], level.stats.wall[STAT_Load]);
+		res->work[BENCH_UDMF] = res->lines;
+
+		/* eval */
+
+		seg_t *list = CreateSegs();
+
+		bbox_t bounds;
+		FindLimits2(list, &bounds);
+
+		std::vector<seg_t *> sample;
+		int total = 0;
+
+		for (seg_t *seg = list ; seg != NULL ; seg = seg->next)
+			total++;
+
+		int step = std::max(1, total / EVAL_SAMPLE);
+		int k = 0;
+
+		for (seg_t *seg = list ; seg != NULL ; seg = seg->next, k++)
+			if (k % step == 0)
+				sample.push_back(seg);
+
+		quadtree_c *tree = TreeFromSegList(list, &bounds);
+
+		level_stats_t stats;
+
+		double start = TimeWall();
+
+		for (size_t i = 0 ; i < sample.size() ; i++)
+			EvalPartition(tree, sample[i], 1.0e99, &stats);
+
+		Keep(&res->secs[BENCH_Eval], TimeWall() - start);
+
+		res->segs = total;
+		res->work[BENCH_Eval] = (double)sample.size();
+
+		delete tree;
+
+		/* blockmap and reject */
+
+		InitBlockmap();
+
+		start = TimeWall();
+		PutBlockmap();
+		Keep(&res->secs[BENCH_Blockmap], TimeWall() - start);
+
+		res->work[BENCH_Blockmap] = res->lines;
+
+		if (res->sectors <= REJECT_MAX_SECTORS)
+		{
+			start = TimeWall();
+			PutReject();
+			Keep(&res->secs[BENCH_Reject], TimeWall() - start);
+
+			res->work[BENCH_Reject] = res->sectors;
+		}
+
+		WriteLevel();
+
+		EndLevel();
+
+		/* nodes, on a fresh copy of the level */
+
+		level_t fresh;
+
+		BeginLevel(0, &fresh);
+
+		start = TimeWall();
+
+		list = CreateSegs();
+
+		node_t   *root_node = NULL;
+		subsec_t *root_sub  = NULL;
+
+		if (config.threads != 1)
+			BuildNodesThreaded(list, &bounds, &root_node, &root_sub);
+		else
+			BuildNodes(list, 0, &bounds, &root_node, &root_sub);
+
+		Keep(&res->secs[BENCH_Nodes], TimeWall() - start);
+
+		res->work[BENCH_Nodes] = res->lines;
+
+		EndLevel();
+	}
+
+	CloseWad();
+}
+
+
+static void RunMap(int style, int want_lines)
+{
+	mapgen_c map;
+
+	map.Generate((mapgen_style_e)style, want_lines);
+
+	Wad_file *wad = Wad_file::Open(TEMP_WAD, 'w');
+
+	if (wad == NULL)
+		config.FatalError("cannot create file: %s\n", TEMP_WAD);
+
+	wad->BeginWrite();
+	map.WriteUDMF(wad, "MAP01");
+	wad->EndWrite();
+
+	delete wad;
+
+	result_t res;
+
+	res.style   = style;
+	res.lines   = (int)map.lines.size();
+	res.sectors = (int)map.sectors.size();
+	res.segs    = 0;
+
+	printf("  %-8s %8d lines %8d sectors ...", MapGen_StyleName(style), res.lines, res.sectors);
+	fflush(stdout);
+
+	double start = TimeWall();
+
+	RunBenchmarks(&res);
+
+	printf(" %1.1f s\n", TimeWall() - start);
+	fflush(stdout);
+
+	results.push_back(res);
+
+	FileDelete(TEMP_WAD);
+}
+
+
+//------------------------------------------------------------------------
+
+
+static double Throughput(const result_t& res, int b)
+{
+	if (res.secs[b] <= 0)
+		return 0;
+
+	return res.work[b] / res.secs[b];
+}
+
+
+static const char *ThroughputUnit(int b)
+{
+	switch (b)
+	{
+		case BENCH_Eval:   return "evals/s";
+		case BENCH_Reject: return "sectors/s";
+		default:           return "lines/s";
+	}
+}
+
+
+// the size which the time of a benchmark depends on
+static double BenchSize(const result_t& res, int b)
+{
+	switch (b)
+	{
+		case BENCH_Eval:   return res.segs;
+		case BENCH_Reject: return res.sectors;
+		default:           return res.lines;
+	}
+}
+
+
+static void ShowTable(int b)
+{
+	printf("\n%s\n\n", bench_titles[b]);
+
+	printf("  %-8s %8s %8s %12s %14s %8s\n", "style", "lines", "sectors", "time (ms)", ThroughputUnit(b), "scaling");
+
+	for (size_t i = 0 ; i < results.size() ; i++)
+	{
+		const result_t& res = results[i];
+
+		if (res.secs[b] < 0)
+		{
+			printf("  %-8s %8d %8d %12s\n", MapGen_StyleName(res.style), res.lines, res.sectors, "skipped");
+			continue;
+		}
+
+		char scaling[32] = "";
+
+		// compare with the previous size of the same style
+		if (i > 0 && results[i-1].style == res.style && results[i-1].secs[b] > 0 && res.secs[b] > 0)
+		{
+			const result_t& prev = results[i-1];
+
+			double size_now  = BenchSize(res,  b);
+			double size_prev = BenchSize(prev, b);
+
+			// the eval benchmark is timed per evaluation
+			double time_now  = res.secs[b];
+			double time_prev = prev.secs[b];
+
+			if (b == BENCH_Eval)
+			{
+				time_now  /= std::max(1.0, res.work[b]);
+				time_prev /= std::max(1.0, prev.work[b]);
+			}
+
+			if (size_now > size_prev)
+				snprintf(scaling, sizeof(scaling), "%1.2f", log(time_now / time_prev) / log(size_now / size_prev));
+		}
+
+		double tp = Throughput(res, b);
+
+		if (b == BENCH_Eval)
+			printf("  %-8s %8d %8d %12.3f %14.0f %8s   (%1.0f segs/s)\n", MapGen_StyleName(res.style),
+					res.lines, res.sectors, res.secs[b] * 1000.0, tp, scaling, tp * res.segs);
+		else
+			printf("  %-8s %8d %8d %12.3f %14.0f %8s\n", MapGen_StyleName(res.style),
+					res.lines, res.sectors, res.secs[b] * 1000.0, tp, scaling);
+	}
+}
+
+
+static void WriteCSV(const char *filename)
+{
+	FILE *fp = fopen(filename, "w");
+
+	if (fp == NULL)
+		config.FatalError("cannot create file: %s\n", filename);
+
+	fprintf(fp, "style,lines,sectors,segs,bench,seconds,throughput,unit\n");
+
+	for (size_t i = 0 ; i < results.size() ; i++)
+	{
+		const result_t& res = results[i];
+
+		for (int b = 0 ; b < NUM_BENCHES ; b++)
+		{
+			if (res.secs[b] < 0)
+				continue;
+
+			fprintf(fp, "%s,%d,%d,%d,%s,%1.6f,%1.1f,%s\n", MapGen_StyleName(res.style),
+					res.lines, res.sectors, res.segs, bench_names[b],
+					res.secs[b], Throughput(res, b), ThroughputUnit(b));
+		}
+	}
+
+	fclose(fp);
+}
+
+
+//------------------------------------------------------------------------
+
+
+static void ShowUsage()
+{
+	printf(
+		"\n"
+		"Usage: elfbsp_bench [options...]\n"
+		"       elfbsp_bench --gen STYLE LINES FILE\n"
+		"\n"
+		"Available options are:\n"
+		"    --sizes  LIST      Numbers of linedefs (default 1000,4000,16000,64000)\n"
+		"    --styles LIST      Map styles (default rooms,caves,outdoor,sectors)\n"
+		"    --repeat ##        Number of runs, the best is kept (default 3)\n"
+		"    --threads ##       Number of threads for BuildNodes (default 1)\n"
+		"    --csv  FILE        Also write the results to a CSV file\n"
+		"\n"
+		"    --gen STYLE LINES FILE\n"
+		"                       Write a generated map as MAP01 of a new wad,\n"
+		"                       in DOOM format when it fits, otherwise UDMF\n"
+		"\n"
+		"Sizes can range from 1000 to 500000 linedefs.\n"
+		"\n");
+}
+
+
+static void ParseList(const char *str, std::vector<std::string>& list)
+{
+	std::string cur;
+
+	for ( ; ; str++)
+	{
+		if (*str == ',' || *str == 0)
+		{
+			if (cur.size() > 0)
+				list.push_back(cur);
+
+			cur.clear();
+
+			if (*str == 0)
+				return;
+
+			continue;
+		}
+
+		cur += *str;
+	}
+}
+
+
+static int GenerateFile(const char *style_name, const char *lines, const char *filename)
+{
+	int style = MapGen_FindStyle(style_name);
+
+	if (style < 0)
+		config.FatalError("unknown style: %s\n", style_name);
+
+	mapgen_c map;
+
+	map.Generate((mapgen_style_e)style, atoi(lines));
+
+	Wad_file *wad = Wad_file::Open(filename, 'w');
+
+	if (wad == NULL)
+		config.FatalError("cannot create file: %s\n", filename);
+
+	bool doom = map.FitsDoom();
+
+	wad->BeginWrite();
+
+	if (doom)
+		map.WriteDoom(wad, "MAP01");
+	else
+		map.WriteUDMF(wad, "MAP01");
+
+	wad->EndWrite();
+
+	delete wad;
+
+	printf("Wrote %s: %s map with %d lines, %d sectors, %d vertices (%s format)\n",
+			filename, MapGen_StyleName(style), (int)map.lines.size(),
+			(int)map.sectors.size(), (int)map.vertices.size(), doom ? "DOOM" : "UDMF");
+
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	SetInfo(&config);
+
+	for (int i = 1 ; i < argc ; i++)
+	{
+		const char *arg = argv[i];
+		const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+		if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0)
+		{
+			ShowUsage();
+			return 0;
+		}
+
+		if (strcmp(arg, "--gen") == 0)
+		{
+			if (i + 3 >= argc)
+				config.FatalError("usage: --gen STYLE LINES FILE\n");
+
+			return GenerateFile(argv[i+1], argv[i+2], argv[i+3]);
+		}
+
+		if (val == NULL)
+			config.FatalError("missing value for '%s' option\n", arg);
+
+		i++;
+
+		if (strcmp(arg, "--sizes") == 0)
+		{
+			std::vector<std::string> list;
+			ParseList(val, list);
+
+			for (size_t k = 0 ; k < list.size() ; k++)
+				opt_sizes.push_back(atoi(list[k].c_str()));
+		}
+		else if (strcmp(arg, "--styles") == 0)
+		{
+			std::vector<std::string> list;
+			ParseList(val, list);
+
+			for (size_t k = 0 ; k < list.size() ; k++)
+			{
+				int style = MapGen_FindStyle(list[k].c_str());
+
+				if (style < 0)
+					config.FatalError("unknown style: %s\n", list[k].c_str());
+
+				opt_styles.push_back(style);
+			}
+		}
+		else if (strcmp(arg, "--repeat") == 0)
+		{
+			opt_repeat = std::max(1, atoi(val));
+		}
+		else if (strcmp(arg, "--threads") == 0)
+		{
+			config.threads = std::max(0, std::min(JOBS_MAX, atoi(val)));
+		}
+		else if (strcmp(arg, "--csv") == 0)
+		{
+			opt_csv = val;
+		}
+		else
+		{
+			config.FatalError("unknown option: '%s'\n", arg);
+		}
+	}
+
+	if (opt_sizes.empty())
+	{
+		opt_sizes.push_back(1000);
+		opt_sizes.push_back(4000);
+		opt_sizes.push_back(16000);
+		opt_sizes.push_back(64000);
+	}
+
+	if (opt_styles.empty())
+	{
+		for (int s = 0 ; s < NUM_MAPGEN_STYLES ; s++)
+			opt_styles.push_back(s);
+	}
+
+	std::sort(opt_sizes.begin(), opt_sizes.end());
+
+	printf("Running benchmarks (best of %d)\n\n", opt_repeat);
+
+	for (size_t s = 0 ; s < opt_styles.size() ; s++)
+		for (size_t k = 0 ; k < opt_sizes.size() ; k++)
+			RunMap(opt_styles[s], opt_sizes[k]);
+
+	for (int b = 0 ; b < NUM_BENCHES ; b++)
+		ShowTable(b);
+
+	printf("\n");
+
+	if (opt_csv.size() > 0)
+		WriteCSV(opt_csv.c_str());
+
+	return 0;
+}
+
+
+//--- editor settings ---
+// vi:ts=4:sw=4:noexpandtab
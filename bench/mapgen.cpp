@@ -0,0 +1,771 @@
+//------------------------------------------------------------------------
+//  Synthetic Map Generator
+//------------------------------------------------------------------------
+//
+//  ELFBSP  Copyright (C) 2025  Guilherme Miranda
+//
+//  This program is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU General Public License
+//  as published by the Free Software Foundation; either version 2
+//  of the License, or (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//------------------------------------------------------------------------
+
+#include <algorithm>
+
+#include "mapgen.hpp"
+
+#include "raw_def.hpp"
+#include "system.hpp"
+#include "utility.hpp"
+#include "wad.hpp"
+
+using namespace elfbsp;
+
+
+// the maps are kept inside this square, so they fit in the DOOM format
+#define MAP_EXTENT  60000
+
+
+const char *MapGen_StyleName(int style)
+{
+	switch (style)
+	{
+		case MAPGEN_Rooms:   return "rooms";
+		case MAPGEN_Caves:   return "caves";
+		case MAPGEN_Outdoor: return "outdoor";
+		case MAPGEN_Sectors: return "sectors";
+		default: break;
+	}
+
+	return "???";
+}
+
+
+int MapGen_FindStyle(const char *name)
+{
+	for (int i = 0 ; i < NUM_MAPGEN_STYLES ; i++)
+		if (StringCaseCmp(name, MapGen_StyleName(i)) == 0)
+			return i;
+
+	return -1;
+}
+
+
+mapgen_c::mapgen_c(uint32_t seed)
+{
+	Clear(seed);
+}
+
+
+void mapgen_c::Clear(uint32_t seed)
+{
+	vertices.clear();
+	lines.clear();
+	sectors.clear();
+	things.clear();
+
+	vertex_map.clear();
+
+	rand_state = seed ? seed : 1;
+}
+
+
+int mapgen_c::Random(int range)
+{
+	// xorshift32, the same sequence on every platform
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+
+	if (range <= 1)
+		return 0;
+
+	return (int)(rand_state % (uint32_t)range);
+}
+
+
+int mapgen_c::AddVertex(int x, int y)
+{
+	uint64_t key = ((uint64_t)(uint32_t)x << 32) | (uint64_t)(uint32_t)y;
+
+	auto it = vertex_map.find(key);
+
+	if (it != vertex_map.end())
+		return it->second;
+
+	vertex_t V;
+
+	V.x = x;
+	V.y = y;
+
+	vertices.push_back(V);
+
+	int index = (int)vertices.size() - 1;
+
+	vertex_map[key] = index;
+
+	return index;
+}
+
+
+int mapgen_c::AddSector(int floor_h, int ceil_h, int light)
+{
+	sector_t S;
+
+	S.floor_h = floor_h;
+	S.ceil_h  = ceil_h;
+	S.light   = light;
+
+	sectors.push_back(S);
+
+	return (int)sectors.size() - 1;
+}
+
+
+void mapgen_c::AddLine(int v1, int v2, int front, int back)
+{
+	line_t L;
+
+	L.v1 = v1;
+	L.v2 = v2;
+
+	L.front = front;
+	L.back  = back;
+
+	lines.push_back(L);
+}
+
+
+void mapgen_c::AddThing(int x, int y, int type)
+{
+	thing_t T;
+
+	T.x = x;
+	T.y = y;
+	T.type = type;
+
+	things.push_back(T);
+}
+
+
+//------------------------------------------------------------------------
+//  STYLES
+//------------------------------------------------------------------------
+
+
+void mapgen_c::GridLines(const std::vector<int>& cells, int w, int h,
+		const std::vector<int>& cx, const std::vector<int>& cy)
+{
+	auto cell = [&](int x, int y) -> int
+	{
+		if (x < 0 || x >= w || y < 0 || y >= h)
+			return -1;
+
+		return cells[y * w + x];
+	};
+
+	auto corner = [&](int x, int y) -> int
+	{
+		int idx = y * (w + 1) + x;
+
+		return AddVertex(cx[idx], cy[idx]);
+	};
+
+	// vertical edges.  going upwards, the right side is the cell
+	// with the higher x.
+	for (int y = 0 ; y < h ; y++)
+	for (int x = 0 ; x <= w ; x++)
+	{
+		int L = cell(x - 1, y);
+		int R = cell(x, y);
+
+		if (L == R)
+			continue;
+
+		int bottom = corner(x, y);
+		int top    = corner(x, y + 1);
+
+		if (R >= 0)
+			AddLine(bottom, top, R, L);
+		else
+			AddLine(top, bottom, L, -1);
+	}
+
+	// horizontal edges.  going right, the right side is the cell
+	// with the lower y.
+	for (int y = 0 ; y <= h ; y++)
+	for (int x = 0 ; x < w ; x++)
+	{
+		int B = cell(x, y - 1);
+		int A = cell(x, y);
+
+		if (A == B)
+			continue;
+
+		int left  = corner(x, y);
+		int right = corner(x + 1, y);
+
+		if (B >= 0)
+			AddLine(left, right, B, A);
+		else
+			AddLine(right, left, A, -1);
+	}
+}
+
+
+void mapgen_c::Polygon(int mid_x, int mid_y, int radius, int sides, int angle,
+		int inner, int outer)
+{
+	std::vector<int> points;
+
+	// counter-clockwise, so the right side is the outside
+	for (int k = 0 ; k < sides ; k++)
+	{
+		double ang = (angle + k * 360.0 / sides) * M_PI / 180.0;
+
+		int x = mid_x + I_ROUND(radius * cos(ang));
+		int y = mid_y + I_ROUND(radius * sin(ang));
+
+		points.push_back(AddVertex(x, y));
+	}
+
+	for (int k = 0 ; k < sides ; k++)
+	{
+		int v1 = points[k];
+		int v2 = points[(k + 1) % sides];
+
+		AddLine(v1, v2, outer, inner);
+	}
+}
+
+
+void mapgen_c::Rooms(int size)
+{
+	// each room is ROOM x ROOM cells, with a wall of one cell
+	// between neighbouring rooms.  doorways are single cells in
+	// those walls, with their own sector.
+
+	const int ROOM  = 5;
+	const int PITCH = ROOM + 1;
+
+	int w = size * PITCH + 1;
+	int h = w;
+
+	int cs = std::max(8, std::min(64, MAP_EXTENT / w));
+
+	std::vector<int> cells(w * h, -1);
+
+	for (int ry = 0 ; ry < size ; ry++)
+	for (int rx = 0 ; rx < size ; rx++)
+	{
+		int floor_h = Random(8) * 8;
+		int light   = 128 + Random(8) * 16;
+
+		int room = AddSector(floor_h, floor_h + 128 + Random(4) * 32, light);
+
+		int x0 = rx * PITCH + 1;
+		int y0 = ry * PITCH + 1;
+
+		for (int y = 0 ; y < ROOM ; y++)
+		for (int x = 0 ; x < ROOM ; x++)
+			cells[(y0 + y) * w + x0 + x] = room;
+
+		// pillar in the middle
+		if (Random(3) == 0)
+			cells[(y0 + ROOM/2) * w + x0 + ROOM/2] = -1;
+
+		// doorways to the right and above
+		if (rx + 1 < size && Random(4) != 0)
+			cells[(y0 + ROOM/2) * w + x0 + ROOM] = AddSector(floor_h, floor_h + 72, light);
+
+		if (ry + 1 < size && Random(4) != 0)
+			cells[(y0 + ROOM) * w + x0 + ROOM/2] = AddSector(floor_h, floor_h + 72, light);
+
+		int mid_x = (x0 + ROOM/2 - w/2) * cs + cs/2;
+		int mid_y = (y0 + ROOM/2 - h/2) * cs + cs/2;
+
+		AddThing(mid_x + cs, mid_y, (rx == 0 && ry == 0) ? 1 : 3004);
+	}
+
+	std::vector<int> cx((w + 1) * (h + 1));
+	std::vector<int> cy((w + 1) * (h + 1));
+
+	for (int y = 0 ; y <= h ; y++)
+	for (int x = 0 ; x <= w ; x++)
+	{
+		cx[y * (w + 1) + x] = (x - w/2) * cs;
+		cy[y * (w + 1) + x] = (y - h/2) * cs;
+	}
+
+	GridLines(cells, w, h, cx, cy);
+}
+
+
+void mapgen_c::Caves(int size)
+{
+	// rock and open space are decided by a cellular automaton.  the
+	// open cells of each BLOCK x BLOCK area form one sector, and the
+	// corners of the cells are moved randomly, so that nearly every
+	// line is diagonal.
+
+	const int BLOCK = 8;
+
+	int w = std::max(4, size);
+	int h = w;
+
+	int cs = std::max(16, std::min(64, MAP_EXTENT / w));
+
+	std::vector<int> rock(w * h);
+
+	for (int y = 0 ; y < h ; y++)
+	for (int x = 0 ; x < w ; x++)
+	{
+		bool edge = (x == 0 || y == 0 || x == w-1 || y == h-1);
+
+		rock[y * w + x] = (edge || Random(100) < 45) ? 1 : 0;
+	}
+
+	for (int pass = 0 ; pass < 4 ; pass++)
+	{
+		std::vector<int> next(rock);
+
+		for (int y = 1 ; y < h-1 ; y++)
+		for (int x = 1 ; x < w-1 ; x++)
+		{
+			int count = 0;
+
+			for (int dy = -1 ; dy <= 1 ; dy++)
+			for (int dx = -1 ; dx <= 1 ; dx++)
+				count += rock[(y + dy) * w + x + dx];
+
+			next[y * w + x] = (count >= 5) ? 1 : 0;
+		}
+
+		rock.swap(next);
+	}
+
+	int bw = (w + BLOCK - 1) / BLOCK;
+	int bh = (h + BLOCK - 1) / BLOCK;
+
+	std::vector<int> block_sec(bw * bh, -1);
+	std::vector<int> cells(w * h, -1);
+
+	for (int y = 0 ; y < h ; y++)
+	for (int x = 0 ; x < w ; x++)
+	{
+		if (rock[y * w + x])
+			continue;
+
+		int& sec = block_sec[(y / BLOCK) * bw + (x / BLOCK)];
+
+		if (sec < 0)
+		{
+			int floor_h = Random(16) * 4;
+
+			sec = AddSector(floor_h, floor_h + 96 + Random(8) * 16, 96 + Random(8) * 16);
+
+			AddThing((x - w/2) * cs + cs/2, (y - h/2) * cs + cs/2,
+					things.empty() ? 1 : 3001);
+		}
+
+		cells[y * w + x] = sec;
+	}
+
+	int jitter = cs * 3 / 10;
+
+	std::vector<int> cx((w + 1) * (h + 1));
+	std::vector<int> cy((w + 1) * (h + 1));
+
+	for (int y = 0 ; y <= h ; y++)
+	for (int x = 0 ; x <= w ; x++)
+	{
+		cx[y * (w + 1) + x] = (x - w/2) * cs + Random(jitter * 2 + 1) - jitter;
+		cy[y * (w + 1) + x] = (y - h/2) * cs + Random(jitter * 2 + 1) - jitter;
+	}
+
+	GridLines(cells, w, h, cx, cy);
+}
+
+
+void mapgen_c::Outdoor(int size)
+{
+	// one huge sector, full of small rocks (void) and hills (sectors)
+	// in the shape of polygons with random sizes and angles.
+
+	int n = std::max(1, size);
+
+	int spacing = std::max(48, std::min(384, MAP_EXTENT / (n + 1)));
+	int half    = (n + 1) * spacing / 2;
+
+	int ground = AddSector(0, 512, 192);
+
+	// the border, split into lines like the edge of the cells
+	std::vector<int> border;
+
+	for (int k = 0 ; k <= n ; k++) border.push_back(AddVertex(-half, -half + k * spacing));
+	for (int k = 1 ; k <= n ; k++) border.push_back(AddVertex(-half + k * spacing,  half));
+	for (int k = 0 ; k <= n ; k++) border.push_back(AddVertex( half,  half - k * spacing));
+	for (int k = 1 ; k <= n ; k++) border.push_back(AddVertex( half - k * spacing, -half));
+
+	for (size_t k = 0 ; k < border.size() ; k++)
+		AddLine(border[k], border[(k + 1) % border.size()], ground, -1);
+
+	AddThing(-half + spacing / 2, -half + spacing / 2, 1);
+
+	for (int j = 0 ; j < n ; j++)
+	for (int i = 0 ; i < n ; i++)
+	{
+		int shift  = spacing / 8;
+		int mid_x  = -half + (i + 1) * spacing + Random(shift * 2 + 1) - shift;
+		int mid_y  = -half + (j + 1) * spacing + Random(shift * 2 + 1) - shift;
+
+		int radius = spacing / 8 + Random(spacing / 6 + 1);
+		int sides  = 3 + Random(6);
+		int angle  = Random(360);
+
+		if (Random(5) == 0)
+		{
+			int hill = AddSector(16 + Random(4) * 16, 512, 192);
+
+			Polygon(mid_x, mid_y, radius, sides, angle, hill, ground);
+		}
+		else
+		{
+			Polygon(mid_x, mid_y, radius, sides, angle, -1, ground);
+		}
+	}
+}
+
+
+void mapgen_c::Sectors(int size)
+{
+	// every cell is a sector of its own.  a void row and column
+	// every ISLAND cells splits them into islands which cannot see
+	// each other, giving the REJECT builder some work.
+
+	const int ISLAND = 16;
+
+	int w = std::max(2, size);
+	int h = w;
+
+	int cs = std::max(8, std::min(64, MAP_EXTENT / w));
+
+	std::vector<int> cells(w * h, -1);
+
+	for (int y = 0 ; y < h ; y++)
+	for (int x = 0 ; x < w ; x++)
+	{
+		if (x % (ISLAND + 1) == ISLAND || y % (ISLAND + 1) == ISLAND)
+			continue;
+
+		int floor_h = Random(4) * 8;
+
+		cells[y * w + x] = AddSector(floor_h, floor_h + 128, 128 + Random(8) * 16);
+
+		if (x % (ISLAND + 1) == 0 && y % (ISLAND + 1) == 0)
+			AddThing((x - w/2) * cs + cs/2, (y - h/2) * cs + cs/2, things.empty() ? 1 : 2014);
+	}
+
+	std::vector<int> cx((w + 1) * (h + 1));
+	std::vector<int> cy((w + 1) * (h + 1));
+
+	for (int y = 0 ; y <= h ; y++)
+	for (int x = 0 ; x <= w ; x++)
+	{
+		cx[y * (w + 1) + x] = (x - w/2) * cs;
+		cy[y * (w + 1) + x] = (y - h/2) * cs;
+	}
+
+	GridLines(cells, w, h, cx, cy);
+}
+
+
+void mapgen_c::Style(mapgen_style_e style, int size)
+{
+	switch (style)
+	{
+		case MAPGEN_Rooms:   Rooms  (size); break;
+		case MAPGEN_Caves:   Caves  (size); break;
+		case MAPGEN_Outdoor: Outdoor(size); break;
+		case MAPGEN_Sectors: Sectors(size); break;
+		default: break;
+	}
+}
+
+
+void mapgen_c::Generate(mapgen_style_e style, int want_lines)
+{
+	uint32_t seed = rand_state;
+
+	want_lines = std::max(want_lines, 16);
+
+	// the number of lines grows with the square of the size.  start
+	// from a rough guess, then correct it using the result.
+	int size = 4;
+
+	for (int loop = 0 ; loop < 3 ; loop++)
+	{
+		Clear(seed);
+		Style(style, size);
+
+		double ratio = (double)want_lines / (double)std::max((size_t)1, lines.size());
+
+		int new_size = std::max(2, I_ROUND(size * sqrt(ratio)));
+
+		if (new_size == size)
+			break;
+
+		size = new_size;
+
+		if (loop == 2)
+		{
+			Clear(seed);
+			Style(style, size);
+		}
+	}
+}
+
+
+//------------------------------------------------------------------------
+//  WRITING
+//------------------------------------------------------------------------
+
+
+bool mapgen_c::FitsDoom() const
+{
+	size_t num_sides = 0;
+
+	for (size_t i = 0 ; i < lines.size() ; i++)
+	{
+		if (lines[i].front >= 0) num_sides++;
+		if (lines[i].back  >= 0) num_sides++;
+	}
+
+	if (vertices.size() > 65535 || num_sides >= 65535 || sectors.size() > 65535)
+		return false;
+
+	for (size_t i = 0 ; i < vertices.size() ; i++)
+	{
+		if (vertices[i].x < -32768 || vertices[i].x > 32767 ||
+			vertices[i].y < -32768 || vertices[i].y > 32767)
+			return false;
+	}
+
+	return true;
+}
+
+
+static void WriteLump(Wad_file *wad, const char *name, const void *data, size_t len)
+{
+	Lump_c *lump = wad->AddLump(name);
+
+	if (len > 0)
+		lump->Write(data, (int)len);
+
+	lump->Finish();
+}
+
+
+static void CopyTex(char *dest, const char *src)
+{
+	memset(dest, 0, 8);
+	memcpy(dest, src, std::min(strlen(src), (size_t)8));
+}
+
+
+void mapgen_c::WriteDoom(Wad_file *wad, const char *name) const
+{
+	std::vector<raw_thing_t>   raw_things;
+	std::vector<raw_linedef_t> raw_lines;
+	std::vector<raw_sidedef_t> raw_sides;
+	std::vector<raw_vertex_t>  raw_verts;
+	std::vector<raw_sector_t>  raw_secs;
+
+	for (size_t i = 0 ; i < things.size() ; i++)
+	{
+		raw_thing_t T;
+
+		T.x       = LE_S16(things[i].x);
+		T.y       = LE_S16(things[i].y);
+		T.angle   = LE_S16(90);
+		T.type    = LE_U16(things[i].type);
+		T.options = LE_U16(7);
+
+		raw_things.push_back(T);
+	}
+
+	auto add_side = [&](int sector, bool one_sided) -> uint16_t
+	{
+		raw_sidedef_t S;
+
+		S.x_offset = 0;
+		S.y_offset = 0;
+
+		CopyTex(S.upper_tex, one_sided ? "-" : "STARTAN3");
+		CopyTex(S.lower_tex, one_sided ? "-" : "STARTAN3");
+		CopyTex(S.mid_tex,   one_sided ? "STARTAN3" : "-");
+
+		S.sector = LE_U16(sector);
+
+		raw_sides.push_back(S);
+
+		return (uint16_t)(raw_sides.size() - 1);
+	};
+
+	for (size_t i = 0 ; i < lines.size() ; i++)
+	{
+		const line_t& L = lines[i];
+
+		bool one_sided = (L.back < 0);
+
+		raw_linedef_t R;
+
+		R.start   = LE_U16(L.v1);
+		R.end     = LE_U16(L.v2);
+		R.flags   = LE_U16(one_sided ? 1 : 4);
+		R.special = 0;
+		R.tag     = 0;
+		R.right   = LE_U16(add_side(L.front, one_sided));
+		R.left    = LE_U16(one_sided ? 0xFFFF : add_side(L.back, false));
+
+		raw_lines.push_back(R);
+	}
+
+	for (size_t i = 0 ; i < vertices.size() ; i++)
+	{
+		raw_vertex_t V;
+
+		V.x = LE_S16(vertices[i].x);
+		V.y = LE_S16(vertices[i].y);
+
+		raw_verts.push_back(V);
+	}
+
+	for (size_t i = 0 ; i < sectors.size() ; i++)
+	{
+		raw_sector_t S;
+
+		S.floorh = LE_S16(sectors[i].floor_h);
+		S.ceilh  = LE_S16(sectors[i].ceil_h);
+
+		CopyTex(S.floor_tex, "FLOOR4_8");
+		CopyTex(S.ceil_tex,  "CEIL3_5");
+
+		S.light = LE_U16(sectors[i].light);
+		S.type  = 0;
+		S.tag   = 0;
+
+		raw_secs.push_back(S);
+	}
+
+	wad->AddLevel(name)->Finish();
+
+	WriteLump(wad, "THINGS",   raw_things.data(), raw_things.size() * sizeof(raw_thing_t));
+	WriteLump(wad, "LINEDEFS", raw_lines.data(),  raw_lines.size()  * sizeof(raw_linedef_t));
+	WriteLump(wad, "SIDEDEFS", raw_sides.data(),  raw_sides.size()  * sizeof(raw_sidedef_t));
+	WriteLump(wad, "VERTEXES", raw_verts.data(),  raw_verts.size()  * sizeof(raw_vertex_t));
+	WriteLump(wad, "SEGS",     NULL, 0);
+	WriteLump(wad, "SSECTORS", NULL, 0);
+	WriteLump(wad, "NODES",    NULL, 0);
+	WriteLump(wad, "SECTORS",  raw_secs.data(),   raw_secs.size()   * sizeof(raw_sector_t));
+	WriteLump(wad, "REJECT",   NULL, 0);
+	WriteLump(wad, "BLOCKMAP", NULL, 0);
+}
+
+
+std::string mapgen_c::TextMap() const
+{
+	std::string text;
+
+	char buffer[256];
+
+	text += "namespace = \"doom\";\n";
+
+	for (size_t i = 0 ; i < things.size() ; i++)
+	{
+		snprintf(buffer, sizeof(buffer),
+				"thing\n{\nx = %d.000;\ny = %d.000;\nangle = 90;\ntype = %d;\n"
+				"skill1 = true;\nskill2 = true;\nskill3 = true;\nskill4 = true;\nskill5 = true;\n"
+				"single = true;\ncoop = true;\ndm = true;\n}\n\n",
+				things[i].x, things[i].y, things[i].type);
+		text += buffer;
+	}
+
+	for (size_t i = 0 ; i < vertices.size() ; i++)
+	{
+		snprintf(buffer, sizeof(buffer), "vertex\n{\nx = %d.000;\ny = %d.000;\n}\n\n",
+				vertices[i].x, vertices[i].y);
+		text += buffer;
+	}
+
+	int num_sides = 0;
+
+	for (size_t i = 0 ; i < lines.size() ; i++)
+	{
+		const line_t& L = lines[i];
+
+		int front = num_sides++;
+		int back  = (L.back >= 0) ? num_sides++ : -1;
+
+		if (back < 0)
+			snprintf(buffer, sizeof(buffer),
+					"linedef\n{\nv1 = %d;\nv2 = %d;\nsidefront = %d;\nblocking = true;\n}\n\n",
+					L.v1, L.v2, front);
+		else
+			snprintf(buffer, sizeof(buffer),
+					"linedef\n{\nv1 = %d;\nv2 = %d;\nsidefront = %d;\nsideback = %d;\ntwosided = true;\n}\n\n",
+					L.v1, L.v2, front, back);
+		text += buffer;
+	}
+
+	// the sidedefs, in the same order as above
+	for (size_t i = 0 ; i < lines.size() ; i++)
+	{
+		const line_t& L = lines[i];
+
+		if (L.back < 0)
+		{
+			snprintf(buffer, sizeof(buffer), "sidedef\n{\nsector = %d;\ntexturemiddle = \"STARTAN3\";\n}\n\n",
+					L.front);
+			text += buffer;
+		}
+		else
+		{
+			snprintf(buffer, sizeof(buffer), "sidedef\n{\nsector = %d;\n}\n\nsidedef\n{\nsector = %d;\n}\n\n",
+					L.front, L.back);
+			text += buffer;
+		}
+	}
+
+	for (size_t i = 0 ; i < sectors.size() ; i++)
+	{
+		snprintf(buffer, sizeof(buffer),
+				"sector\n{\nheightfloor = %d;\nheightceiling = %d;\ntexturefloor = \"FLOOR4_8\";\n"
+				"textureceiling = \"CEIL3_5\";\nlightlevel = %d;\n}\n\n",
+				sectors[i].floor_h, sectors[i].ceil_h, sectors[i].light);
+		text += buffer;
+	}
+
+	return text;
+}
+
+
+void mapgen_c::WriteUDMF(Wad_file *wad, const char *name) const
+{
+	std::string text = TextMap();
+
+	wad->AddLevel(name)->Finish();
+
+	WriteLump(wad, "TEXTMAP", text.data(), text.size());
+	WriteLump(wad, "ENDMAP",  NULL, 0);
+}
+
+
+//--- editor settings ---
+// vi:ts=4:sw=4:noexpandtab
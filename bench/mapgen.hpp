@@ -0,0 +1,149 @@
+//------------------------------------------------------------------------
+//  Synthetic Map Generator
+//------------------------------------------------------------------------
+//
+//  ELFBSP  Copyright (C) 2025  Guilherme Miranda
+//
+//  This program is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU General Public License
+//  as published by the Free Software Foundation; either version 2
+//  of the License, or (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//------------------------------------------------------------------------
+
+#ifndef __ELFBSP_MAPGEN_H__
+#define __ELFBSP_MAPGEN_H__
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace elfbsp
+{
+class Wad_file;
+}
+
+
+typedef enum
+{
+	// a grid of square rooms, with pillars, joined by doorways
+	MAPGEN_Rooms = 0,
+
+	// caves made by a cellular automaton, every line is diagonal
+	MAPGEN_Caves,
+
+	// a huge open sector, full of small rocks and hills
+	MAPGEN_Outdoor,
+
+	// lots of tiny sectors in isolated islands (stresses REJECT)
+	MAPGEN_Sectors,
+
+	NUM_MAPGEN_STYLES
+}
+mapgen_style_e;
+
+// give the name of a style, like "caves"
+const char *MapGen_StyleName(int style);
+
+// find a style from its name, returns -1 if unknown
+int MapGen_FindStyle(const char *name);
+
+
+class mapgen_c
+{
+	// the objects of a generated map.  sector numbers of -1 mean
+	// the void (outside of the map).
+
+public:
+	struct vertex_t
+	{
+		int x, y;
+	};
+
+	struct line_t
+	{
+		int v1, v2;
+
+		// sector on the right side (front) and left side (back)
+		int front, back;
+	};
+
+	struct sector_t
+	{
+		int floor_h, ceil_h;
+		int light;
+	};
+
+	struct thing_t
+	{
+		int x, y, type;
+	};
+
+	std::vector<vertex_t> vertices;
+	std::vector<line_t>   lines;
+	std::vector<sector_t> sectors;
+	std::vector<thing_t>  things;
+
+private:
+	// for sharing vertices at the same spot
+	std::unordered_map<uint64_t, int> vertex_map;
+
+	uint32_t rand_state;
+
+public:
+	mapgen_c(uint32_t seed = 1);
+
+	void Clear(uint32_t seed = 1);
+
+	// make a map of the given style with about 'want_lines' linedefs.
+	void Generate(mapgen_style_e style, int want_lines);
+
+	// true when the map can be stored in the DOOM format
+	bool FitsDoom() const;
+
+	// write the map into the wad (which must be between BeginWrite()
+	// and EndWrite() calls), using the DOOM or UDMF format.
+	void WriteDoom(elfbsp::Wad_file *wad, const char *name) const;
+	void WriteUDMF(elfbsp::Wad_file *wad, const char *name) const;
+
+	// produce the TEXTMAP lump of the UDMF format
+	std::string TextMap() const;
+
+	int  AddVertex(int x, int y);
+	int  AddSector(int floor_h, int ceil_h, int light);
+	void AddLine(int v1, int v2, int front, int back);
+	void AddThing(int x, int y, int type);
+
+	// a random number in the range 0 .. (range-1)
+	int Random(int range);
+
+private:
+	// the styles, 'size' controls the number of lines
+	void Rooms  (int size);
+	void Caves  (int size);
+	void Outdoor(int size);
+	void Sectors(int size);
+
+	void Style(mapgen_style_e style, int size);
+
+	// add the lines between the cells of a grid, where each cell is
+	// a sector number (or -1).  'cx' and 'cy' give the corners of
+	// the cells, which need not be straight.
+	void GridLines(const std::vector<int>& cells, int w, int h,
+			const std::vector<int>& cx, const std::vector<int>& cy);
+
+	// add a polygon, its inside is 'inner' and the outside is 'outer'.
+	void Polygon(int mid_x, int mid_y, int radius, int sides, int angle,
+			int inner, int outer);
+};
+
+#endif  /* __ELFBSP_MAPGEN_H__ */
+
+//--- editor settings ---
+// vi:ts=4:sw=4:noexpandtab
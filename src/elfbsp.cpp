@@ -18,19 +18,28 @@
 //------------------------------------------------------------------------
 
 #include <cstdarg>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include "elfbsp.hpp"
 #include "system.hpp"
 #include "utility.hpp"
+#include "zip.hpp"
+
+#ifdef WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
 bool opt_backup   = false;
 bool opt_help     = false;
 bool opt_doc      = false;
 bool opt_version  = false;
+bool opt_stats    = false;
 
 std::string opt_output;
+std::string opt_stats_json;
 
 std::vector< const char * > wad_list;
 
@@ -48,18 +57,45 @@ struct map_range_t
 std::vector< map_range_t > map_list;
 
 
+// statistics of each built level, for --stats and --stats-json
+
+struct level_record_t
+{
+	std::string name;
+	build_result_e result;
+	level_stats_t stats;
+};
+
+struct file_record_t
+{
+	std::string filename;
+	std::vector< level_record_t > levels;
+	level_stats_t total;
+};
+
+std::vector< file_record_t > stats_files;
+
+
 // this is > 0 when ShowMap() is used and the current line
 // has not been terminated with a new-line ('\n') character.
 int hanging_pos;
 
+// where messages go.  this becomes stderr when the wad itself is
+// written to stdout (see StreamFile).
+FILE *msg_fp = stdout;
+
+// levels may be built by several threads (see --jobs), this keeps
+// their messages from getting mixed up.
+std::mutex print_lock;
+
 void StopHanging()
 {
 	if (hanging_pos > 0)
 	{
 		hanging_pos = 0;
 
-		printf("\n");
-		fflush(stdout);
+		fprintf(msg_fp, "\n");
+		fflush(msg_fp);
 	}
 }
 
@@ -71,7 +107,7 @@ public:
 	{
 		va_list arg_ptr;
 
-		static char buffer[MSG_BUF_LEN];
+		static thread_local char buffer[MSG_BUF_LEN];
 
 		va_start(arg_ptr, fmt);
 		vsnprintf(buffer, MSG_BUF_LEN-1, fmt, arg_ptr);
@@ -79,10 +115,12 @@ public:
 
 		buffer[MSG_BUF_LEN-1] = 0;
 
+		std::lock_guard<std::mutex> guard(print_lock);
+
 		StopHanging();
 
-		printf("%s", buffer);
-		fflush(stdout);
+		fprintf(msg_fp, "%s", buffer);
+		fflush(msg_fp);
 	}
 
 	void Print_Verbose(const char *fmt, ...)
@@ -92,7 +130,7 @@ public:
 
 		va_list arg_ptr;
 
-		static char buffer[MSG_BUF_LEN];
+		static thread_local char buffer[MSG_BUF_LEN];
 
 		va_start(arg_ptr, fmt);
 		vsnprintf(buffer, MSG_BUF_LEN-1, fmt, arg_ptr);
@@ -100,15 +138,17 @@ public:
 
 		buffer[MSG_BUF_LEN-1] = 0;
 
+		std::lock_guard<std::mutex> guard(print_lock);
+
 		StopHanging();
 
-		printf("%s", buffer);
-		fflush(stdout);
+		fprintf(msg_fp, "%s", buffer);
+		fflush(msg_fp);
 	}
 
 	void Debug(const char *fmt, ...)
 	{
-		static char buffer[MSG_BUF_LEN];
+		static thread_local char buffer[MSG_BUF_LEN];
 
 		va_list args;
 
@@ -129,11 +169,13 @@ public:
 
 		// display the map names across the terminal
 
+		std::lock_guard<std::mutex> guard(print_lock);
+
 		if (hanging_pos >= 68)
 			StopHanging();
 
-		printf("  %s", name);
-		fflush(stdout);
+		fprintf(msg_fp, "  %s", name);
+		fflush(msg_fp);
 
 		hanging_pos += strlen(name) + 2;
 	}
@@ -145,7 +187,7 @@ public:
 	{
 		va_list arg_ptr;
 
-		static char buffer[MSG_BUF_LEN];
+		static thread_local char buffer[MSG_BUF_LEN];
 
 		va_start(arg_ptr, fmt);
 		vsnprintf(buffer, MSG_BUF_LEN-1, fmt, arg_ptr);
@@ -202,6 +244,169 @@ bool CheckMapInMaplist(int lev_idx)
 }
 
 
+//------------------------------------------------------------------------
+
+
+bool WantStats()
+{
+	return opt_stats || opt_stats_json.size() > 0;
+}
+
+
+void PrintStats(const level_stats_t *stats)
+{
+	double total_wall = 0;
+	double total_cpu  = 0;
+
+	config.Print("    %-12s %9s %9s\n", "phase", "wall", "cpu");
+
+	for (int i = 0 ; i < NUM_STAT_PHASES ; i++)
+	{
+		config.Print("    %-12s %9.3f %9.3f\n", elfbsp::StatPhaseName(i),
+				stats->wall[i], stats->cpu[i]);
+
+		total_wall += stats->wall[i];
+		total_cpu  += stats->cpu [i];
+	}
+
+	config.Print("    %-12s %9.3f %9.3f\n", "total", total_wall, total_cpu);
+
+	double early = 0;
+	if (stats->eval_calls > 0)
+		early = 100.0 * (double)stats->eval_early / (double)stats->eval_calls;
+
+	config.Print("    EvalPartition calls: %lld, early-outs: %lld (%1.1f%%)\n",
+			stats->eval_calls, stats->eval_early, early);
+
+	config.Print("    Seg splits: %lld, minisegs: %lld\n",
+			stats->seg_splits, stats->minisegs);
+
+	if (stats->peak_memory > 0)
+		config.Print("    Peak memory: %1.1f MB\n", (double)stats->peak_memory / 1048576.0);
+}
+
+
+void WriteJSONString(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+
+	for ( ; *str ; str++)
+	{
+		unsigned char ch = (unsigned char) *str;
+
+		if (ch == '"' || ch == '\\')
+			fprintf(fp, "\\%c", ch);
+		else if (ch < 32)
+			fprintf(fp, "\\u%04x", ch);
+		else
+			fputc(ch, fp);
+	}
+
+	fputc('"', fp);
+}
+
+
+void WriteJSONStats(FILE *fp, const level_stats_t *stats, const char *indent)
+{
+	double total_wall = 0;
+	double total_cpu  = 0;
+
+	fprintf(fp, "%s\"phases\": {\n", indent);
+
+	for (int i = 0 ; i < NUM_STAT_PHASES ; i++)
+	{
+		fprintf(fp, "%s  \"%s\": { \"wall\": %1.6f, \"cpu\": %1.6f }%s\n", indent,
+				elfbsp::StatPhaseName(i), stats->wall[i], stats->cpu[i],
+				(i+1 < NUM_STAT_PHASES) ? "," : "");
+
+		total_wall += stats->wall[i];
+		total_cpu  += stats->cpu [i];
+	}
+
+	fprintf(fp, "%s},\n", indent);
+	fprintf(fp, "%s\"total\": { \"wall\": %1.6f, \"cpu\": %1.6f },\n", indent, total_wall, total_cpu);
+
+	fprintf(fp, "%s\"eval_calls\": %lld,\n",  indent, stats->eval_calls);
+	fprintf(fp, "%s\"eval_early\": %lld,\n",  indent, stats->eval_early);
+	fprintf(fp, "%s\"seg_splits\": %lld,\n",  indent, stats->seg_splits);
+	fprintf(fp, "%s\"minisegs\": %lld,\n",    indent, stats->minisegs);
+	fprintf(fp, "%s\"nodes\": %d,\n",         indent, stats->nodes);
+	fprintf(fp, "%s\"subsecs\": %d,\n",       indent, stats->subsecs);
+	fprintf(fp, "%s\"segs\": %d,\n",          indent, stats->segs);
+	fprintf(fp, "%s\"vertices\": %d,\n",      indent, stats->vertices);
+	fprintf(fp, "%s\"peak_memory\": %lld\n",  indent, stats->peak_memory);
+}
+
+
+const char *ResultName(build_result_e res)
+{
+	switch (res)
+	{
+		case BUILD_OK:           return "ok";
+		case BUILD_Cancelled:    return "cancelled";
+		case BUILD_LumpOverflow: return "overflow";
+		default: break;
+	}
+
+	return "???";
+}
+
+
+void WriteStatsFile(const char *filename)
+{
+	FILE *fp = fopen(filename, "w");
+
+	if (fp == NULL)
+		config.FatalError("cannot create stats file: %s\n", filename);
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"files\": [\n");
+
+	for (size_t f = 0 ; f < stats_files.size() ; f++)
+	{
+		const file_record_t& file = stats_files[f];
+
+		fprintf(fp, "    {\n");
+		fprintf(fp, "      \"file\": ");
+		WriteJSONString(fp, file.filename.c_str());
+		fprintf(fp, ",\n");
+		fprintf(fp, "      \"levels\": [\n");
+
+		for (size_t k = 0 ; k < file.levels.size() ; k++)
+		{
+			const level_record_t& lev = file.levels[k];
+
+			fprintf(fp, "        {\n");
+			fprintf(fp, "          \"name\": ");
+			WriteJSONString(fp, lev.name.c_str());
+			fprintf(fp, ",\n");
+			fprintf(fp, "          \"result\": \"%s\",\n", ResultName(lev.result));
+
+			WriteJSONStats(fp, &lev.stats, "          ");
+
+			fprintf(fp, "        }%s\n", (k+1 < file.levels.size()) ? "," : "");
+		}
+
+		fprintf(fp, "      ],\n");
+		fprintf(fp, "      \"totals\": {\n");
+
+		WriteJSONStats(fp, &file.total, "        ");
+
+		fprintf(fp, "      }\n");
+		fprintf(fp, "    }%s\n", (f+1 < stats_files.size()) ? "," : "");
+	}
+
+	fprintf(fp, "  ]\n");
+	fprintf(fp, "}\n");
+
+	if (ferror(fp) != 0 || fclose(fp) != 0)
+		config.FatalError("failed to write stats file: %s\n", filename);
+}
+
+
+//------------------------------------------------------------------------
+
+
 build_result_e BuildFile()
 {
 	config.total_warnings = 0;
@@ -216,23 +421,64 @@ build_result_e BuildFile()
 		return BUILD_OK;
 	}
 
-	int visited  = 0;
+	std::vector<int> lev_list;
+
+	for (int n = 0 ; n < num_levels ; n++)
+	{
+		if (CheckMapInMaplist(n))
+			lev_list.push_back(n);
+	}
+
+	int visited  = (int)lev_list.size();
 	int failures = 0;
 
 	build_result_e res = BUILD_OK;
 
+	// with --jobs, all the levels are built up-front
+	bool parallel = (config.jobs != 1 && visited > 1);
+
+	std::vector<build_result_e> results(lev_list.size(), BUILD_OK);
+	std::vector<level_stats_t>  stats  (lev_list.size());
+
+	if (parallel)
+	{
+		elfbsp::BuildLevels(lev_list.data(), results.data(), visited, stats.data());
+	}
+
 	// loop over each level in the wad
-	for (int n = 0 ; n < num_levels ; n++)
+	for (int k = 0 ; k < visited ; k++)
 	{
-		if (! CheckMapInMaplist(n))
-			continue;
+		int n = lev_list[k];
 
-		visited += 1;
+		if (parallel)
+		{
+			res = results[k];
+		}
+		else
+		{
+			if (n > 0)
+				config.Print_Verbose("\n");
 
-		if (n > 0)
-			config.Print_Verbose("\n");
+			res = elfbsp::BuildLevel(n, &stats[k]);
+		}
 
-		res = elfbsp::BuildLevel(n);
+		if (WantStats())
+		{
+			level_record_t record;
+
+			record.name   = elfbsp::GetLevelName(n);
+			record.result = res;
+			record.stats  = stats[k];
+
+			stats_files.back().levels.push_back(record);
+			stats_files.back().total.Add(stats[k]);
+
+			if (opt_stats)
+			{
+				config.Print("  Stats for %s:\n", record.name.c_str());
+				PrintStats(&stats[k]);
+			}
+		}
 
 		// handle a failed map (due to lump overflow)
 		if (res == BUILD_LumpOverflow)
@@ -282,6 +528,12 @@ build_result_e BuildFile()
 		config.Print("  Minor issues: %d\n", config.total_minor_issues);
 	}
 
+	if (opt_stats && visited > 1)
+	{
+		config.Print("  Stats for all maps:\n");
+		PrintStats(&stats_files.back().total);
+	}
+
 	return BUILD_OK;
 }
 
@@ -294,18 +546,14 @@ void ValidateInputFilename(const char *filename)
 	if (elfbsp::MatchExtension(filename, "bak"))
 		config.FatalError("cannot process a backup file: %s\n", filename);
 
-	// we do not support packages
+	// we only support packages which are ZIP files
 	if (elfbsp::MatchExtension(filename, "pak") ||
 		elfbsp::MatchExtension(filename, "pk2") ||
-		elfbsp::MatchExtension(filename, "pk3") ||
-		elfbsp::MatchExtension(filename, "pk4") ||
 		elfbsp::MatchExtension(filename, "pk7") ||
-		elfbsp::MatchExtension(filename, "epk") ||
 		elfbsp::MatchExtension(filename, "pack") ||
-		elfbsp::MatchExtension(filename, "zip") ||
 		elfbsp::MatchExtension(filename, "rar"))
 	{
-		config.FatalError("package files (like PK3) are not supported: %s\n", filename);
+		config.FatalError("package files (other than PK3/ZIP) are not supported: %s\n", filename);
 	}
 
 	// reject some very common formats
@@ -348,8 +596,175 @@ void BackupFile(const char *filename)
 }
 
 
+bool IsPackage(const char *filename)
+{
+	return  elfbsp::MatchExtension(filename, "pk3") ||
+			elfbsp::MatchExtension(filename, "pk4") ||
+			elfbsp::MatchExtension(filename, "epk") ||
+			elfbsp::MatchExtension(filename, "zip");
+}
+
+
+//
+// only the wads directly in the "maps" folder are built, like the
+// ones a source port loads as levels.
+//
+bool IsMapWadEntry(const char *name)
+{
+	if (elfbsp::StringCaseCmpMax(name, "maps/", 5) != 0)
+		return false;
+
+	if (strchr(name + 5, '/') != NULL)
+		return false;
+
+	return elfbsp::MatchExtension(name + 5, "wad");
+}
+
+
+void VisitPackage(const char *filename)
+{
+	elfbsp::Zip_file *zip = elfbsp::Zip_file::Open(filename);
+	if (zip == NULL)
+		config.FatalError("cannot open package (or not a ZIP file): %s\n", filename);
+
+	int num_wads = 0;
+
+	for (int i = 0 ; i < zip->NumEntries() ; i++)
+	{
+		const char *name = zip->EntryName(i);
+
+		if (! IsMapWadEntry(name))
+			continue;
+
+		std::string full_name = std::string(filename) + ":" + name;
+
+		std::vector<uint8_t> data;
+
+		if (! zip->ReadEntry(i, data))
+			config.FatalError("failed to read from package: %s\n", full_name.c_str());
+
+		// silently skip anything which is not really a wad
+		if (data.size() < 12 || memcmp(&data[1], "WAD", 3) != 0)
+			continue;
+
+		num_wads += 1;
+
+		config.Print("\n");
+		config.Print("Building %s\n", full_name.c_str());
+
+		std::vector<uint8_t> original(data);
+
+		// this will fatal error if it fails
+		elfbsp::OpenWadMemory(full_name.c_str(), &data);
+
+		if (WantStats())
+		{
+			stats_files.push_back(file_record_t());
+			stats_files.back().filename = full_name;
+		}
+
+		build_result_e res = BuildFile();
+
+		elfbsp::CloseWad();
+
+		if (res == BUILD_Cancelled)
+			config.FatalError("CANCELLED\n");
+
+		if (data != original)
+			zip->ReplaceEntry(i, data);
+	}
+
+	// this writes the changed wads into the package
+	zip->Commit();
+
+	delete zip;
+
+	if (num_wads == 0)
+	{
+		config.Print("\n");
+		config.Print("  No map wads in package: %s\n", filename);
+		total_empty_files += 1;
+	}
+}
+
+
+bool IsStdin(const char *filename)
+{
+	return strcmp(filename, "-") == 0;
+}
+
+
+//
+// with "-" as the input file, the wad is read from stdin, and with
+// "-o -" it is written to stdout (the default for stdin).  either
+// way the wad is built in memory and the input file (if any) is not
+// touched.
+//
+void StreamFile(const char *filename)
+{
+	bool from_stdin = IsStdin(filename);
+	bool to_stdout  = (opt_output.empty() || opt_output == "-");
+
+	const char *name = from_stdin ? "<stdin>" : filename;
+
+	FILE *in = from_stdin ? stdin : fopen(filename, "rb");
+	if (in == NULL)
+		config.FatalError("cannot open file: %s\n", filename);
+
+	std::vector<uint8_t> data;
+
+	bool loaded = elfbsp::FileLoad(in, data);
+
+	if (! from_stdin)
+		fclose(in);
+
+	if (! loaded)
+		config.FatalError("failed to read input file: %s\n", name);
+
+	config.Print("\n");
+	config.Print("Building %s\n", name);
+
+	// this will fatal error if it fails
+	elfbsp::OpenWadMemory(name, &data);
+
+	if (WantStats())
+	{
+		stats_files.push_back(file_record_t());
+		stats_files.back().filename = name;
+	}
+
+	build_result_e res = BuildFile();
+
+	elfbsp::CloseWad();
+
+	if (res == BUILD_Cancelled)
+		config.FatalError("CANCELLED\n");
+
+	FILE *out = to_stdout ? stdout : fopen(opt_output.c_str(), "wb");
+	if (out == NULL)
+		config.FatalError("failed to create output file: %s\n", opt_output.c_str());
+
+	bool written = data.empty() || (fwrite(data.data(), data.size(), 1, out) == 1);
+
+	if (fflush(out) != 0)
+		written = false;
+
+	if (! to_stdout && fclose(out) != 0)
+		written = false;
+
+	if (! written)
+		config.FatalError("failed to write output file: %s\n", to_stdout ? "<stdout>" : opt_output.c_str());
+}
+
+
 void VisitFile(unsigned int idx, const char *filename)
 {
+	if (IsStdin(filename) || opt_output == "-")
+	{
+		StreamFile(filename);
+		return;
+	}
+
 	// handle the -o option
 	if (opt_output.size() > 0)
 	{
@@ -364,12 +779,24 @@ void VisitFile(unsigned int idx, const char *filename)
 	if (opt_backup)
 		BackupFile(filename);
 
+	if (IsPackage(filename))
+	{
+		VisitPackage(filename);
+		return;
+	}
+
 	config.Print("\n");
 	config.Print("Building %s\n", filename);
 
 	// this will fatal error if it fails
 	elfbsp::OpenWad(filename);
 
+	if (WantStats())
+	{
+		stats_files.push_back(file_record_t());
+		stats_files.back().filename = filename;
+	}
+
 	build_result_e res = BuildFile();
 
 	elfbsp::CloseWad();
@@ -406,11 +833,11 @@ void ShowVersion()
 
 void ShowBanner()
 {
-	printf("+---------------------------------------------------+\n");
-	printf("|   ELFBSP %s (C) 2025 Guilherme Miranda, et al   |\n", PROJECT_VERSION);
-	printf("+---------------------------------------------------+\n");
+	fprintf(msg_fp, "+---------------------------------------------------+\n");
+	fprintf(msg_fp, "|   ELFBSP %s (C) 2025 Guilherme Miranda, et al   |\n", PROJECT_VERSION);
+	fprintf(msg_fp, "+---------------------------------------------------+\n");
 
-	fflush(stdout);
+	fflush(msg_fp);
 }
 
 
@@ -534,7 +961,6 @@ void ParseShortArgument(const char *arg)
 
 			case 'm':
 			case 'o':
-			case 't':
 				config.FatalError("cannot use option '-%c' like that\n", c);
 				return;
 
@@ -558,6 +984,46 @@ void ParseShortArgument(const char *arg)
 				config.split_cost = val;
 				continue;
 
+			case 'j':
+				if (*arg == 0 || ! isdigit(*arg))
+					config.FatalError("missing value for '-j' option\n");
+
+				// we only accept up to three digits here
+				val = *arg - '0';
+				arg++;
+
+				for (int k = 0 ; k < 2 && *arg && isdigit(*arg) ; k++)
+				{
+					val = (val * 10) + (*arg - '0');
+					arg++;
+				}
+
+				if (val > JOBS_MAX)
+					config.FatalError("illegal value for '-j' option\n");
+
+				config.jobs = val;
+				continue;
+
+			case 't':
+				if (*arg == 0 || ! isdigit(*arg))
+					config.FatalError("missing value for '-t' option\n");
+
+				// we only accept up to three digits here
+				val = *arg - '0';
+				arg++;
+
+				for (int k = 0 ; k < 2 && *arg && isdigit(*arg) ; k++)
+				{
+					val = (val * 10) + (*arg - '0');
+					arg++;
+				}
+
+				if (val > JOBS_MAX)
+					config.FatalError("illegal value for '-t' option\n");
+
+				config.threads = val;
+				continue;
+
 			default:
 				if (isprint(c) && !isspace(c))
 					config.FatalError("unknown short option: '-%c'\n", c);
@@ -627,11 +1093,71 @@ int ParseLongArgument(const char *name, int argc, char *argv[])
 		config.split_cost = val;
 		used = 1;
 	}
+	else if (strcmp(name, "--jobs") == 0)
+	{
+		if (argc < 1 || ! isdigit(argv[0][0]))
+			config.FatalError("missing value for '--jobs' option\n");
+
+		int val = atoi(argv[0]);
+
+		if (val > JOBS_MAX)
+			config.FatalError("illegal value for '--jobs' option\n");
+
+		config.jobs = val;
+		used = 1;
+	}
+	else if (strcmp(name, "--threads") == 0)
+	{
+		if (argc < 1 || ! isdigit(argv[0][0]))
+			config.FatalError("missing value for '--threads' option\n");
+
+		int val = atoi(argv[0]);
+
+		if (val > JOBS_MAX)
+			config.FatalError("illegal value for '--threads' option\n");
+
+		config.threads = val;
+		used = 1;
+	}
+	else if (strcmp(name, "--compact") == 0)
+	{
+		config.compact = true;
+	}
+	else if (strcmp(name, "--blockmap-pack") == 0)
+	{
+		config.blockmap_pack = true;
+	}
+	else if (strcmp(name, "--blockmap-nozero") == 0)
+	{
+		config.blockmap_pack = true;
+		config.blockmap_nozero = true;
+	}
+	else if (strcmp(name, "--blockmap-search") == 0)
+	{
+		config.blockmap_search = BMSEARCH_Size;
+	}
+	else if (strcmp(name, "--blockmap-search-lines") == 0)
+	{
+		config.blockmap_search = BMSEARCH_Lines;
+	}
+	else if (strcmp(name, "--stats") == 0)
+	{
+		opt_stats = true;
+	}
+	else if (strcmp(name, "--stats-json") == 0)
+	{
+		if (argc < 1 || argv[0][0] == '-')
+			config.FatalError("missing value for '--stats-json' option\n");
+
+		opt_stats_json = argv[0];
+		used = 1;
+	}
 	else if (strcmp(name, "--output") == 0)
 	{
 		// this option is *only* for compatibility
 
-		if (argc < 1 || argv[0][0] == '-')
+		// "-" means stdout
+		if (argc < 1 || (argv[0][0] == '-' && argv[0][1] != 0))
 			config.FatalError("missing value for '--output' option\n");
 
 		if (opt_output.size() > 0)
@@ -678,8 +1204,12 @@ void ParseCommandLine(int argc, char *argv[])
 			continue;
 		}
 
+		// read the wad from stdin
 		if (strcmp(arg, "-") == 0)
-			config.FatalError("illegal option '-'\n");
+		{
+			wad_list.push_back(arg);
+			continue;
+		}
 
 		if (strcmp(arg, "--") == 0)
 		{
@@ -689,6 +1219,8 @@ void ParseCommandLine(int argc, char *argv[])
 
 		// handle short args which are isolate and require a value
 		if (strcmp(arg, "-c") == 0) arg = "--cost";
+		if (strcmp(arg, "-j") == 0) arg = "--jobs";
+		if (strcmp(arg, "-t") == 0) arg = "--threads";
 		if (strcmp(arg, "-m") == 0) arg = "--map";
 		if (strcmp(arg, "-o") == 0) arg = "--output";
 
@@ -752,10 +1284,34 @@ int main(int argc, char *argv[])
 		if (total_files > 1)
 			config.FatalError("cannot use multiple input files with --output\n");
 
-		if (elfbsp::StringCaseCmp(wad_list[0], opt_output.c_str()) == 0)
+		if (elfbsp::StringCaseCmp(wad_list[0], opt_output.c_str()) == 0 && opt_output != "-")
 			config.FatalError("input and output files are the same\n");
 	}
 
+	bool use_stdin = false;
+
+	for (int i = 0 ; i < total_files ; i++)
+		if (IsStdin(wad_list[i]))
+			use_stdin = true;
+
+	if (use_stdin)
+	{
+		if (opt_backup)
+			config.FatalError("cannot use --backup with standard input\n");
+
+		if (total_files > 1)
+			config.FatalError("cannot use multiple input files with standard input\n");
+	}
+
+	// keep stdout for the wad itself
+	if (opt_output == "-" || (use_stdin && opt_output.empty()))
+		msg_fp = stderr;
+
+#ifdef WIN32
+	_setmode(_fileno(stdin),  _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
 	ShowBanner();
 
 	// validate all filenames before processing any of them
@@ -763,8 +1319,14 @@ int main(int argc, char *argv[])
 	{
 		const char *filename = wad_list[i];
 
+		if (IsStdin(filename))
+			continue;
+
 		ValidateInputFilename(filename);
 
+		if (opt_output == "-" && IsPackage(filename))
+			config.FatalError("cannot write a package to standard output: %s\n", filename);
+
 		if (! elfbsp::FileExists(filename))
 			config.FatalError("no such file: %s\n", filename);
 	}
@@ -774,6 +1336,9 @@ int main(int argc, char *argv[])
 		VisitFile(i, wad_list[i]);
 	}
 
+	if (opt_stats_json.size() > 0)
+		WriteStatsFile(opt_stats_json.c_str());
+
 	config.Print("\n");
 
 	if (total_failed_files > 0)
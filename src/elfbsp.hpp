@@ -22,6 +22,9 @@
 #ifndef __ELFBSP_BSP_H__
 #define __ELFBSP_BSP_H__
 
+#include <cstdint>
+#include <vector>
+
 //
 // Node Build Information Structure
 //
@@ -30,6 +33,16 @@
 #define SPLIT_COST_DEFAULT  11
 #define SPLIT_COST_MAX      32
 
+#define JOBS_MAX  256
+
+typedef enum
+{
+	BMSEARCH_Off = 0,   // use the normal blockmap origin
+	BMSEARCH_Size,      // find the origin giving the smallest lump
+	BMSEARCH_Lines      // find the origin giving the fewest lines per block
+}
+blockmap_search_e;
+
 class buildinfo_t
 {
 public:
@@ -47,9 +60,27 @@ public:
 
 	int split_cost;
 
+	// number of levels to build at the same time (0 = one per CPU)
+	int jobs;
+
+	// number of threads building the nodes of a level (0 = one per CPU)
+	int threads;
+
 	// this affects how some messages are shown
 	bool verbose;
 
+	// write a fresh, compacted wad instead of updating it in place
+	bool compact;
+
+	// when the blockmap overflows, pack its line lists more tightly
+	// (sharing the tails of lists), and perhaps without the zero
+	// which begins every list.
+	bool blockmap_pack;
+	bool blockmap_nozero;
+
+	// try other origins for the blockmap (a blockmap_search_e value)
+	int blockmap_search;
+
 	// from here on, various bits of internal state
 	int total_warnings;
 	int total_minor_issues;
@@ -66,7 +97,13 @@ public:
 		cancelled(false),
 
 		split_cost(SPLIT_COST_DEFAULT),
+		jobs(1),
+		threads(1),
 		verbose(false),
+		compact(false),
+		blockmap_pack(false),
+		blockmap_nozero(false),
+		blockmap_search(BMSEARCH_Off),
 
 		total_warnings(0),
 		total_minor_issues(0)
@@ -97,10 +134,25 @@ constexpr const char PRINT_HELP[] =
 	"    -f --fast          Faster partition selection\n"
 	"    -m --map   XXXX    Control which map(s) are built\n"
 	"    -c --cost  ##      Cost assigned to seg splits (1-32)\n"
+	"    -j --jobs  ##      Number of levels to build at once\n"
+	"    -t --threads ##    Number of threads for each level\n"
 	"\n"
 	"    -x --xnod          Use XNOD format in NODES lump\n"
 	"    -s --ssect         Use XGL3 format in SSECTORS lump\n"
 	"\n"
+	"    --compact          Rewrite the whole wad without any gaps\n"
+	"    --blockmap-pack    Pack the blockmap tighter when it overflows\n"
+	"    --blockmap-nozero  Also drop the zero beginning each list\n"
+	"    --blockmap-search  Move the blockmap grid for the smallest lump\n"
+	"    --blockmap-search-lines\n"
+	"                       Or for the fewest lines in any block\n"
+	"    --stats            Show the timing and counters of each map\n"
+	"    --stats-json FILE  Write the timing and counters to a file\n"
+	"\n"
+	"A FILE of - reads the wad from stdin, -o - writes to stdout\n"
+	"Packages (PK3 or ZIP) are accepted too, the wads in their\n"
+	"maps folder are built and written back into them\n"
+	"\n"
 	"Short options may be mixed, for example: -fbv\n"
 	"Long options must always begin with a double hyphen\n"
 	"\n"
@@ -169,6 +221,89 @@ constexpr const char PRINT_DOC[] =
 	"NOTE: this option has little effect when the --fast\n"
 	"option is enabled.\n"
 	"\n"
+	"`-j --jobs  ##`\n"
+	"Sets how many levels of a wad are built at the same time,\n"
+	"each one in its own thread.  A value of 0 uses one thread\n"
+	"per CPU.  The default value is 1 (no threading).\n"
+	"Only writing the finished lumps into the wad is done\n"
+	"one level at a time, in the order of the wad.\n"
+	"The output is identical whatever value is used, but\n"
+	"the verbose messages of different levels may be mixed.\n"
+	"\n"
+	"`-t --threads  ##`\n"
+	"Sets how many threads are used to build the nodes of each\n"
+	"level.  The two halves of the large nodes are built at the\n"
+	"same time by different threads, and the possible partition\n"
+	"lines of large nodes are evaluated by all the threads.\n"
+	"A value of 0 uses one thread per CPU.  The default value\n"
+	"is 1 (no threading).\n"
+	"\n"
+	"NOTE: splits of the segs lying on the partition line of a\n"
+	"large node are not passed to the other half until both\n"
+	"halves are done, so the nodes can differ slightly from a\n"
+	"build with one thread.  They are the same for any number\n"
+	"of threads above one.\n"
+	"\n"
+	"`--compact`\n"
+	"Writes each wad file anew, with every lump in directory\n"
+	"order and no gaps between them, then replaces the original\n"
+	"file with it.  Without this option, the new lumps are written\n"
+	"into the existing file, reusing any unused space in it, and\n"
+	"the file never shrinks.  With this option, the original file\n"
+	"is left untouched until every map has been built.\n"
+	"\n"
+	"`--blockmap-pack`\n"
+	"When the BLOCKMAP of a map is too big for the 16-bit offsets\n"
+	"it uses, normally the lump is left empty and the engine has to\n"
+	"build its own blockmap each time the map is loaded.  With this\n"
+	"option the line lists are packed more tightly instead: when the\n"
+	"lines of one block are all in another block, they are put at\n"
+	"the end of that block's list and both blocks share them.  Maps\n"
+	"which fit without packing are not affected.\n"
+	"\n"
+	"NOTE: a packed blockmap checks the lines of a block in a\n"
+	"different order, which may break the sync of old demos.  Ports\n"
+	"which skip the zero at the start of each list will see line 0\n"
+	"in some extra blocks, which is harmless.\n"
+	"\n"
+	"`--blockmap-nozero`\n"
+	"Like --blockmap-pack, but the packed lists also leave out the\n"
+	"zero which normally begins every list, saving more space.\n"
+	"Only use this for ports which read the whole list, like the\n"
+	"original DOOM engine does, since ports skipping the first\n"
+	"entry of each list would miss a line in every block.\n"
+	"\n"
+	"`--blockmap-search`\n"
+	"Normally the blockmap grid begins at the bottom left corner of\n"
+	"the map, rounded down to a multiple of 8.  Moving the grid\n"
+	"changes how many lines cross the edges of the blocks, hence\n"
+	"the size of the BLOCKMAP lump.  With this option 64 positions\n"
+	"of the grid (moved down and left by 0 to 112 units, in steps\n"
+	"of 16) are tried, using the threads of the --threads option,\n"
+	"and the one giving the smallest lump is kept.  A blockmap which\n"
+	"overflows is never kept when another position fits.\n"
+	"\n"
+	"`--blockmap-search-lines`\n"
+	"Like --blockmap-search, but keeps the position where the block\n"
+	"with the most lines has the fewest, which makes the slowest\n"
+	"collision checks in the game faster.  Ties are broken by the\n"
+	"size of the lump.\n"
+	"\n"
+	"`--stats`\n"
+	"Shows statistics after building each map: the time taken by\n"
+	"each phase (loading, nodes, blockmap, reject, etc), how many\n"
+	"partition lines were evaluated, the number of seg splits and\n"
+	"minisegs, and the peak memory use.  Totals are shown for each\n"
+	"file with several maps.\n"
+	"\n"
+	"NOTE: the CPU time includes the extra threads of the --threads\n"
+	"option, so it can be more than the wall-clock time.\n"
+	"\n"
+	"`--stats-json  FILE`\n"
+	"Writes the same statistics as --stats into the given file,\n"
+	"in JSON format, with an entry for each map and the totals\n"
+	"of each input file.\n"
+	"\n"
 	"`-o --output  FILE`\n"
 	"This option is provided *only* for compatibility with\n"
 	"existing node builders.  It causes the input file to be\n"
@@ -176,6 +311,28 @@ constexpr const char PRINT_DOC[] =
 	"processed.  This option *cannot* be used with multiple\n"
 	"input files, or with the --backup option.\n"
 	"\n"
+	"STREAMING\n"
+	"Giving - as the input file reads the wad from stdin, and\n"
+	"the built wad is written to stdout (or to the file given\n"
+	"by the --output option).  With \"--output -\" the wad is\n"
+	"written to stdout, whatever the input file, which is left\n"
+	"untouched.  In both cases the wad is built in memory and\n"
+	"written without any gaps, as with the --compact option,\n"
+	"and all messages go to stderr.\n"
+	"\n"
+	"PACKAGES\n"
+	"A package (a PK3 or ZIP file) can be given instead of a wad.\n"
+	"Every wad in the \"maps\" folder of the package is read into\n"
+	"memory and built there, then the wads which have changed\n"
+	"are written back into the package, leaving the rest of it\n"
+	"alone.  These wads are always written without any gaps, as\n"
+	"with the --compact option.  Stored and deflated entries are\n"
+	"supported, but not encrypted ones, nor ZIP64 packages.\n"
+	"The new wads and directory are written after the end of the\n"
+	"package, so that it stays valid if building is interrupted.\n"
+	"The space of the old ones is not reused, so the package grows\n"
+	"each time it is rebuilt.\n"
+	"\n"
 	"`-h --help`\n"
 	"Displays a brief help screen, then exits.\n"
 	"\n"
@@ -202,6 +359,66 @@ typedef enum
 build_result_e;
 
 
+//
+// Statistics of building a level
+//
+
+typedef enum
+{
+	STAT_Load = 0,    // reading the level lumps, finding polyobjs
+	STAT_Overlaps,    // detecting overlapping vertices and lines
+	STAT_WallTips,    // CalculateWallTips
+	STAT_Nodes,       // creating the segs and building the BSP tree
+	STAT_Clockwise,   // ClockwiseBspTree
+	STAT_Normalise,   // NormaliseBspTree and RoundOffBspTree
+	STAT_Blockmap,    // PutBlockmap
+	STAT_Reject,      // PutReject
+	STAT_Write,       // writing the other lumps of the level
+
+	NUM_STAT_PHASES
+}
+stat_phase_e;
+
+class level_stats_t
+{
+public:
+	// wall-clock and CPU time spent in each phase, in seconds.
+	// the CPU time includes the worker threads used by --threads.
+	double wall[NUM_STAT_PHASES];
+	double cpu [NUM_STAT_PHASES];
+
+	// number of partition lines evaluated, and how many of those
+	// were abandoned early since they could not beat the best one.
+	long long eval_calls;
+	long long eval_early;
+
+	long long seg_splits;
+	long long minisegs;
+
+	// size of the result
+	int nodes;
+	int subsecs;
+	int segs;
+	int vertices;
+
+	// peak memory used by the whole process so far, in bytes.
+	// zero when unknown.
+	long long peak_memory;
+
+public:
+	level_stats_t()
+	{
+		Clear();
+	}
+
+	void Clear();
+
+	// add the times and counters of another level (or part of one).
+	// the peak memory becomes the largest of the two.
+	void Add(const level_stats_t& other);
+};
+
+
 namespace elfbsp
 {
 
@@ -212,6 +429,12 @@ void SetInfo(buildinfo_t *info);
 // buildinfo_t interface is called.
 void OpenWad(const char *filename);
 
+// open a wad which is held in memory, e.g. one stored inside a
+// package.  the vector receives the new contents of the wad when it
+// is closed, so it must stay alive until then.  on failure, the
+// FatalError method in the buildinfo_t interface is called.
+void OpenWadMemory(const char *name, std::vector<uint8_t> *data);
+
 // close a previously opened wad.
 void CloseWad();
 
@@ -225,7 +448,24 @@ const char *GetLevelName(int lev_idx);
 // BUILD_Cancelled result and the wad is unchanged.  otherwise the wad
 // is updated to store the new lumps and returns either BUILD_OK or
 // BUILD_LumpOverflow if some limits were exceeded.
-build_result_e BuildLevel(int lev_idx);
+//
+// when 'stats' is not NULL, it receives the statistics of building
+// the level (even when cancelled).
+build_result_e BuildLevel(int lev_idx, level_stats_t *stats = NULL);
+
+// build the nodes of several levels, using the number of threads
+// given by the 'jobs' field of buildinfo_t.  the results are stored
+// in the 'results' array, in the same order as 'lev_list'.  the wad
+// is updated in that order too, giving the same file as calling
+// BuildLevel() on each level in turn.  after a level is cancelled or
+// fails to build, the remaining levels get the BUILD_Cancelled result.
+// when 'stats' is not NULL, it receives the statistics of each level,
+// again in the same order as 'lev_list'.
+void BuildLevels(const int *lev_list, build_result_e *results, int count,
+		level_stats_t *stats = NULL);
+
+// give a short name for a phase of the statistics, like "blockmap".
+const char *StatPhaseName(int phase);
 
 
 }  // namespace elfbsp
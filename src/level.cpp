@@ -19,15 +19,22 @@
 //
 //------------------------------------------------------------------------
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #include "elfbsp.hpp"
 #include "local.hpp"
 #include "parse.hpp"
 #include "raw_def.hpp"
 #include "system.hpp"
+#include "task.hpp"
 #include "utility.hpp"
 #include "wad.hpp"
 
 #define DEBUG_BLOCKMAP  0
+#define DEBUG_BLOCKMAP_WALK  0
 #define DEBUG_REJECT    0
 
 #define DEBUG_LOAD      0
@@ -39,24 +46,50 @@ namespace elfbsp
 
 Wad_file * cur_wad;
 
-static int block_x, block_y;
-static int block_w, block_h;
-static int block_count;
+// this must be held while reading or writing the wad, since several
+// levels may be built at the same time (see BuildLevels).
+static std::recursive_mutex wad_lock;
+
+static thread_local int block_x, block_y;
+static thread_local int block_w, block_h;
+static thread_local int block_count;
+
+static thread_local int block_mid_x = 0;
+static thread_local int block_mid_y = 0;
+
+// limits of the lines in the blockmap, from InitBlockmap
+static thread_local bbox_t block_limits;
 
-static int block_mid_x = 0;
-static int block_mid_y = 0;
+// the line lists of all the blocks are kept in a single buffer.
+// block_start[] gives where each block begins in block_buf[], and
+// the list of block N ends where the list of block N+1 begins.
+// empty blocks take no space at all.
+static thread_local int      * block_start;
+static thread_local uint16_t * block_buf;
 
-static uint16_t ** block_lines;
+static thread_local uint16_t *block_ptrs;
 
-static uint16_t *block_ptrs;
-static uint16_t *block_dups;
+// the different non-empty blocks, in the order their line lists are
+// written to the BLOCKMAP lump.
+static thread_local int *block_order;
+static thread_local int  block_order_num;
 
-static int block_compression;
-static int block_overflowed;
+// for each block, the block whose line list it uses (often itself),
+// or -1 when the block is empty.
+static thread_local int *block_same;
+
+// the line lists of a packed blockmap (see PackBlockmap), ready to be
+// written after the pointers.  empty when not packed.
+static thread_local std::vector<uint16_t> block_packed;
+
+static thread_local int block_compression;
+static thread_local int block_overflowed;
 
 #define BLOCK_LIMIT  16000
 
-#define DUMMY_DUP  0xFFFF
+// the origins tried by --blockmap-search are moved down and left
+// by multiples of this, up to a whole block.
+#define BLOCK_SEARCH_STEP  16
 
 
 void GetBlockmapBounds(int *x, int *y, int *w, int *h)
@@ -139,17 +172,43 @@ int CheckLinedefInsideBox(int xmin, int ymin, int xmax, int ymax,
 
 /* ----- create blockmap ------------------------------------ */
 
+// layout of each non-empty block in block_buf[]
 #define BK_NUM    0
-#define BK_MAX    1
-#define BK_XOR    2
-#define BK_FIRST  3
+#define BK_XOR    1
+#define BK_FIRST  2
 
-#define BK_QUANTUM  32
+// how far (in map units) the span of a line in a row of blocks is
+// widened, to cover the rounding of intersections in the box test.
+#define BK_WALK_FUZZ  16
 
-static void BlockAdd(int blk_num, int line_index)
+// get the line list of a block, NULL if the block is empty.
+static inline uint16_t * BlockLines(int blk_num)
+{
+	int pos = block_start[blk_num];
+
+	if (pos == block_start[blk_num + 1])
+		return NULL;
+
+	return block_buf + pos;
+}
+
+
+// first pass: count the lines in each block.  the counts are kept in
+// block_start[] (one place along) until the buffer is laid out.
+static void BlockCount(int blk_num, int line_index)
 {
-	uint16_t *cur = block_lines[blk_num];
+	(void) line_index;
+
+	if (blk_num < 0 || blk_num >= block_count)
+		BugError("BlockCount: bad block number %d\n", blk_num);
 
+	block_start[blk_num + 1] += 1;
+}
+
+
+// second pass: store the line in the list of the block.
+static void BlockAdd(int blk_num, int line_index)
+{
 #if DEBUG_BLOCKMAP
 	cur_info->Debug("Block %d has line %d\n", blk_num, line_index);
 #endif
@@ -157,22 +216,10 @@ static void BlockAdd(int blk_num, int line_index)
 	if (blk_num < 0 || blk_num >= block_count)
 		BugError("BlockAdd: bad block number %d\n", blk_num);
 
-	if (! cur)
-	{
-		// create empty block
-		block_lines[blk_num] = cur = (uint16_t *)UtilCalloc(BK_QUANTUM * sizeof(uint16_t));
-		cur[BK_NUM] = 0;
-		cur[BK_MAX] = BK_QUANTUM;
-		cur[BK_XOR] = 0x1234;
-	}
-
-	if (BK_FIRST + cur[BK_NUM] == cur[BK_MAX])
-	{
-		// no more room, so allocate some more...
-		cur[BK_MAX] += BK_QUANTUM;
+	uint16_t *cur = BlockLines(blk_num);
 
-		block_lines[blk_num] = cur = (uint16_t *)UtilRealloc(cur, cur[BK_MAX] * sizeof(uint16_t));
-	}
+	if (cur == NULL || BK_FIRST + cur[BK_NUM] >= block_start[blk_num + 1] - block_start[blk_num])
+		BugError("BlockAdd: block %d was not counted\n", blk_num);
 
 	// compute new checksum
 	cur[BK_XOR] = (uint16_t) (((cur[BK_XOR] << 4) | (cur[BK_XOR] >> 12)) ^ line_index);
@@ -182,7 +229,7 @@ static void BlockAdd(int blk_num, int line_index)
 }
 
 
-static void BlockAddLine(const linedef_t *L)
+static void BlockAddLine(const linedef_t *L, void (*add_func)(int blk_num, int line_index))
 {
 	int x1 = (int) L->start->x;
 	int y1 = (int) L->start->y;
@@ -217,7 +264,7 @@ static void BlockAddLine(const linedef_t *L)
 		for (bx=bx1 ; bx <= bx2 ; bx++)
 		{
 			int blk_num = by1 * block_w + bx;
-			BlockAdd(blk_num, line_index);
+			add_func(blk_num, line_index);
 		}
 		return;
 	}
@@ -228,35 +275,88 @@ static void BlockAddLine(const linedef_t *L)
 		for (by=by1 ; by <= by2 ; by++)
 		{
 			int blk_num = by * block_w + bx1;
-			BlockAdd(blk_num, line_index);
+			add_func(blk_num, line_index);
 		}
 		return;
 	}
 
-	// handle the rest (diagonals)
+	// handle the rest (diagonals).  walk the line one row of blocks
+	// at a time, finding the span of columns it covers in that row.
+	// only the blocks in the span are tested against the line, and
+	// the span is widened a little so that the rounding done by
+	// CheckLinedefInsideBox() can never reach a block outside it.
+
+	double dx_dy = (x2 - x1) / (double)(y2 - y1);
+
+#if DEBUG_BLOCKMAP_WALK
+	std::vector<int> spans;
+#endif
+
+	int lo_y = std::min(y1, y2);
+	int hi_y = std::max(y1, y2);
 
 	for (by=by1 ; by <= by2 ; by++)
-	for (bx=bx1 ; bx <= bx2 ; bx++)
 	{
-		int blk_num = by * block_w + bx;
-
-		int minx = block_x + bx * 128;
 		int miny = block_y + by * 128;
-		int maxx = minx + 127;
 		int maxy = miny + 127;
 
-		if (CheckLinedefInsideBox(minx, miny, maxx, maxy, x1, y1, x2, y2))
+		double ya = std::max(miny - BK_WALK_FUZZ, lo_y);
+		double yb = std::min(maxy + BK_WALK_FUZZ, hi_y);
+
+		double xa = x1 + (ya - y1) * dx_dy;
+		double xb = x1 + (yb - y1) * dx_dy;
+
+		if (xa > xb)
+			std::swap(xa, xb);
+
+		int cx1 = (int)floor((xa - BK_WALK_FUZZ - block_x) / 128.0);
+		int cx2 = (int)floor((xb + BK_WALK_FUZZ - block_x) / 128.0);
+
+		cx1 = std::max(cx1, bx1);
+		cx2 = std::min(cx2, bx2);
+
+#if DEBUG_BLOCKMAP_WALK
+		spans.push_back(cx1);
+		spans.push_back(cx2);
+#endif
+
+		for (bx=cx1 ; bx <= cx2 ; bx++)
 		{
-			BlockAdd(blk_num, line_index);
+			int minx = block_x + bx * 128;
+			int maxx = minx + 127;
+
+			if (CheckLinedefInsideBox(minx, miny, maxx, maxy, x1, y1, x2, y2))
+			{
+				add_func(by * block_w + bx, line_index);
+			}
 		}
 	}
+
+#if DEBUG_BLOCKMAP_WALK
+	// check that testing every block in the bounding box would not
+	// have found any block which the walk missed.
+	for (by=by1 ; by <= by2 ; by++)
+	for (bx=bx1 ; bx <= bx2 ; bx++)
+	{
+		int minx = block_x + bx * 128;
+		int miny = block_y + by * 128;
+
+		int cx1 = spans[(by - by1) * 2];
+		int cx2 = spans[(by - by1) * 2 + 1];
+
+		if (bx >= cx1 && bx <= cx2)
+			continue;
+
+		if (CheckLinedefInsideBox(minx, miny, minx + 127, miny + 127, x1, y1, x2, y2))
+			BugError("BlockAddLine: walk of line #%d missed block (%d,%d)\n",
+					line_index, bx, by);
+	}
+#endif
 }
 
 
-static void CreateBlockmap(void)
+static void BlockAddAllLines(void (*add_func)(int blk_num, int line_index))
 {
-	block_lines = (uint16_t **) UtilCalloc(block_count * sizeof(uint16_t *));
-
 	for (int i=0 ; i < num_linedefs ; i++)
 	{
 		const linedef_t *L = lev_linedefs[i];
@@ -268,18 +368,49 @@ static void CreateBlockmap(void)
 		if (L->special == Special_NoBlockmap)
 			continue;
 
-		BlockAddLine(L);
+		BlockAddLine(L, add_func);
 	}
 }
 
 
-static int BlockCompare(const void *p1, const void *p2)
+static void CreateBlockmap(void)
 {
-	int blk_num1 = ((const uint16_t *) p1)[0];
-	int blk_num2 = ((const uint16_t *) p2)[0];
+	block_start = (int *) UtilCalloc((block_count + 1) * sizeof(int));
+
+	// count the lines in each block, then lay out the buffer so
+	// that each non-empty block has room for its header and lines.
+
+	BlockAddAllLines(BlockCount);
+
+	for (int i=0 ; i < block_count ; i++)
+	{
+		int count = block_start[i + 1];
+
+		if (count > 0)
+			count += BK_FIRST;
+
+		block_start[i + 1] = block_start[i] + count;
+	}
 
-	const uint16_t *A = block_lines[blk_num1];
-	const uint16_t *B = block_lines[blk_num2];
+	block_buf = (uint16_t *) UtilCalloc((block_start[block_count] + 1) * sizeof(uint16_t));
+
+	for (int i=0 ; i < block_count ; i++)
+	{
+		uint16_t *cur = BlockLines(i);
+
+		if (cur)
+			cur[BK_XOR] = 0x1234;
+	}
+
+	// now fill in the line lists
+	BlockAddAllLines(BlockAdd);
+}
+
+
+static int BlockCompare(int blk_num1, int blk_num2)
+{
+	const uint16_t *A = BlockLines(blk_num1);
+	const uint16_t *B = BlockLines(blk_num2);
 
 	if (A == B)
 		return 0;
@@ -301,6 +432,41 @@ static int BlockCompare(const void *p1, const void *p2)
 }
 
 
+static uint64_t BlockHash(const uint16_t *blk)
+{
+	// a 64-bit hash of the whole line list, four lines at a time.
+	// unlike the BK_XOR value, two different lists will practically
+	// never give the same hash.
+
+	int count = blk[BK_NUM];
+	const uint16_t *p = blk + BK_FIRST;
+
+	uint64_t h = 0x9E3779B97F4A7C15ULL ^ (uint64_t)count;
+
+	for (; count >= 4 ; count -= 4, p += 4)
+	{
+		uint64_t w;
+		memcpy(&w, p, sizeof(w));
+
+		h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 32;
+	}
+
+	for (; count > 0 ; count--, p++)
+	{
+		h = (h ^ *p) * 0xC4CEB9FE1A85EC53ULL;
+		h ^= h >> 29;
+	}
+
+	// final mixing (from splitmix64)
+	h ^= h >> 30;  h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 27;  h *= 0x94D049BB133111EBULL;
+	h ^= h >> 31;
+
+	return h;
+}
+
+
 static void CompressBlockmap(void)
 {
 	int i;
@@ -311,71 +477,102 @@ static void CompressBlockmap(void)
 
 	int orig_size, new_size;
 
-	block_ptrs = (uint16_t *)UtilCalloc(block_count * sizeof(uint16_t));
-	block_dups = (uint16_t *)UtilCalloc(block_count * sizeof(uint16_t));
+	block_ptrs  = (uint16_t *)UtilCalloc(block_count * sizeof(uint16_t));
+	block_order = (int *)UtilCalloc((block_count + 1) * sizeof(int));
+	block_same  = (int *)UtilCalloc((block_count + 1) * sizeof(int));
 
-	// sort duplicate-detecting array.  After the sort, all duplicates
-	// will be next to each other.  The duplicate array gives the order
-	// of the blocklists in the BLOCKMAP lump.
+	block_order_num = 0;
 
-	for (i=0 ; i < block_count ; i++)
-		block_dups[i] = (uint16_t) i;
+	orig_size = 4 + block_count;
 
-	qsort(block_dups, block_count, sizeof(uint16_t), BlockCompare);
+	// find the duplicate blocks with a hash table.  each block is
+	// looked up by the hash of its line list, and only when the
+	// hashes match are the lists themselves compared.  the first
+	// block with a certain list represents all of them.
 
-	// scan duplicate array and build up offset array
 
-	cur_offset = 4 + block_count + 2;
+	int table_size = 64;
+	while (table_size < block_count * 2)
+		table_size <<= 1;
 
-	orig_size = 4 + block_count;
-	new_size  = cur_offset;
+	std::vector<int>      table(table_size, -1);
+	std::vector<uint64_t> table_hash(table_size);
 
 	for (i=0 ; i < block_count ; i++)
 	{
-		int blk_num = block_dups[i];
-		int count;
+		const uint16_t *blk = BlockLines(i);
 
 		// empty block ?
-		if (block_lines[blk_num] == NULL)
+		if (blk == NULL)
 		{
-			block_ptrs[blk_num] = (uint16_t) (4 + block_count);
-			block_dups[i] = DUMMY_DUP;
+			block_ptrs[i] = (uint16_t) (4 + block_count);
+			block_same[i] = -1;
 
 			orig_size += 2;
 			continue;
 		}
 
-		count = 2 + block_lines[blk_num][BK_NUM];
+		orig_size += 2 + blk[BK_NUM];
 
-		// duplicate ?  Only the very last one of a sequence of duplicates
-		// will update the current offset value.
+		uint64_t h = BlockHash(blk);
+		int slot = (int)(h & (uint64_t)(table_size - 1));
 
-		if (i+1 < block_count && BlockCompare(block_dups + i, block_dups + i+1) == 0)
+		for (;;)
 		{
-			block_ptrs[blk_num] = (uint16_t) cur_offset;
-			block_dups[i] = DUMMY_DUP;
+			int other = table[slot];
+
+			if (other < 0)
+			{
+				table[slot] = i;
+				table_hash[slot] = h;
+
+				block_same[i] = i;
+
+				block_order[block_order_num++] = i;
+				break;
+			}
 
-			// free the memory of the duplicated block
-			UtilFree(block_lines[blk_num]);
-			block_lines[blk_num] = NULL;
+			if (table_hash[slot] == h && BlockCompare(other, i) == 0)
+			{
+				block_same[i] = other;
 
 #if DEBUG_BLOCKMAP
-			dup_count++;
+				dup_count++;
 #endif
+				break;
+			}
 
-			orig_size += count;
-			continue;
+			slot = (slot + 1) & (table_size - 1);
 		}
+	}
+
+	// the different lists are written in sorted order, which keeps
+	// the lump exactly the same as when all the blocks were sorted.
+
+	std::sort(block_order, block_order + block_order_num, [](int A, int B)
+	{
+		return BlockCompare(A, B) < 0;
+	});
+
+	cur_offset = 4 + block_count + 2;
+
+	new_size = cur_offset;
 
-		// OK, this block is either the last of a series of duplicates, or
-		// just a singleton.
+	for (i=0 ; i < block_order_num ; i++)
+	{
+		int blk_num = block_order[i];
+		int count   = 2 + BlockLines(blk_num)[BK_NUM];
 
 		block_ptrs[blk_num] = (uint16_t) cur_offset;
 
 		cur_offset += count;
+		new_size   += count;
+	}
 
-		orig_size += count;
-		new_size  += count;
+	for (i=0 ; i < block_count ; i++)
+	{
+		if (block_same[i] >= 0)
+			block_ptrs[i] = block_ptrs[block_same[i]];
 	}
 
 	if (cur_offset > 65535)
@@ -397,6 +594,231 @@ static void CompressBlockmap(void)
 }
 
 
+static bool BlockIsSubset(const uint16_t *A, const uint16_t *B)
+{
+	// check if every line of A is also in B.  the lines of both
+	// lists are in increasing order.
+
+	int num_a = A[BK_NUM];
+	int num_b = B[BK_NUM];
+
+	int k = 0;
+
+	for (int i=0 ; i < num_a ; i++)
+	{
+		int line = LE_U16(A[BK_FIRST + i]);
+
+		while (k < num_b && LE_U16(B[BK_FIRST + k]) < line)
+			k++;
+
+		if (k >= num_b || LE_U16(B[BK_FIRST + k]) != line)
+			return false;
+
+		k++;
+	}
+
+	return true;
+}
+
+
+//
+// Lay out the line lists more tightly than CompressBlockmap does, for
+// when that overflows.  Lists are joined into chains, where each list
+// is a subset of the one before it.  The lines which only the bigger
+// list has are written first, followed by the smaller list, and both
+// blocks point into the same run of lines.  Every list still begins
+// with a zero, unless the user allows leaving it out.
+//
+static void PackBlockmap(void)
+{
+	bool zero = ! cur_info->blockmap_nozero;
+
+	int num = block_order_num;
+	int i;
+
+	// for each line, find which lists contain it
+
+	std::vector<int> line_start(num_linedefs + 2, 0);
+
+	for (i=0 ; i < num ; i++)
+	{
+		const uint16_t *blk = BlockLines(block_order[i]);
+
+		for (int k=0 ; k < blk[BK_NUM] ; k++)
+			line_start[LE_U16(blk[BK_FIRST + k]) + 1] += 1;
+	}
+
+	for (i=0 ; i <= num_linedefs ; i++)
+		line_start[i + 1] += line_start[i];
+
+	std::vector<int> line_lists(line_start[num_linedefs + 1]);
+	std::vector<int> line_fill (line_start.begin(), line_start.end() - 1);
+
+	for (i=0 ; i < num ; i++)
+	{
+		const uint16_t *blk = BlockLines(block_order[i]);
+
+		for (int k=0 ; k < blk[BK_NUM] ; k++)
+			line_lists[line_fill[LE_U16(blk[BK_FIRST + k])]++] = i;
+	}
+
+	// visit the lists from biggest to smallest, linking each one to
+	// the smallest bigger list which contains it and has not been
+	// linked to another list yet.  a link saves as many words as the
+	// smaller list has lines, plus one.
+
+	std::vector<int> by_size(num);
+
+	for (i=0 ; i < num ; i++)
+		by_size[i] = i;
+
+	std::stable_sort(by_size.begin(), by_size.end(), [](int A, int B)
+	{
+		return BlockLines(block_order[A])[BK_NUM] > BlockLines(block_order[B])[BK_NUM];
+	});
+
+	std::vector<int> child (num, -1);
+	std::vector<int> parent(num, -1);
+
+	for (int b : by_size)
+	{
+		const uint16_t *B = BlockLines(block_order[b]);
+		int num_b = B[BK_NUM];
+
+		// only the lists having the rarest line of B can contain it
+		int rare = LE_U16(B[BK_FIRST]);
+
+		for (int k=1 ; k < num_b ; k++)
+		{
+			int line = LE_U16(B[BK_FIRST + k]);
+
+			if (line_start[line + 1] - line_start[line] < line_start[rare + 1] - line_start[rare])
+				rare = line;
+		}
+
+		int best     = -1;
+		int best_num = INT_MAX;
+
+		for (int p = line_start[rare] ; p < line_start[rare + 1] ; p++)
+		{
+			int a = line_lists[p];
+
+			if (child[a] >= 0)
+				continue;
+
+			const uint16_t *A = BlockLines(block_order[a]);
+
+			if (A[BK_NUM] <= num_b || A[BK_NUM] >= best_num)
+				continue;
+
+			if (BlockIsSubset(B, A))
+			{
+				best     = a;
+				best_num = A[BK_NUM];
+			}
+		}
+
+		if (best >= 0)
+		{
+			child[best] = b;
+			parent[b]   = best;
+		}
+	}
+
+	// write out the chains
+
+	block_packed.clear();
+
+	// the null block which all empty blocks will use
+	if (zero)
+		block_packed.push_back(0x0000);
+
+	block_packed.push_back(0xFFFF);
+
+	int base = 4 + block_count;
+
+	std::vector<int> list_ptr(num);
+
+	for (i=0 ; i < num ; i++)
+	{
+		if (parent[i] >= 0)
+			continue;
+
+		for (int n = i ; n >= 0 ; n = child[n])
+		{
+			list_ptr[n] = base + (int)block_packed.size();
+
+			if (zero)
+				block_packed.push_back(0x0000);
+
+			const uint16_t *blk = BlockLines(block_order[n]);
+			const uint16_t *sub = (child[n] >= 0) ? BlockLines(block_order[child[n]]) : NULL;
+
+			// skip the lines which come later, in the smaller list
+			int k = 0;
+
+			for (int j=0 ; j < blk[BK_NUM] ; j++)
+			{
+				int line = LE_U16(blk[BK_FIRST + j]);
+
+				if (sub && k < sub[BK_NUM] && LE_U16(sub[BK_FIRST + k]) == line)
+				{
+					k++;
+					continue;
+				}
+
+				block_packed.push_back(blk[BK_FIRST + j]);
+			}
+		}
+
+		block_packed.push_back(0xFFFF);
+	}
+
+	int cur_offset = base + (int)block_packed.size();
+
+	if (cur_offset > 65535)
+	{
+		block_packed.clear();
+		block_overflowed = true;
+		return;
+	}
+
+	std::vector<int> order_pos(block_count, -1);
+
+	for (i=0 ; i < num ; i++)
+		order_pos[block_order[i]] = i;
+
+	int orig_size = 4 + block_count;
+
+	for (i=0 ; i < block_count ; i++)
+	{
+		const uint16_t *blk = BlockLines(i);
+
+		if (blk == NULL)
+		{
+			block_ptrs[i] = (uint16_t) base;
+			orig_size += 2;
+		}
+		else
+		{
+			block_ptrs[i] = (uint16_t) list_ptr[order_pos[block_same[i]]];
+			orig_size += 2 + blk[BK_NUM];
+		}
+	}
+
+	block_overflowed = false;
+
+	block_compression = (orig_size - cur_offset) * 100 / orig_size;
+
+	if (block_compression < 0)
+		block_compression = 0;
+
+#if DEBUG_BLOCKMAP
+	cur_info->Debug("Blockmap: packed, last ptr = %d\n", cur_offset);
+#endif
+}
+
+
 static int CalcBlockmapSize()
 {
 	// compute size of final BLOCKMAP lump.
@@ -409,16 +831,13 @@ static int CalcBlockmapSize()
 	// the pointers (offsets to the line lists)
 	size = size + block_count * 2;
 
+	if (! block_packed.empty())
+		return size + (int)block_packed.size() * 2;
+
 	// add size of each block
-	for (int i=0 ; i < block_count ; i++)
+	for (int i=0 ; i < block_order_num ; i++)
 	{
-		int blk_num = block_dups[i];
-
-		// ignore duplicate or empty blocks
-		if (blk_num == DUMMY_DUP)
-			continue;
-
-		uint16_t *blk = block_lines[blk_num];
+		const uint16_t *blk = BlockLines(block_order[i]);
 		SYS_ASSERT(blk);
 
 		size += (1 + (int)(blk[BK_NUM]) + 1) * 2;
@@ -434,7 +853,7 @@ static void WriteBlockmap(void)
 
 	int max_size = CalcBlockmapSize();
 
-	Lump_c *lump = CreateLevelLump("BLOCKMAP", max_size);
+	level_lump_c *lump = CreateLevelLump("BLOCKMAP", max_size);
 
 	uint16_t null_block[2] = { 0x0000, 0xFFFF };
 	uint16_t m_zero = 0x0000;
@@ -461,19 +880,20 @@ static void WriteBlockmap(void)
 		lump->Write(&ptr, sizeof(uint16_t));
 	}
 
+	if (! block_packed.empty())
+	{
+		lump->Write(block_packed.data(), (int)block_packed.size() * sizeof(uint16_t));
+		lump->Finish();
+		return;
+	}
+
 	// add the null block which *all* empty blocks will use
 	lump->Write(null_block, sizeof(null_block));
 
 	// handle each block list
-	for (i=0 ; i < block_count ; i++)
+	for (i=0 ; i < block_order_num ; i++)
 	{
-		int blk_num = block_dups[i];
-
-		// ignore duplicate or empty blocks
-		if (blk_num == DUMMY_DUP)
-			continue;
-
-		uint16_t *blk = block_lines[blk_num];
+		const uint16_t *blk = BlockLines(block_order[i]);
 		SYS_ASSERT(blk);
 
 		lump->Write(&m_zero, sizeof(uint16_t));
@@ -487,15 +907,14 @@ static void WriteBlockmap(void)
 
 static void FreeBlockmap(void)
 {
-	for (int i=0 ; i < block_count ; i++)
-	{
-		if (block_lines[i])
-			UtilFree(block_lines[i]);
-	}
-
-	UtilFree(block_lines);
+	UtilFree(block_start);
+	UtilFree(block_buf);
 	UtilFree(block_ptrs);
-	UtilFree(block_dups);
+	UtilFree(block_order);
+	UtilFree(block_same);
+
+	block_packed.clear();
+	block_packed.shrink_to_fit();
 }
 
 
@@ -549,24 +968,228 @@ static void FindBlockmapLimits(bbox_t *bbox)
 }
 
 
-void InitBlockmap()
+static void SetBlockmapOrigin(int x, int y)
 {
-	bbox_t map_bbox;
+	block_x = x;
+	block_y = y;
+
+	block_w = ((block_limits.maxx - block_x) / 128) + 1;
+	block_h = ((block_limits.maxy - block_y) / 128) + 1;
+
+	block_count = block_w * block_h;
+}
 
+
+void InitBlockmap()
+{
 	// find limits of linedefs, and store as map limits
-	FindBlockmapLimits(&map_bbox);
+	FindBlockmapLimits(&block_limits);
 
 	cur_info->Print_Verbose("    Map limits: (%d,%d) to (%d,%d)\n",
-			map_bbox.minx, map_bbox.miny,
-			map_bbox.maxx, map_bbox.maxy);
+			block_limits.minx, block_limits.miny,
+			block_limits.maxx, block_limits.maxy);
 
-	block_x = map_bbox.minx - (map_bbox.minx & 0x7);
-	block_y = map_bbox.miny - (map_bbox.miny & 0x7);
+	SetBlockmapOrigin(block_limits.minx - (block_limits.minx & 0x7),
+	                  block_limits.miny - (block_limits.miny & 0x7));
+}
 
-	block_w = ((map_bbox.maxx - block_x) / 128) + 1;
-	block_h = ((map_bbox.maxy - block_y) / 128) + 1;
 
-	block_count = block_w * block_h;
+/* ----- blockmap origin search ----------------------------- */
+
+class blockmap_try_t
+{
+public:
+	int x, y;
+
+	// size of the lump in bytes, INT_MAX when it overflowed
+	int size;
+
+	// number of lines in the block with the most
+	int max_lines;
+};
+
+
+static int BlockmapLumpSize()
+{
+	// header and pointers
+	int size = (4 + block_count) * 2;
+
+	if (! block_packed.empty())
+		return size + (int)block_packed.size() * 2;
+
+	// the null block, then each list with its zero and -1
+	size += 4;
+
+	for (int i=0 ; i < block_order_num ; i++)
+		size += (2 + BlockLines(block_order[i])[BK_NUM]) * 2;
+
+	return size;
+}
+
+
+static void TryBlockmapOrigin(blockmap_try_t *T)
+{
+	SetBlockmapOrigin(T->x, T->y);
+
+	block_overflowed = false;
+
+	CreateBlockmap();
+	CompressBlockmap();
+
+	if (block_overflowed && cur_info->blockmap_pack)
+		PackBlockmap();
+
+	T->size = block_overflowed ? INT_MAX : BlockmapLumpSize();
+	T->max_lines = 0;
+
+	for (int i=0 ; i < block_order_num ; i++)
+		T->max_lines = std::max(T->max_lines, (int)BlockLines(block_order[i])[BK_NUM]);
+
+	FreeBlockmap();
+}
+
+
+static bool BlockmapTryBetter(const blockmap_try_t& A, const blockmap_try_t& B)
+{
+	// an overflowed blockmap is never better
+	if (A.size == INT_MAX || B.size == INT_MAX)
+		return A.size < B.size;
+
+	if (cur_info->blockmap_search == BMSEARCH_Lines && A.max_lines != B.max_lines)
+		return A.max_lines < B.max_lines;
+
+	if (A.size != B.size)
+		return A.size < B.size;
+
+	return A.max_lines < B.max_lines;
+}
+
+
+class blockmap_task_c : public task_c
+{
+public:
+	level_t *level;
+	bbox_t limits;
+
+	std::vector<blockmap_try_t> *tries;
+
+	// shared by all the tasks
+	std::atomic<size_t> *next_try;
+
+	// CPU time used on a worker thread, added to the level afterwards
+	double cpu;
+
+public:
+	void Run()
+	{
+		task_cpu_timer_c timer;
+
+		// the blockmap state is per-thread, so this thread needs the
+		// level and its limits before building anything.
+		level_t *saved_level = cur_level;
+
+		cur_level    = level;
+		block_limits = limits;
+
+		for (;;)
+		{
+			size_t i = next_try->fetch_add(1);
+
+			if (i >= tries->size())
+				break;
+
+			TryBlockmapOrigin(&(*tries)[i]);
+		}
+
+		cur_level = saved_level;
+
+		cpu = timer.Stop();
+	}
+};
+
+
+//
+// Try moving the blockmap origin down and left by up to a block, and
+// keep the one which gives the best blockmap.  The first try is the
+// normal origin, which is kept unless another one is really better.
+//
+static void SearchBlockmapOrigin()
+{
+	int base_x = block_x;
+	int base_y = block_y;
+
+	std::vector<blockmap_try_t> tries;
+
+	for (int dy = 0 ; dy < 128 ; dy += BLOCK_SEARCH_STEP)
+	for (int dx = 0 ; dx < 128 ; dx += BLOCK_SEARCH_STEP)
+	{
+		// the origin must fit in the header
+		if (base_x - dx < SHRT_MIN || base_y - dy < SHRT_MIN)
+			continue;
+
+		blockmap_try_t T;
+
+		T.x = base_x - dx;
+		T.y = base_y - dy;
+
+		tries.push_back(T);
+	}
+
+	int count = cur_info->threads;
+
+	if (count <= 0)
+		count = (int)std::thread::hardware_concurrency();
+
+	count = std::max(1, std::min(count, (int)tries.size()));
+
+	std::atomic<size_t> next_try(0);
+
+	{
+		task_pool_c pool(count);
+
+		std::vector<blockmap_task_c> tasks(count);
+
+		for (int i = 0 ; i < count ; i++)
+		{
+			tasks[i].level    = cur_level;
+			tasks[i].limits   = block_limits;
+			tasks[i].tries    = &tries;
+			tasks[i].next_try = &next_try;
+			tasks[i].cpu      = 0;
+		}
+
+		for (int i = 1 ; i < count ; i++)
+			pool.Push(&tasks[i]);
+
+		tasks[0].Run();
+
+		for (int i = count-1 ; i >= 1 ; i--)
+			pool.Wait(&tasks[i]);
+
+		for (int i = 0 ; i < count ; i++)
+			cur_level->stats.cpu[STAT_Blockmap] += tasks[i].cpu;
+	}
+
+	size_t best = 0;
+
+	for (size_t i = 1 ; i < tries.size() ; i++)
+	{
+		if (BlockmapTryBetter(tries[i], tries[best]))
+			best = i;
+	}
+
+	SetBlockmapOrigin(tries[best].x, tries[best].y);
+
+	if (best > 0)
+	{
+		cur_info->Print_Verbose("    Blockmap origin moved by (%d,%d)\n",
+				tries[best].x - base_x, tries[best].y - base_y);
+
+		if (tries[0].size != INT_MAX)
+			cur_info->Print_Verbose("    Blockmap lump %d -> %d bytes, most lines in a block %d -> %d\n",
+					tries[0].size, tries[best].size,
+					tries[0].max_lines, tries[best].max_lines);
+	}
 }
 
 
@@ -579,6 +1202,9 @@ void PutBlockmap()
 		return;
 	}
 
+	if (cur_info->blockmap_search != BMSEARCH_Off)
+		SearchBlockmapOrigin();
+
 	block_overflowed = false;
 
 	// initial phase: create internal blockmap containing the index of
@@ -586,12 +1212,20 @@ void PutBlockmap()
 
 	CreateBlockmap();
 
-	// -AJA- second phase: compress the blockmap.  We do this by sorting
-	//       the blocks, which is a typical way to detect duplicates in
-	//       a large list.  This also detects BLOCKMAP overflow.
+	// -AJA- second phase: compress the blockmap.  Duplicate blocks
+	//       are found with a hash table and share a single line list.
+	//       This also detects BLOCKMAP overflow.
 
 	CompressBlockmap();
 
+	if (block_overflowed && cur_info->blockmap_pack)
+	{
+		PackBlockmap();
+
+		if (! block_overflowed)
+			cur_info->Print_Verbose("    Blockmap packed to avoid overflow\n");
+	}
+
 	// final phase: write it out in the correct format
 
 	if (block_overflowed)
@@ -618,8 +1252,8 @@ void PutBlockmap()
 //------------------------------------------------------------------------
 
 
-static uint8_t *rej_matrix;
-static int      rej_total_size;	// in bytes
+static thread_local uint8_t *rej_matrix;
+static thread_local int      rej_total_size;	// in bytes
 
 
 //
@@ -761,7 +1395,7 @@ static void Reject_ProcessSectors()
 
 static void Reject_WriteLump()
 {
-	Lump_c *lump = CreateLevelLump("REJECT", rej_total_size);
+	level_lump_c *lump = CreateLevelLump("REJECT", rej_total_size);
 
 	lump->Write(rej_matrix, rej_total_size);
 	lump->Finish();
@@ -806,41 +1440,69 @@ void PutReject()
 
 
 // per-level variables
+// [ these are thread-local, since each level is loaded, built and
+//   saved by a single thread, see BuildLevels() ]
 
-const char *lev_current_name;
+static thread_local const char *lev_current_name;
 
-int lev_current_idx;
-int lev_current_start;
+static thread_local int lev_current_idx;
+static thread_local int lev_current_start;
 
-map_format_e lev_format;
-bool lev_force_xnod;
+static thread_local map_format_e lev_format;
+static thread_local bool lev_force_xnod;
 
-bool lev_long_name;
-bool lev_overflows;
+static thread_local bool lev_long_name;
+static thread_local bool lev_overflows;
 
+static thread_local int num_real_lines = 0;
 
-// objects of loaded level, and stuff we've built
-std::vector<vertex_t *>  lev_vertices;
-std::vector<linedef_t *> lev_linedefs;
-std::vector<sidedef_t *> lev_sidedefs;
-std::vector<sector_t *>  lev_sectors;
-std::vector<thing_t *>   lev_things;
+thread_local level_t * cur_level;
 
-std::vector<seg_t *>     lev_segs;
-std::vector<subsec_t *>  lev_subsecs;
-std::vector<node_t *>    lev_nodes;
-std::vector<walltip_t *> lev_walltips;
 
-int num_old_vert = 0;
-int num_new_vert = 0;
-int num_real_lines = 0;
+/* ----- statistics ---------------------------- */
+
+class phase_timer_c
+{
+	// adds the time from its creation to its destruction to the
+	// statistics of the current level.  Switch() moves on to another
+	// phase, so a sequence of phases can be timed with one timer.
+
+private:
+	stat_phase_e phase;
+
+	double wall;
+	double cpu;
+
+public:
+	phase_timer_c(stat_phase_e _phase) :
+		phase(_phase), wall(TimeWall()), cpu(TimeThreadCPU())
+	{ }
+
+	~phase_timer_c()
+	{
+		Switch(phase);
+	}
+
+	void Switch(stat_phase_e new_phase)
+	{
+		double now_wall = TimeWall();
+		double now_cpu  = TimeThreadCPU();
+
+		cur_level->stats.wall[phase] += now_wall - wall;
+		cur_level->stats.cpu [phase] += now_cpu  - cpu;
+
+		phase = new_phase;
+		wall  = now_wall;
+		cpu   = now_cpu;
+	}
+};
 
 
 /* ----- allocation routines ---------------------------- */
 
 vertex_t *NewVertex()
 {
-	vertex_t *V = (vertex_t *) UtilCalloc(sizeof(vertex_t));
+	vertex_t *V = (vertex_t *) cur_level->vertex_mem.Alloc(sizeof(vertex_t));
 	V->index = num_vertices;
 	lev_vertices.push_back(V);
 	return V;
@@ -848,7 +1510,7 @@ vertex_t *NewVertex()
 
 linedef_t *NewLinedef()
 {
-	linedef_t *L = (linedef_t *) UtilCalloc(sizeof(linedef_t));
+	linedef_t *L = (linedef_t *) cur_level->linedef_mem.Alloc(sizeof(linedef_t));
 	L->index = num_linedefs;
 	lev_linedefs.push_back(L);
 	return L;
@@ -856,7 +1518,7 @@ linedef_t *NewLinedef()
 
 sidedef_t *NewSidedef()
 {
-	sidedef_t *S = (sidedef_t *) UtilCalloc(sizeof(sidedef_t));
+	sidedef_t *S = (sidedef_t *) cur_level->sidedef_mem.Alloc(sizeof(sidedef_t));
 	S->index = num_sidedefs;
 	lev_sidedefs.push_back(S);
 	return S;
@@ -864,7 +1526,7 @@ sidedef_t *NewSidedef()
 
 sector_t *NewSector()
 {
-	sector_t *S = (sector_t *) UtilCalloc(sizeof(sector_t));
+	sector_t *S = (sector_t *) cur_level->sector_mem.Alloc(sizeof(sector_t));
 	S->index = num_sectors;
 	lev_sectors.push_back(S);
 	return S;
@@ -872,7 +1534,7 @@ sector_t *NewSector()
 
 thing_t *NewThing()
 {
-	thing_t *T = (thing_t *) UtilCalloc(sizeof(thing_t));
+	thing_t *T = (thing_t *) cur_level->thing_mem.Alloc(sizeof(thing_t));
 	T->index = num_things;
 	lev_things.push_back(T);
 	return T;
@@ -880,28 +1542,28 @@ thing_t *NewThing()
 
 seg_t *NewSeg()
 {
-	seg_t *S = (seg_t *) UtilCalloc(sizeof(seg_t));
+	seg_t *S = (seg_t *) cur_level->seg_mem.Alloc(sizeof(seg_t));
 	lev_segs.push_back(S);
 	return S;
 }
 
 subsec_t *NewSubsec()
 {
-	subsec_t *S = (subsec_t *) UtilCalloc(sizeof(subsec_t));
+	subsec_t *S = (subsec_t *) cur_level->subsec_mem.Alloc(sizeof(subsec_t));
 	lev_subsecs.push_back(S);
 	return S;
 }
 
 node_t *NewNode()
 {
-	node_t *N = (node_t *) UtilCalloc(sizeof(node_t));
+	node_t *N = (node_t *) cur_level->node_mem.Alloc(sizeof(node_t));
 	lev_nodes.push_back(N);
 	return N;
 }
 
 walltip_t *NewWallTip()
 {
-	walltip_t *WT = (walltip_t *) UtilCalloc(sizeof(walltip_t));
+	walltip_t *WT = (walltip_t *) cur_level->walltip_mem.Alloc(sizeof(walltip_t));
 	lev_walltips.push_back(WT);
 	return WT;
 }
@@ -911,74 +1573,64 @@ walltip_t *NewWallTip()
 
 void FreeVertices()
 {
-	for (unsigned int i = 0 ; i < lev_vertices.size() ; i++)
-		UtilFree((void *) lev_vertices[i]);
-
 	lev_vertices.clear();
+	cur_level->vertex_mem.Release();
 }
 
 void FreeLinedefs()
 {
-	for (unsigned int i = 0 ; i < lev_linedefs.size() ; i++)
-		UtilFree((void *) lev_linedefs[i]);
-
 	lev_linedefs.clear();
+	cur_level->linedef_mem.Release();
 }
 
 void FreeSidedefs()
 {
-	for (unsigned int i = 0 ; i < lev_sidedefs.size() ; i++)
-		UtilFree((void *) lev_sidedefs[i]);
-
 	lev_sidedefs.clear();
+	cur_level->sidedef_mem.Release();
 }
 
 void FreeSectors()
 {
-	for (unsigned int i = 0 ; i < lev_sectors.size() ; i++)
-		UtilFree((void *) lev_sectors[i]);
-
 	lev_sectors.clear();
+	cur_level->sector_mem.Release();
 }
 
 void FreeThings()
 {
-	for (unsigned int i = 0 ; i < lev_things.size() ; i++)
-		UtilFree((void *) lev_things[i]);
-
 	lev_things.clear();
+	cur_level->thing_mem.Release();
 }
 
 void FreeSegs()
 {
-	for (unsigned int i = 0 ; i < lev_segs.size() ; i++)
-		UtilFree((void *) lev_segs[i]);
-
 	lev_segs.clear();
+	cur_level->seg_mem.Release();
 }
 
 void FreeSubsecs()
 {
-	for (unsigned int i = 0 ; i < lev_subsecs.size() ; i++)
-		UtilFree((void *) lev_subsecs[i]);
-
 	lev_subsecs.clear();
+	cur_level->subsec_mem.Release();
 }
 
 void FreeNodes()
 {
-	for (unsigned int i = 0 ; i < lev_nodes.size() ; i++)
-		UtilFree((void *) lev_nodes[i]);
-
 	lev_nodes.clear();
+	cur_level->node_mem.Release();
 }
 
 void FreeWallTips()
 {
-	for (unsigned int i = 0 ; i < lev_walltips.size() ; i++)
-		UtilFree((void *) lev_walltips[i]);
-
 	lev_walltips.clear();
+	cur_level->walltip_mem.Release();
+}
+
+void FreeOutput()
+{
+	for (level_lump_c *L : cur_level->output)
+		delete L;
+
+	cur_level->output.clear();
 }
 
 
@@ -1016,31 +1668,61 @@ static inline sidedef_t *SafeLookupSidedef(uint16_t num)
 }
 
 
-void GetVertices()
+//
+// copy the contents of a lump of the current level into the buffer,
+// straight from the mapped wad when possible.  returns false when the
+// level has no such lump.
+//
+static bool CopyLevelLump(const char *name, std::vector<uint8_t>& buffer)
 {
-	int count = 0;
+	Lump_c *lump = FindLevelLump(name);
 
-	Lump_c *lump = FindLevelLump("VERTEXES");
+	if (lump == NULL)
+		return false;
 
-	if (lump)
-		count = lump->Length() / (int)sizeof(raw_vertex_t);
+	int length = lump->Length();
+
+	buffer.resize(length);
+
+	if (length == 0)
+		return true;
+
+	const uint8_t *data = lump->Data();
+
+	if (data != NULL)
+	{
+		memcpy(buffer.data(), data, length);
+		return true;
+	}
+
+	if (! lump->Seek(0))
+		cur_info->FatalError("Error seeking to %s lump.\n", name);
+
+	if (! lump->Read(buffer.data(), length))
+		cur_info->FatalError("Error reading %s lump.\n", name);
+
+	return true;
+}
+
+
+void GetVertices(const std::vector<uint8_t>& lump)
+{
+	int count = (int)(lump.size() / sizeof(raw_vertex_t));
 
 #if DEBUG_LOAD
 	cur_info->Debug("GetVertices: num = %d\n", count);
 #endif
 
-	if (lump == NULL || count == 0)
+	if (count == 0)
 		return;
 
-	if (! lump->Seek(0))
-		cur_info->FatalError("Error seeking to vertices.\n");
+	const uint8_t *data = lump.data();
 
 	for (int i = 0 ; i < count ; i++)
 	{
 		raw_vertex_t raw;
 
-		if (! lump->Read(&raw, sizeof(raw)))
-			cur_info->FatalError("Error reading vertices.\n");
+		memcpy(&raw, data + (size_t)i * sizeof(raw), sizeof(raw));
 
 		vertex_t *vert = NewVertex();
 
@@ -1052,20 +1734,14 @@ void GetVertices()
 }
 
 
-void GetSectors()
+void GetSectors(const std::vector<uint8_t>& lump)
 {
-	int count = 0;
-
-	Lump_c *lump = FindLevelLump("SECTORS");
+	int count = (int)(lump.size() / sizeof(raw_sector_t));
 
-	if (lump)
-		count = lump->Length() / (int)sizeof(raw_sector_t);
-
-	if (lump == NULL || count == 0)
+	if (count == 0)
 		return;
 
-	if (! lump->Seek(0))
-		cur_info->FatalError("Error seeking to sectors.\n");
+	const uint8_t *data = lump.data();
 
 #if DEBUG_LOAD
 	cur_info->Debug("GetSectors: num = %d\n", count);
@@ -1075,8 +1751,7 @@ void GetSectors()
 	{
 		raw_sector_t raw;
 
-		if (! lump->Read(&raw, sizeof(raw)))
-			cur_info->FatalError("Error reading sectors.\n");
+		memcpy(&raw, data + (size_t)i * sizeof(raw), sizeof(raw));
 
 		sector_t *sector = NewSector();
 
@@ -1085,20 +1760,14 @@ void GetSectors()
 }
 
 
-void GetThings()
+void GetThings(const std::vector<uint8_t>& lump)
 {
-	int count = 0;
+	int count = (int)(lump.size() / sizeof(raw_thing_t));
 
-	Lump_c *lump = FindLevelLump("THINGS");
-
-	if (lump)
-		count = lump->Length() / (int)sizeof(raw_thing_t);
-
-	if (lump == NULL || count == 0)
+	if (count == 0)
 		return;
 
-	if (! lump->Seek(0))
-		cur_info->FatalError("Error seeking to things.\n");
+	const uint8_t *data = lump.data();
 
 #if DEBUG_LOAD
 	cur_info->Debug("GetThings: num = %d\n", count);
@@ -1108,8 +1777,7 @@ void GetThings()
 	{
 		raw_thing_t raw;
 
-		if (! lump->Read(&raw, sizeof(raw)))
-			cur_info->FatalError("Error reading things.\n");
+		memcpy(&raw, data + (size_t)i * sizeof(raw), sizeof(raw));
 
 		thing_t *thing = NewThing();
 
@@ -1120,20 +1788,14 @@ void GetThings()
 }
 
 
-void GetThingsHexen()
+void GetThingsHexen(const std::vector<uint8_t>& lump)
 {
-	int count = 0;
-
-	Lump_c *lump = FindLevelLump("THINGS");
-
-	if (lump)
-		count = lump->Length() / (int)sizeof(raw_hexen_thing_t);
+	int count = (int)(lump.size() / sizeof(raw_hexen_thing_t));
 
-	if (lump == NULL || count == 0)
+	if (count == 0)
 		return;
 
-	if (! lump->Seek(0))
-		cur_info->FatalError("Error seeking to things.\n");
+	const uint8_t *data = lump.data();
 
 #if DEBUG_LOAD
 	cur_info->Debug("GetThingsHexen: num = %d\n", count);
@@ -1143,8 +1805,7 @@ void GetThingsHexen()
 	{
 		raw_hexen_thing_t raw;
 
-		if (! lump->Read(&raw, sizeof(raw)))
-			cur_info->FatalError("Error reading things.\n");
+		memcpy(&raw, data + (size_t)i * sizeof(raw), sizeof(raw));
 
 		thing_t *thing = NewThing();
 
@@ -1155,20 +1816,14 @@ void GetThingsHexen()
 }
 
 
-void GetSidedefs()
+void GetSidedefs(const std::vector<uint8_t>& lump)
 {
-	int count = 0;
-
-	Lump_c *lump = FindLevelLump("SIDEDEFS");
+	int count = (int)(lump.size() / sizeof(raw_sidedef_t));
 
-	if (lump)
-		count = lump->Length() / (int)sizeof(raw_sidedef_t);
-
-	if (lump == NULL || count == 0)
+	if (count == 0)
 		return;
 
-	if (! lump->Seek(0))
-		cur_info->FatalError("Error seeking to sidedefs.\n");
+	const uint8_t *data = lump.data();
 
 #if DEBUG_LOAD
 	cur_info->Debug("GetSidedefs: num = %d\n", count);
@@ -1178,8 +1833,7 @@ void GetSidedefs()
 	{
 		raw_sidedef_t raw;
 
-		if (! lump->Read(&raw, sizeof(raw)))
-			cur_info->FatalError("Error reading sidedefs.\n");
+		memcpy(&raw, data + (size_t)i * sizeof(raw), sizeof(raw));
 
 		sidedef_t *side = NewSidedef();
 
@@ -1188,20 +1842,14 @@ void GetSidedefs()
 }
 
 
-void GetLinedefs()
+void GetLinedefs(const std::vector<uint8_t>& lump)
 {
-	int count = 0;
+	int count = (int)(lump.size() / sizeof(raw_linedef_t));
 
-	Lump_c *lump = FindLevelLump("LINEDEFS");
-
-	if (lump)
-		count = lump->Length() / (int)sizeof(raw_linedef_t);
-
-	if (lump == NULL || count == 0)
+	if (count == 0)
 		return;
 
-	if (! lump->Seek(0))
-		cur_info->FatalError("Error seeking to linedefs.\n");
+	const uint8_t *data = lump.data();
 
 #if DEBUG_LOAD
 	cur_info->Debug("GetLinedefs: num = %d\n", count);
@@ -1211,8 +1859,7 @@ void GetLinedefs()
 	{
 		raw_linedef_t raw;
 
-		if (! lump->Read(&raw, sizeof(raw)))
-			cur_info->FatalError("Error reading linedefs.\n");
+		memcpy(&raw, data + (size_t)i * sizeof(raw), sizeof(raw));
 
 		linedef_t *line;
 
@@ -1259,20 +1906,14 @@ void GetLinedefs()
 }
 
 
-void GetLinedefsHexen()
+void GetLinedefsHexen(const std::vector<uint8_t>& lump)
 {
-	int count = 0;
+	int count = (int)(lump.size() / sizeof(raw_hexen_linedef_t));
 
-	Lump_c *lump = FindLevelLump("LINEDEFS");
-
-	if (lump)
-		count = lump->Length() / (int)sizeof(raw_hexen_linedef_t);
-
-	if (lump == NULL || count == 0)
+	if (count == 0)
 		return;
 
-	if (! lump->Seek(0))
-		cur_info->FatalError("Error seeking to linedefs.\n");
+	const uint8_t *data = lump.data();
 
 #if DEBUG_LOAD
 	cur_info->Debug("GetLinedefsHexen: num = %d\n", count);
@@ -1282,8 +1923,7 @@ void GetLinedefsHexen()
 	{
 		raw_hexen_linedef_t raw;
 
-		if (! lump->Read(&raw, sizeof(raw)))
-			cur_info->FatalError("Error reading linedefs.\n");
+		memcpy(&raw, data + (size_t)i * sizeof(raw), sizeof(raw));
 
 		linedef_t *line;
 
@@ -1600,31 +2240,10 @@ void ParseUDMF_Pass(const std::string& data, int pass)
 }
 
 
-void ParseUDMF()
+void ParseUDMF(const std::vector<uint8_t>& lump)
 {
-	Lump_c *lump = FindLevelLump("TEXTMAP");
-
-	if (lump == NULL || ! lump->Seek(0))
-		cur_info->FatalError("Error finding TEXTMAP lump.\n");
-
-	int remain = lump->Length();
-
 	// load the lump into this string
-	std::string data;
-
-	while (remain > 0)
-	{
-		char buffer[4096];
-
-		int want = std::min(remain, (int)sizeof(buffer));
-
-		if (! lump->Read(buffer, want))
-			cur_info->FatalError("Error reading TEXTMAP lump.\n");
-
-		data.append(buffer, want);
-
-		remain -= want;
-	}
+	std::string data((const char *)lump.data(), lump.size());
 
 	// now parse it...
 
@@ -1657,7 +2276,7 @@ void PutVertices()
 	// this size is worst-case scenario
 	int size = num_vertices * (int)sizeof(raw_vertex_t);
 
-	Lump_c *lump = CreateLevelLump("VERTEXES", size);
+	level_lump_c *lump = CreateLevelLump("VERTEXES", size);
 
 	for (i=0, count=0 ; i < num_vertices ; i++)
 	{
@@ -1716,7 +2335,7 @@ void PutSegs()
 	// this size is worst-case scenario
 	int size = num_segs * (int)sizeof(raw_seg_t);
 
-	Lump_c *lump = CreateLevelLump("SEGS", size);
+	level_lump_c *lump = CreateLevelLump("SEGS", size);
 
 	for (int i=0 ; i < num_segs ; i++)
 	{
@@ -1762,7 +2381,7 @@ void PutSubsecs()
 {
 	int size = num_subsecs * (int)sizeof(raw_subsec_t);
 
-	Lump_c * lump = CreateLevelLump("SSECTORS", size);
+	level_lump_c *lump = CreateLevelLump("SSECTORS", size);
 
 	for (int i=0 ; i < num_subsecs ; i++)
 	{
@@ -1791,9 +2410,9 @@ void PutSubsecs()
 }
 
 
-static int node_cur_index;
+static thread_local int node_cur_index;
 
-static void PutOneNode(node_t *node, Lump_c *lump)
+static void PutOneNode(node_t *node, level_lump_c *lump)
 {
 	if (node->r.node)
 		PutOneNode(node->r.node, lump);
@@ -1853,7 +2472,7 @@ void PutNodes(node_t *root)
 	// this can be bigger than the actual size, but never smaller
 	int max_size = (num_nodes + 1) * struct_size;
 
-	Lump_c *lump = CreateLevelLump("NODES", max_size);
+	level_lump_c *lump = CreateLevelLump("NODES", max_size);
 
 	node_cur_index = 0;
 
@@ -1934,17 +2553,15 @@ void SortSegs()
 	std::sort(lev_segs.begin(), lev_segs.end(), Compare_seg_pred());
 
 	// remove unwanted segs
+	// [ their memory is released along with the level ]
 	while (lev_segs.size() > 0 && lev_segs.back()->index == SEG_IS_GARBAGE)
-	{
-		UtilFree((void *) lev_segs.back());
 		lev_segs.pop_back();
-	}
 }
 
 
 /* ----- ZDoom format writing --------------------------- */
 
-void PutZVertices(Lump_c *lump)
+void PutZVertices(level_lump_c *lump)
 {
 	int count, i;
 
@@ -1976,7 +2593,7 @@ void PutZVertices(Lump_c *lump)
 }
 
 
-void PutZSubsecs(Lump_c *lump)
+void PutZSubsecs(level_lump_c *lump)
 {
 	uint32_t raw_num = LE_U32(num_subsecs);
 	lump->Write(&raw_num, 4);
@@ -2011,7 +2628,7 @@ void PutZSubsecs(Lump_c *lump)
 }
 
 
-void PutZSegs(Lump_c *lump)
+void PutZSegs(level_lump_c *lump)
 {
 	uint32_t raw_num = LE_U32(num_segs);
 	lump->Write(&raw_num, 4);
@@ -2041,7 +2658,7 @@ void PutZSegs(Lump_c *lump)
 }
 
 
-void PutXGL3Segs(Lump_c *lump)
+void PutXGL3Segs(level_lump_c *lump)
 {
 	uint32_t raw_num = LE_U32(num_segs);
 	lump->Write(&raw_num, 4);
@@ -2069,7 +2686,7 @@ void PutXGL3Segs(Lump_c *lump)
 }
 
 
-static void PutOneZNode(Lump_c *lump, node_t *node, bool xgl3)
+static void PutOneZNode(level_lump_c *lump, node_t *node, bool xgl3)
 {
 	raw_zdoom_node_t raw;
 
@@ -2145,7 +2762,7 @@ static void PutOneZNode(Lump_c *lump, node_t *node, bool xgl3)
 }
 
 
-void PutZNodes(Lump_c *lump, node_t *root, bool xgl3)
+void PutZNodes(level_lump_c *lump, node_t *root, bool xgl3)
 {
 	uint32_t raw_num = LE_U32(num_nodes);
 	lump->Write(&raw_num, 4);
@@ -2183,7 +2800,7 @@ void SaveZDFormat(node_t *root_node)
 
 	int max_size = CalcZDoomNodesSize();
 
-	Lump_c *lump = CreateLevelLump("NODES", max_size);
+	level_lump_c *lump = CreateLevelLump("NODES", max_size);
 
 	lump->Write(XNOD_MAGIC, 4);
 
@@ -2197,7 +2814,7 @@ void SaveZDFormat(node_t *root_node)
 }
 
 
-void SaveXGL3Format(Lump_c *lump, node_t *root_node)
+void SaveXGL3Format(level_lump_c *lump, node_t *root_node)
 {
 	SortSegs();
 
@@ -2219,6 +2836,13 @@ void SaveXGL3Format(Lump_c *lump, node_t *root_node)
 
 void LoadLevel()
 {
+	std::unique_lock<std::recursive_mutex> guard(wad_lock);
+
+	phase_timer_c timer(STAT_Load);
+
+	lev_current_start = cur_wad->LevelHeader(lev_current_idx);
+	lev_format        = cur_wad->LevelFormat(lev_current_idx);
+
 	Lump_c *LEV = cur_wad->GetLump(lev_current_start);
 
 	lev_current_name = LEV->Name();
@@ -2227,28 +2851,48 @@ void LoadLevel()
 
 	cur_info->ShowMap(lev_current_name);
 
+	// copy the raw lumps, everything else only touches our own level
+	std::vector<uint8_t> textmap;
+	std::vector<uint8_t> vertexes, sectors, sidedefs, linedefs, things;
+
+	if (lev_format == MAPF_UDMF)
+	{
+		if (! CopyLevelLump("TEXTMAP", textmap))
+			cur_info->FatalError("Error finding TEXTMAP lump.\n");
+	}
+	else
+	{
+		CopyLevelLump("VERTEXES", vertexes);
+		CopyLevelLump("SECTORS",  sectors);
+		CopyLevelLump("SIDEDEFS", sidedefs);
+		CopyLevelLump("LINEDEFS", linedefs);
+		CopyLevelLump("THINGS",   things);
+	}
+
+	guard.unlock();
+
 	num_new_vert   = 0;
 	num_real_lines = 0;
 
 	if (lev_format == MAPF_UDMF)
 	{
-		ParseUDMF();
+		ParseUDMF(textmap);
 	}
 	else
 	{
-		GetVertices();
-		GetSectors();
-		GetSidedefs();
+		GetVertices(vertexes);
+		GetSectors(sectors);
+		GetSidedefs(sidedefs);
 
 		if (lev_format == MAPF_Hexen)
 		{
-			GetLinedefsHexen();
-			GetThingsHexen();
+			GetLinedefsHexen(linedefs);
+			GetThingsHexen(things);
 		}
 		else
 		{
-			GetLinedefs();
-			GetThings();
+			GetLinedefs(linedefs);
+			GetThings(things);
 		}
 
 		// always prune vertices at end of lump, otherwise all the
@@ -2259,11 +2903,17 @@ void LoadLevel()
 	cur_info->Print_Verbose("    Loaded %d vertices, %d sectors, %d sides, %d lines, %d things\n",
 				num_vertices, num_sectors, num_sidedefs, num_linedefs, num_things);
 
+	timer.Switch(STAT_Overlaps);
+
 	DetectOverlappingVertices();
 	DetectOverlappingLines();
 
+	timer.Switch(STAT_WallTips);
+
 	CalculateWallTips();
 
+	timer.Switch(STAT_Load);
+
 	// -JL- Find sectors containing polyobjs
 	switch (lev_format)
 	{
@@ -2286,10 +2936,23 @@ void FreeLevel()
 	FreeNodes();
 	FreeWallTips();
 	FreeIntersections();
+	FreeOutput();
 }
 
 
 static void AddMissingLump(const char *name, const char *after)
+{
+	cur_level->output.push_back(new level_lump_c(LUMP_AddMissing, name, after));
+}
+
+
+static void RemoveZNodes()
+{
+	cur_level->output.push_back(new level_lump_c(LUMP_RemoveZNodes, "ZNODES"));
+}
+
+
+static void WadMissingLump(const char *name, const char *after)
 {
 	if (cur_wad->LevelLookupLump(lev_current_idx, name) >= 0)
 		return;
@@ -2313,8 +2976,9 @@ static void AddMissingLump(const char *name, const char *after)
 build_result_e SaveLevel(node_t *root_node)
 {
 	// Note: root_node may be NULL
+	// [ nothing is written to the wad here, see WriteLevel() ]
 
-	cur_wad->BeginWrite();
+	phase_timer_c timer(STAT_Write);
 
 	// ensure all necessary level lumps are present
 	AddMissingLump("SEGS",     "VERTEXES");
@@ -2340,7 +3004,7 @@ build_result_e SaveLevel(node_t *root_node)
 
 		if (cur_info->ssect_xgl3)
 		{
-			Lump_c *lump = CreateLevelLump("SSECTORS");
+			level_lump_c *lump = CreateLevelLump("SSECTORS");
 			SaveXGL3Format(lump, root_node);
 		}
 		else
@@ -2350,9 +3014,13 @@ build_result_e SaveLevel(node_t *root_node)
 
 		if (lev_force_xnod)
 		{
+			timer.Switch(STAT_Normalise);
+
 			// remove all the mini-segs from subsectors
 			NormaliseBspTree();
 
+			timer.Switch(STAT_Write);
+
 			SaveZDFormat(root_node);
 		}
 		else
@@ -2362,6 +3030,8 @@ build_result_e SaveLevel(node_t *root_node)
 	}
 	else
 	{
+		timer.Switch(STAT_Normalise);
+
 		// remove all the mini-segs from subsectors
 		NormaliseBspTree();
 
@@ -2370,6 +3040,8 @@ build_result_e SaveLevel(node_t *root_node)
 		// are removed from subsectors.
 		RoundOffBspTree();
 
+		timer.Switch(STAT_Write);
+
 		SortSegs();
 
 		PutVertices();
@@ -2380,10 +3052,13 @@ build_result_e SaveLevel(node_t *root_node)
 	}
 
 
+	timer.Switch(STAT_Blockmap);
+
 	PutBlockmap();
-	PutReject();
 
-	cur_wad->EndWrite();
+	timer.Switch(STAT_Reject);
+
+	PutReject();
 
 	if (lev_overflows)
 	{
@@ -2400,16 +3075,12 @@ build_result_e SaveLevel(node_t *root_node)
 
 build_result_e SaveUDMF(node_t *root_node)
 {
-	cur_wad->BeginWrite();
+	phase_timer_c timer(STAT_Write);
 
 	// remove any existing ZNODES lump
-	cur_wad->RemoveZNodes(lev_current_idx);
+	RemoveZNodes();
 
-	Lump_c *lump = CreateLevelLump("ZNODES", -1);
-
-	// [EA] Ensure needed lumps exist
-	AddMissingLump("REJECT",   "ZNODES");
-	AddMissingLump("BLOCKMAP", "REJECT");
+	level_lump_c *lump = CreateLevelLump("ZNODES", -1);
 
 	if (num_real_lines == 0)
 	{
@@ -2420,11 +3091,19 @@ build_result_e SaveUDMF(node_t *root_node)
 		SaveXGL3Format(lump, root_node);
 	}
 
+	// [EA] Ensure needed lumps exist
+	// (only after ZNODES is finished, one lump is written at a time)
+	AddMissingLump("REJECT",   "ZNODES");
+	AddMissingLump("BLOCKMAP", "REJECT");
+
 	// [EA]
+	timer.Switch(STAT_Blockmap);
+
 	PutBlockmap();
-	PutReject();
 
-	cur_wad->EndWrite();
+	timer.Switch(STAT_Reject);
+
+	PutReject();
 
 	return BUILD_OK;
 }
@@ -2432,6 +3111,33 @@ build_result_e SaveUDMF(node_t *root_node)
 
 /* ---------------------------------------------------------------- */
 
+level_lump_c::level_lump_c(level_lump_e _action, const char *_name, const char *_after, int _max_size) :
+	action(_action), name(_name), after(_after), max_size(_max_size), data()
+{
+	if (max_size > 0)
+		data.reserve(max_size);
+}
+
+
+bool level_lump_c::Write(const void *ptr, int len)
+{
+	SYS_ASSERT(ptr && len > 0);
+
+	const uint8_t *bytes = (const uint8_t *)ptr;
+
+	data.insert(data.end(), bytes, bytes + len);
+
+	return true;
+}
+
+
+bool level_lump_c::Finish()
+{
+	// nothing to do, the lump is written by WriteLevel()
+	return true;
+}
+
+
 Lump_c * FindLevelLump(const char *name)
 {
 	int idx = cur_wad->LevelLookupLump(lev_current_idx, name);
@@ -2443,7 +3149,17 @@ Lump_c * FindLevelLump(const char *name)
 }
 
 
-Lump_c * CreateLevelLump(const char *name, int max_size)
+level_lump_c * CreateLevelLump(const char *name, int max_size)
+{
+	level_lump_c *lump = new level_lump_c(LUMP_Create, name, NULL, max_size);
+
+	cur_level->output.push_back(lump);
+
+	return lump;
+}
+
+
+static Lump_c * WadLevelLump(const char *name, int max_size)
 {
 	// look for existing one
 	Lump_c *lump = FindLevelLump(name);
@@ -2470,6 +3186,53 @@ Lump_c * CreateLevelLump(const char *name, int max_size)
 }
 
 
+void WriteLevel()
+{
+	// only this part of saving a level needs the wad, everything has
+	// been formatted beforehand.  the steps are applied in the order
+	// they were made, so the wad ends up the same as when writing it
+	// directly.
+
+	if (cur_level->output.empty())
+		return;
+
+	std::lock_guard<std::recursive_mutex> guard(wad_lock);
+
+	phase_timer_c timer(STAT_Write);
+
+	cur_wad->BeginWrite();
+
+	for (level_lump_c *L : cur_level->output)
+	{
+		switch (L->action)
+		{
+			case LUMP_Create:
+			{
+				Lump_c *lump = WadLevelLump(L->name, L->max_size);
+
+				if (! L->data.empty())
+					lump->Write(L->data.data(), (int)L->data.size());
+
+				lump->Finish();
+				break;
+			}
+
+			case LUMP_AddMissing:
+				WadMissingLump(L->name, L->after);
+				break;
+
+			case LUMP_RemoveZNodes:
+				cur_wad->RemoveZNodes(lev_current_idx);
+				break;
+		}
+	}
+
+	cur_wad->EndWrite();
+
+	FreeOutput();
+}
+
+
 //------------------------------------------------------------------------
 // MAIN STUFF
 //------------------------------------------------------------------------
@@ -2495,14 +3258,31 @@ void OpenWad(const char *filename)
 
 		cur_info->FatalError("file is read only: %s\n", filename);
 	}
+
+	// the directory is only written once, when the wad is closed
+	cur_wad->BeginSession(cur_info->compact);
+}
+
+
+void OpenWadMemory(const char *name, std::vector<uint8_t> *data)
+{
+	cur_wad = Wad_file::OpenMemory(name, data);
+	if (cur_wad == NULL)
+		cur_info->FatalError("not a wad file: %s\n", name);
+
+	// there is no file to keep valid, so the wad is always written
+	// afresh, without any gaps.
+	cur_wad->BeginSession(true);
 }
 
 
 void CloseWad()
 {
+	std::lock_guard<std::recursive_mutex> guard(wad_lock);
+
 	if (cur_wad != NULL)
 	{
-		// this closes the file
+		// this commits the write session and closes the file
 		delete cur_wad;
 		cur_wad = NULL;
 	}
@@ -2530,17 +3310,9 @@ const char * GetLevelName(int lev_idx)
 
 /* ----- build nodes for a single level ----- */
 
-build_result_e BuildLevel(int lev_idx)
+static build_result_e BuildLevelNodes(node_t **root_node)
 {
-	if (cur_info->cancelled)
-		return BUILD_Cancelled;
-
-	node_t   *root_node = NULL;
-	subsec_t *root_sub  = NULL;
-
-	lev_current_idx   = lev_idx;
-	lev_current_start = cur_wad->LevelHeader(lev_idx);
-	lev_format        = cur_wad->LevelFormat(lev_idx);
+	subsec_t *root_sub = NULL;
 
 	LoadLevel();
 
@@ -2550,50 +3322,316 @@ build_result_e BuildLevel(int lev_idx)
 
 	if (num_real_lines > 0)
 	{
+		phase_timer_c timer(STAT_Nodes);
+
 		bbox_t dummy;
 
 		// create initial segs
 		seg_t *list = CreateSegs();
 
 		// recursively create nodes
-		ret = BuildNodes(list, 0, &dummy, &root_node, &root_sub);
+		if (cur_info->threads != 1)
+			ret = BuildNodesThreaded(list, &dummy, root_node, &root_sub);
+		else
+			ret = BuildNodes(list, 0, &dummy, root_node, &root_sub);
 	}
 
 	if (ret == BUILD_OK)
 	{
+		level_stats_t& stats = cur_level->stats;
+
+		stats.nodes    = num_nodes;
+		stats.subsecs  = num_subsecs;
+		stats.segs     = num_segs;
+		stats.vertices = num_old_vert + num_new_vert;
+
 		cur_info->Print_Verbose("    Built %d NODES, %d SSECTORS, %d SEGS, %d VERTEXES\n",
 				num_nodes, num_subsecs, num_segs, num_old_vert + num_new_vert);
 
-		if (root_node != NULL)
+		if (*root_node != NULL)
 		{
 			cur_info->Print_Verbose("    Heights of subtrees: %d / %d\n",
-					ComputeBspHeight(root_node->r.node),
-					ComputeBspHeight(root_node->l.node));
+					ComputeBspHeight((*root_node)->r.node),
+					ComputeBspHeight((*root_node)->l.node));
 		}
 
-		ClockwiseBspTree();
+		phase_timer_c timer(STAT_Clockwise);
 
-		switch (lev_format)
-		{
-			case MAPF_Doom:
-			case MAPF_Hexen: ret = SaveLevel(root_node); break;
-			case MAPF_UDMF:  ret = SaveUDMF(root_node);  break;
-			default: break;
-		}
+		ClockwiseBspTree();
 	}
 	else
 	{
 		/* build was Cancelled by the user */
 	}
 
+	return ret;
+}
+
+
+static build_result_e BuildLevelSave(node_t *root_node)
+{
+	switch (lev_format)
+	{
+		case MAPF_Doom:
+		case MAPF_Hexen: return SaveLevel(root_node);
+		case MAPF_UDMF:  return SaveUDMF(root_node);
+		default: break;
+	}
+
+	return BUILD_OK;
+}
+
+
+build_result_e BuildLevel(int lev_idx, level_stats_t *stats)
+{
+	if (stats != NULL)
+		stats->Clear();
+
+	if (cur_info->cancelled)
+		return BUILD_Cancelled;
+
+	level_t level;
+
+	cur_level = &level;
+
+	lev_current_idx = lev_idx;
+
+	node_t *root_node = NULL;
+
+	build_result_e ret = BuildLevelNodes(&root_node);
+
+	if (ret == BUILD_OK)
+		ret = BuildLevelSave(root_node);
+
+	WriteLevel();
+
 	FreeLevel();
 
+	level.stats.peak_memory = PeakMemory();
+
+	if (stats != NULL)
+		*stats = level.stats;
+
+	cur_level = NULL;
+
 	return ret;
 }
 
 
+/* ----- load a level without building it ----- */
+
+void BeginLevel(int lev_idx, level_t *level)
+{
+	cur_level = level;
+
+	lev_current_idx = lev_idx;
+
+	LoadLevel();
+}
+
+
+void EndLevel()
+{
+	FreeLevel();
+
+	cur_level = NULL;
+}
+
+
+/* ----- build nodes for several levels at once ----- */
+
+class level_queue_c
+{
+	// this is shared by all the threads in BuildLevels().
+	// threads take levels from the queue in order, and build them
+	// independently, but only save a level when every level before
+	// it in the queue has been saved.  the wad therefore gets updated
+	// in exactly the same way as when building one level at a time.
+
+public:
+	const int *lev_list;
+	build_result_e *results;
+	level_stats_t *stats;
+	int count;
+
+	// next position in lev_list to be taken by a thread
+	std::atomic<int> next_pos;
+
+	// position in lev_list which is allowed to be saved
+	int save_pos;
+
+	// set when a level was cancelled, nothing more is saved
+	std::atomic<bool> stopped;
+
+	std::mutex save_lock;
+	std::condition_variable save_cond;
+
+public:
+	level_queue_c(const int *_list, build_result_e *_res, level_stats_t *_stats, int _count) :
+		lev_list(_list), results(_res), stats(_stats), count(_count),
+		next_pos(0), save_pos(0), stopped(false)
+	{ }
+
+	void ProcessLevel(int pos)
+	{
+		level_t level;
+
+		cur_level = &level;
+
+		lev_current_idx = lev_list[pos];
+
+		node_t *root_node = NULL;
+
+		build_result_e ret = BUILD_Cancelled;
+
+		if (! cur_info->cancelled && ! stopped)
+			ret = BuildLevelNodes(&root_node);
+
+		// prepare everything to be saved while other levels are
+		// being written, only WriteLevel() needs to wait.
+		if (ret == BUILD_OK && ! stopped)
+			ret = BuildLevelSave(root_node);
+
+		// wait until all previous levels have been saved
+		{
+			std::unique_lock<std::mutex> guard(save_lock);
+
+			save_cond.wait(guard, [this, pos] { return save_pos == pos; });
+
+			if (stopped)
+				ret = BUILD_Cancelled;
+			else
+				WriteLevel();
+
+			if (ret == BUILD_Cancelled)
+				stopped = true;
+
+			results[pos] = ret;
+			save_pos += 1;
+		}
+
+		save_cond.notify_all();
+
+		FreeLevel();
+
+		level.stats.peak_memory = PeakMemory();
+
+		if (stats != NULL)
+			stats[pos] = level.stats;
+
+		cur_level = NULL;
+	}
+
+	void Run()
+	{
+		for (;;)
+		{
+			int pos = next_pos++;
+
+			if (pos >= count)
+				return;
+
+			ProcessLevel(pos);
+		}
+	}
+};
+
+
+void BuildLevels(const int *lev_list, build_result_e *results, int count,
+		level_stats_t *stats)
+{
+	int jobs = cur_info->jobs;
+
+	if (jobs <= 0)
+		jobs = (int)std::thread::hardware_concurrency();
+
+	jobs = std::max(1, std::min(jobs, count));
+
+	level_queue_c queue(lev_list, results, stats, count);
+
+	// the main thread does its share of the work too
+	std::vector<std::thread> threads;
+
+	for (int i = 1 ; i < jobs ; i++)
+		threads.push_back(std::thread(&level_queue_c::Run, &queue));
+
+	queue.Run();
+
+	for (size_t i = 0 ; i < threads.size() ; i++)
+		threads[i].join();
+}
+
+
+
+const char * StatPhaseName(int phase)
+{
+	switch (phase)
+	{
+		case STAT_Load:      return "load";
+		case STAT_Overlaps:  return "overlaps";
+		case STAT_WallTips:  return "walltips";
+		case STAT_Nodes:     return "nodes";
+		case STAT_Clockwise: return "clockwise";
+		case STAT_Normalise: return "normalise";
+		case STAT_Blockmap:  return "blockmap";
+		case STAT_Reject:    return "reject";
+		case STAT_Write:     return "write";
+		default: break;
+	}
+
+	return "???";
+}
+
+
 }  // namespace elfbsp
 
 
+//------------------------------------------------------------------------
+
+void level_stats_t::Clear()
+{
+	for (int i = 0 ; i < NUM_STAT_PHASES ; i++)
+	{
+		wall[i] = 0;
+		cpu [i] = 0;
+	}
+
+	eval_calls = 0;
+	eval_early = 0;
+	seg_splits = 0;
+	minisegs   = 0;
+
+	nodes    = 0;
+	subsecs  = 0;
+	segs     = 0;
+	vertices = 0;
+
+	peak_memory = 0;
+}
+
+
+void level_stats_t::Add(const level_stats_t& other)
+{
+	for (int i = 0 ; i < NUM_STAT_PHASES ; i++)
+	{
+		wall[i] += other.wall[i];
+		cpu [i] += other.cpu [i];
+	}
+
+	eval_calls += other.eval_calls;
+	eval_early += other.eval_early;
+	seg_splits += other.seg_splits;
+	minisegs   += other.minisegs;
+
+	nodes    += other.nodes;
+	subsecs  += other.subsecs;
+	segs     += other.segs;
+	vertices += other.vertices;
+
+	if (peak_memory < other.peak_memory)
+		peak_memory = other.peak_memory;
+}
+
+
 //--- editor settings ---
 // vi:ts=4:sw=4:noexpandtab
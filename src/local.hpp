@@ -23,9 +23,11 @@
 #define __ELFBSP_LOCAL_H__
 
 #include <algorithm>
+#include <cstdint>
 #include <vector>
 
 #include "elfbsp.hpp"
+#include "utility.hpp"
 
 namespace elfbsp
 {
@@ -100,6 +102,7 @@ void PutReject();
 class node_t;
 class sector_t;
 class quadtree_c;
+class intersection_t;
 
 
 // a wall-tip is where a wall meets a vertex
@@ -274,6 +277,11 @@ public:
 	// must also be split.
 	seg_t *partner;
 
+	// when true, the partner seg is being built by another task and
+	// must not be split along with this seg.  Only used when building
+	// with several threads (see BuildNodesThreaded).
+	bool detached;
+
 	// seg index.  Only valid once the seg has been added to a
 	// subsector.  A negative value means it is invalid -- there
 	// shouldn't be any of these once the BSP tree has been built.
@@ -405,9 +413,30 @@ public:
 };
 
 
+class seg_pack_t
+{
+	// a copy of the segs in a quadtree, stored as separate arrays so
+	// that several segs can be checked against a partition line at the
+	// same time (using SIMD instructions).  See EvalPartitionWorker.
+
+public:
+	std::vector<double> sx, sy;
+	std::vector<double> ex, ey;
+
+	// index of the source linedef (as a double, for easy comparison)
+	std::vector<double> line;
+
+	// non-zero for real segs, zero for minisegs
+	std::vector<uint8_t> real;
+
+	std::vector<seg_t *> segs;
+};
+
+
 class quadtree_c
 {
-	// NOTE: not a real quadtree, division is always binary.
+	// NOTE: not a real quadtree, it is a kd-tree: division is always
+	//       binary, along a line which depends on where the segs are.
 
 public:
 	// coordinates on map for this block, from lower-left corner to
@@ -416,11 +445,19 @@ public:
 	int x1, y1;
 	int x2, y2;
 
-	// sub-trees.  NULL for leaf nodes.
+	// sub-trees.  NULL for leaf nodes, and when that side is empty.
 	// [0] has the lower coordinates, and [1] has the higher coordinates.
-	// Division of a square always occurs horizontally (e.g. 512x512 -> 256x512).
+	// The box of a sub-tree is the bounding box of its segs, hence the
+	// two boxes may not touch each other.
 	quadtree_c *subs[2];
 
+	// how this node was divided: 'split_axis' is 0 for a vertical line
+	// at x = split_mid, 1 for a horizontal line at y = split_mid, or -1
+	// when the node was never divided.  a sub-tree only holds segs lying
+	// wholly on its side of the line.
+	int split_axis;
+	double split_mid;
+
 	// count of real/mini segs contained in this node AND ALL CHILDREN.
 	int real_num;
 	int mini_num;
@@ -428,13 +465,48 @@ public:
 	// list of segs completely contained in this node.
 	seg_t *list;
 
+	// packed copy of 'list' (in the same order), which lives at
+	// [pack_first .. pack_first+pack_num-1] of the pack arrays.
+	// the arrays belong to the root node, 'pack' is NULL elsewhere
+	// (and in the root too, until Pack() has been called).
+	seg_pack_t *pack;
+	int pack_first;
+	int pack_num;
+
 public:
 	quadtree_c(int _x1, int _y1, int _x2, int _y2);
 	~quadtree_c();
 
-	void AddSeg(seg_t *seg);
+	// nodes come from a pool, see node.cpp
+	static void * operator new(size_t size);
+	static void operator delete(void *ptr);
+
+	// add all the segs in the list, building the sub-trees.
+	// can only be used once, on a new (empty) tree.
 	void AddList(seg_t *list);
 
+	// add a single seg to the deepest node which can hold it,
+	// enlarging the boxes on the way.  the counts are not updated.
+	void AddSeg(seg_t *seg);
+
+	// remove the sub-trees and divide the node again, as AddList()
+	// would do with all the segs of the node and its sub-trees.
+	void Redivide();
+
+	// recompute the seg counts of the whole tree.  they become stale
+	// when a partner seg in the tree gets split (see SplitSeg).
+	void Recount();
+
+	// make a copy of the tree structure in the pool of the current
+	// thread, sharing the seg lists.  the original must be deleted by
+	// the thread which created it.
+	quadtree_c * Clone() const;
+
+	// build the packed copy of the segs for the whole tree.
+	// only valid on the root node, and the segs must not change
+	// afterwards (until the tree is converted back to a list).
+	void Pack();
+
 	inline bool Empty() const
 	{
 		return (real_num + mini_num) == 0;
@@ -446,21 +518,123 @@ public:
 	// returns -1 or +1 if box is definitively on a particular side,
 	// or 0 if the line intersects or touches the box.
 	int OnLineSide(const seg_t *part) const;
+
+private:
+	void AddSegs(seg_t **segs, int count, std::vector<double>& centres);
+	int  Divide(seg_t **segs, int count, std::vector<double>& centres);
+
+	quadtree_c * NewSubTree(seg_t **segs, int count, std::vector<double>& centres);
+};
+
+
+/* ----- Level output ----------------------- */
+
+typedef enum
+{
+	LUMP_Create = 0,    // create (or recreate) the lump with this data
+	LUMP_AddMissing,    // add an empty lump after 'after' if not present
+	LUMP_RemoveZNodes,  // remove any existing ZNODES lump
+
+} level_lump_e;
+
+class level_lump_c
+{
+	// one step of updating the wad with a built level.  the new lumps
+	// are formatted in memory without touching the wad, and WriteLevel()
+	// later applies all the steps in order, while the wad is locked.
+
+public:
+	level_lump_e action;
+
+	// these are always string constants
+	const char *name;
+	const char *after;
+
+	// size hint for LUMP_Create, see Wad_file::AddLump()
+	int max_size;
+
+	std::vector<uint8_t> data;
+
+public:
+	level_lump_c(level_lump_e _action, const char *_name, const char *_after = NULL, int _max_size = -1);
+
+	// these mimic the methods of Lump_c
+	bool Write(const void *ptr, int len);
+	bool Finish();
 };
 
 
 /* ----- Level data arrays ----------------------- */
 
-extern std::vector<vertex_t *>  lev_vertices;
-extern std::vector<linedef_t *> lev_linedefs;
-extern std::vector<sidedef_t *> lev_sidedefs;
-extern std::vector<sector_t *>  lev_sectors;
-extern std::vector<thing_t *>   lev_things;
+class level_t
+{
+	// all the objects belonging to a single level which is being built.
+	// each level has its own instance, allowing several levels to be
+	// built at the same time by different threads (see --jobs).
 
-extern std::vector<seg_t *>     lev_segs;
-extern std::vector<subsec_t *>  lev_subsecs;
-extern std::vector<node_t *>    lev_nodes;
-extern std::vector<walltip_t *> lev_walltips;
+public:
+	// objects of loaded level, and stuff we've built
+	std::vector<vertex_t *>  vertices;
+	std::vector<linedef_t *> linedefs;
+	std::vector<sidedef_t *> sidedefs;
+	std::vector<sector_t *>  sectors;
+	std::vector<thing_t *>   things;
+
+	std::vector<seg_t *>     segs;
+	std::vector<subsec_t *>  subsecs;
+	std::vector<node_t *>    nodes;
+	std::vector<walltip_t *> walltips;
+
+	// intersections allocated while building nodes
+	std::vector<intersection_t *> cuts;
+
+	// memory of the objects above (except intersections), with a
+	// separate arena for each kind so similar objects stay together.
+	arena_c vertex_mem;
+	arena_c linedef_mem;
+	arena_c sidedef_mem;
+	arena_c sector_mem;
+	arena_c thing_mem;
+
+	arena_c seg_mem;
+	arena_c subsec_mem;
+	arena_c node_mem;
+	arena_c walltip_mem;
+
+	int old_vert_count;
+	int new_vert_count;
+
+	// timing and counters, see BuildLevel()
+	level_stats_t stats;
+
+	// the changes to the wad, in order, see WriteLevel()
+	std::vector<level_lump_c *> output;
+
+public:
+	level_t() : old_vert_count(0), new_vert_count(0)
+	{ }
+};
+
+// the level being built by the current thread
+extern thread_local level_t * cur_level;
+
+// load a level of the current wad into 'level', which becomes the
+// current level, without building anything.  this lets the parts of
+// the node builder be run (and measured) on their own, see bench/.
+// EndLevel() frees the level again.
+void BeginLevel(int lev_idx, level_t *level);
+void EndLevel();
+
+#define lev_vertices  (cur_level->vertices)
+#define lev_linedefs  (cur_level->linedefs)
+#define lev_sidedefs  (cur_level->sidedefs)
+#define lev_sectors   (cur_level->sectors)
+#define lev_things    (cur_level->things)
+
+#define lev_segs      (cur_level->segs)
+#define lev_subsecs   (cur_level->subsecs)
+#define lev_nodes     (cur_level->nodes)
+#define lev_walltips  (cur_level->walltips)
 
 #define num_vertices  ((int)lev_vertices.size())
 #define num_linedefs  ((int)lev_linedefs.size())
@@ -473,8 +647,8 @@ extern std::vector<walltip_t *> lev_walltips;
 #define num_nodes     ((int)lev_nodes.size())
 #define num_walltips  ((int)lev_walltips.size())
 
-extern int num_old_vert;
-extern int num_new_vert;
+#define num_old_vert  (cur_level->old_vert_count)
+#define num_new_vert  (cur_level->new_vert_count)
 
 
 /* ----- function prototypes ----------------------- */
@@ -491,9 +665,12 @@ subsec_t  *NewSubsec();
 node_t    *NewNode();
 walltip_t *NewWallTip();
 
-Lump_c * CreateLevelLump(const char *name, int max_size = -1);
+level_lump_c * CreateLevelLump(const char *name, int max_size = -1);
 Lump_c * FindLevelLump(const char *name);
 
+// apply the output of the current level to the wad
+void WriteLevel();
+
 /* limit flags, to show what went wrong */
 #define LIMIT_VERTEXES     0x000001
 #define LIMIT_SECTORS      0x000002
@@ -582,6 +759,12 @@ public:
 
 /* -------- functions ---------------------------- */
 
+// evaluate a partition seg against all the segs in the tree, giving
+// its cost, or a negative value if it cannot be used.  the evaluation
+// stops early once the cost goes above 'best_cost'.  the call (and
+// any early stop) is counted in 'stats'.
+double EvalPartition(quadtree_c *tree, seg_t *part, double best_cost, level_stats_t *stats);
+
 // scan all the segs in the list, and choose the best seg to use as a
 // partition line, returning it.  If no seg can be used, returns NULL.
 // The 'depth' parameter is the current depth in the tree, used for
@@ -595,24 +778,27 @@ void FindLimits2(seg_t *list, bbox_t *bbox);
 // determine it's fate: moving it into either the left or right lists
 // (perhaps both, when splitting it in two).  Handles partners as
 // well.  Updates the intersection list if the seg lies on or crosses
-// the partition line.
+// the partition line, and enlarges the bounding box of the list(s)
+// receiving the seg.
 void DivideOneSeg(seg_t *cur, seg_t *part,
-		quadtree_c *left_list, quadtree_c *right_list,
+		seg_t ** left_list, seg_t ** right_list,
+		bbox_t *left_box, bbox_t *right_box,
 		intersection_t ** cut_list);
 
-// remove all the segs from the list, partitioning them into the left
-// or right lists based on the given partition line.  Adds any
+// remove all the segs from the tree, partitioning them into the left
+// or right trees based on the given partition line.  The new trees
+// have the same shape as the given one (minus the empty parts), and
+// each seg goes into the same place on its side.  Adds any
 // intersections into the intersection list as it goes.
-void SeparateSegs(quadtree_c *seg_list, seg_t *part,
-		quadtree_c *left_list, quadtree_c *right_list,
+void SeparateSegs(quadtree_c *tree, seg_t *part,
+		quadtree_c ** left_tree, quadtree_c ** right_tree,
 		intersection_t ** cut_list);
 
 // analyse the intersection list, and add any needed minisegs to the
-// given seg lists (one miniseg on each side).  All the intersection
+// given trees (one miniseg on each side).  All the intersection
 // structures will be freed back into a quick-alloc list.
-void AddMinisegs(seg_t *part,
-		quadtree_c *left_list, quadtree_c *right_list,
-		intersection_t *cut_list);
+void AddMinisegs(intersection_t *cut_list, seg_t *part,
+		quadtree_c *left_tree, quadtree_c *right_tree);
 
 void FreeIntersections(void);
 
@@ -626,7 +812,7 @@ void FreeIntersections(void);
 // seg (or seg pair).  Returns the list of segs.
 seg_t *CreateSegs();
 
-quadtree_c *TreeFromSegList(seg_t *list);
+quadtree_c *TreeFromSegList(seg_t *list, const bbox_t *bounds);
 
 // takes the seg list and determines if it is convex.  When it is, the
 // segs are converted to a subsector, and '*S' is the new subsector
@@ -638,6 +824,12 @@ quadtree_c *TreeFromSegList(seg_t *list);
 build_result_e BuildNodes(seg_t *list, int depth, bbox_t *bounds /* output */,
 		node_t ** N, subsec_t ** S);
 
+// same as BuildNodes() for the whole level, but the large subtrees are
+// built by several threads at the same time (the number of threads is
+// given by the 'threads' field of buildinfo_t).
+build_result_e BuildNodesThreaded(seg_t *list, bbox_t *bounds /* output */,
+		node_t ** N, subsec_t ** S);
+
 // compute the height of the bsp tree, starting at 'node'.
 int ComputeBspHeight(const node_t *node);
 
@@ -19,6 +19,8 @@
 //
 //------------------------------------------------------------------------
 
+#include <mutex>
+
 #include "local.hpp"
 #include "raw_def.hpp"
 #include "system.hpp"
@@ -36,7 +38,10 @@ namespace elfbsp
 
 #define SYS_MSG_BUFLEN  4000
 
-static char message_buf[SYS_MSG_BUFLEN];
+static thread_local char message_buf[SYS_MSG_BUFLEN];
+
+// guards the warning counters when building levels in parallel
+static std::mutex message_lock;
 
 
 void Failure(const char *fmt, ...)
@@ -61,6 +66,8 @@ void Warning(const char *fmt, ...)
 
 	cur_info->Print_Verbose("    WARNING: %s", message_buf);
 
+	std::lock_guard<std::mutex> guard(message_lock);
+
 	cur_info->total_warnings++;
 }
 
@@ -78,6 +85,8 @@ void MinorIssue(const char *fmt, ...)
 		cur_info->Print_Verbose("    ISSUE: %s", message_buf);
 	}
 
+	std::lock_guard<std::mutex> guard(message_lock);
+
 	cur_info->total_minor_issues++;
 }
 
@@ -424,8 +433,7 @@ void PruneVerticesAtEnd(void)
 		if (V->is_used)
 			break;
 
-		UtilFree(V);
-
+		// memory is released along with the level
 		lev_vertices.pop_back();
 	}
 
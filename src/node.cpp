@@ -19,8 +19,13 @@
 //
 //------------------------------------------------------------------------
 
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+
 #include "local.hpp"
 #include "system.hpp"
+#include "task.hpp"
 #include "utility.hpp"
 
 
@@ -58,6 +63,13 @@ namespace elfbsp
 
 #define SEG_FAST_THRESHHOLD  200
 
+// quadtree nodes with this many segs (or fewer) are never divided
+#define QUAD_LEAF_SEGS  16
+
+// a quadtree node copied by SeparateSegs is divided again when one
+// of its sub-trees holds less than this fraction of its segs
+#define QUAD_UNEVEN  8
+
 
 class eval_info_t
 {
@@ -91,23 +103,21 @@ public:
 };
 
 
-std::vector<intersection_t *> alloc_cuts;
-
 intersection_t *NewIntersection()
 {
 	intersection_t *cut = new intersection_t;
 
-	alloc_cuts.push_back(cut);
+	cur_level->cuts.push_back(cut);
 
 	return cut;
 }
 
 void FreeIntersections(void)
 {
-	for (size_t i = 0 ; i < alloc_cuts.size() ; i++)
-		delete alloc_cuts[i];
+	for (size_t i = 0 ; i < cur_level->cuts.size() ; i++)
+		delete cur_level->cuts[i];
 
-	alloc_cuts.clear();
+	cur_level->cuts.clear();
 }
 
 
@@ -158,6 +168,8 @@ seg_t * SplitSeg(seg_t *old_seg, double x, double y)
 	vertex_t *new_vert = NewVertexFromSplitSeg(old_seg, x, y);
 	seg_t    *new_seg  = NewSeg();
 
+	cur_level->stats.seg_splits += 1;
+
 	// copy seg info
 	new_seg[0] = old_seg[0];
 	new_seg->next = NULL;
@@ -174,8 +186,9 @@ seg_t * SplitSeg(seg_t *old_seg, double x, double y)
 #endif
 
 	// handle partners
+	// [ a detached partner is split later, see StitchPartners ]
 
-	if (old_seg->partner)
+	if (old_seg->partner && ! old_seg->detached)
 	{
 #if DEBUG_SPLIT
 		cur_info->Debug("Splitting Partner %p\n", old_seg->partner);
@@ -301,170 +314,431 @@ void AddIntersection(intersection_t ** cut_list,
 
 
 //
-// Returns true if a "bad seg" was found early.
+// Check a single seg against the partition line, updating the info.
+// 'a' and 'b' are the perpendicular distances of its start and end
+// points (zero when the seg comes from the same linedef).
 //
-bool EvalPartitionWorker(quadtree_c *tree, seg_t *part, double best_cost, eval_info_t *info)
+static inline void EvalOneSeg(eval_info_t *info, const seg_t *part, const seg_t *check,
+		double a, double b, double split_cost)
 {
-	double split_cost = cur_info->split_cost;
+	double qnty;
 
-	// -AJA- this is the heart of the superblock idea, it tests the
-	//       *whole* quad against the partition line to quickly handle
-	//       all the segs within it at once.  Only when the partition
-	//       line intercepts the box do we need to go deeper into it.
+	double fa = fabs(a);
+	double fb = fabs(b);
 
-	int side = tree->OnLineSide(part);
+	/* check for being on the same line */
+	if (fa <= DIST_EPSILON && fb <= DIST_EPSILON)
+	{
+		// this seg runs along the same line as the partition.  Check
+		// whether it goes in the same direction or the opposite.
 
-	if (side < 0)
+		if (check->pdx*part->pdx + check->pdy*part->pdy < 0)
+			info->BumpLeft(check->linedef);
+		else
+			info->BumpRight(check->linedef);
+
+		return;
+	}
+
+	// -AJA- check for passing through a vertex.  Normally this is fine
+	//       (even ideal), but the vertex could on a sector that we
+	//       DONT want to split, and the normal linedef-based checks
+	//       may fail to detect the sector being cut in half.  Thanks
+	//       to Janis Legzdinsh for spotting this obscure bug.
+
+	if (fa <= DIST_EPSILON || fb <= DIST_EPSILON)
 	{
-		// LEFT
+		if (check->linedef != NULL && check->linedef->is_precious)
+			info->cost += 40.0 * split_cost * PRECIOUS_MULTIPLY;
+	}
 
-		info->real_left += tree->real_num;
-		info->mini_left += tree->mini_num;
+	/* check for right side */
+	if (a > -DIST_EPSILON && b > -DIST_EPSILON)
+	{
+		info->BumpRight(check->linedef);
 
-		return false;
+		/* check for a near miss */
+		if ((a >= IFFY_LEN && b >= IFFY_LEN) ||
+			(a <= DIST_EPSILON && b >= IFFY_LEN) ||
+			(b <= DIST_EPSILON && a >= IFFY_LEN))
+		{
+			return;
+		}
+
+		info->near_miss++;
+
+		// -AJA- near misses are bad, since they have the potential to
+		//       cause really short minisegs to be created in future
+		//       processing.  Thus the closer the near miss, the higher
+		//       the cost.
+
+		if (a <= DIST_EPSILON || b <= DIST_EPSILON)
+			qnty = IFFY_LEN / std::max(a, b);
+		else
+			qnty = IFFY_LEN / std::min(a, b);
+
+		info->cost += 70.0 * split_cost * (qnty * qnty - 1.0);
+		return;
 	}
-	else if (side > 0)
+
+	/* check for left side */
+	if (a < DIST_EPSILON && b < DIST_EPSILON)
 	{
-		// RIGHT
+		info->BumpLeft(check->linedef);
 
-		info->real_right += tree->real_num;
-		info->mini_right += tree->mini_num;
+		/* check for a near miss */
+		if ((a <= -IFFY_LEN && b <= -IFFY_LEN) ||
+				(a >= -DIST_EPSILON && b <= -IFFY_LEN) ||
+				(b >= -DIST_EPSILON && a <= -IFFY_LEN))
+		{
+			return;
+		}
 
-		return false;
+		info->near_miss++;
+
+		// the closer the miss, the higher the cost (see note above)
+		if (a >= -DIST_EPSILON || b >= -DIST_EPSILON)
+			qnty = IFFY_LEN / -std::min(a, b);
+		else
+			qnty = IFFY_LEN / -std::max(a, b);
+
+		info->cost += 70.0 * split_cost * (qnty * qnty - 1.0);
+		return;
 	}
 
-	/* check partition against all Segs */
+	// When we reach here, we have a and b non-zero and opposite sign,
+	// hence this seg will be split by the partition line.
+
+	info->splits++;
+
+	// If the linedef associated with this seg has a tag >= 900, treat
+	// it as precious; i.e. don't split it unless all other options
+	// are exhausted.  This is used to protect deep water and invisible
+	// lifts/stairs from being messed up accidentally by splits.
 
-	for (seg_t *check=tree->list ; check ; check=check->next)
+	if (check->linedef && check->linedef->is_precious)
+		info->cost += 100.0 * split_cost * PRECIOUS_MULTIPLY;
+	else
+		info->cost += 100.0 * split_cost;
+
+	// -AJA- check if the split point is very close to one end, which
+	//       is an undesirable situation (producing very short segs).
+	//       This is perhaps _one_ source of those darn slime trails.
+	//       Hence the name "IFFY segs", and a rather hefty surcharge.
+
+	if (fa < IFFY_LEN || fb < IFFY_LEN)
 	{
-		// This is the heart of my pruning idea - it catches
-		// bad segs early on. Killough
+		info->iffy++;
 
-		if (info->cost > best_cost)
-			return true;
+		// the closer to the end, the higher the cost
+		qnty = IFFY_LEN / std::min(fa, fb);
+		info->cost += 140.0 * split_cost * (qnty * qnty - 1.0);
+	}
+}
 
-		double qnty;
 
-		double a = 0, fa = 0;
-		double b = 0, fb = 0;
+/* ----- vectorised evaluation ------------------------------------ */
 
-		/* get state of lines' relation to each other */
-		if (check->source_line != part->source_line)
-		{
-			a = part->PerpDist(check->psx, check->psy);
-			b = part->PerpDist(check->pex, check->pey);
+//
+// These check a range of packed segs (see seg_pack_t) against the
+// partition line, giving exactly the same result as checking them
+// one by one with EvalOneSeg().
+//
+// The SIMD code computes the perpendicular distances for several segs
+// at once, and handles the common case of a seg lying well away from
+// the partition (which costs nothing) by merely counting it.  Any other
+// seg is given to EvalOneSeg(), in the original order, so the cost is
+// summed in the same order as the plain loop does.
+//
+// Returns true if a "bad seg" was found early.
+//
 
-			fa = fabs(a);
-			fb = fabs(b);
-		}
+typedef bool (* eval_pack_func_t)(const seg_pack_t *P, int first, int num,
+		const seg_t *part, double best_cost, eval_info_t *info);
 
-		/* check for being on the same line */
-		if (fa <= DIST_EPSILON && fb <= DIST_EPSILON)
-		{
-			// this seg runs along the same line as the partition.  Check
-			// whether it goes in the same direction or the opposite.
+static inline double PartLineIndex(const seg_t *part)
+{
+	return part->source_line ? (double)part->source_line->index : -1.0;
+}
 
-			if (check->pdx*part->pdx + check->pdy*part->pdy < 0)
-				info->BumpLeft(check->linedef);
-			else
-				info->BumpRight(check->linedef);
+static inline int BitCount4(int mask)
+{
+	static const int counts[16] = { 0,1,1,2, 1,2,2,3, 1,2,2,3, 2,3,3,4 };
 
-			continue;
-		}
+	return counts[mask & 15];
+}
 
-		// -AJA- check for passing through a vertex.  Normally this is fine
-		//       (even ideal), but the vertex could on a sector that we
-		//       DONT want to split, and the normal linedef-based checks
-		//       may fail to detect the sector being cut in half.  Thanks
-		//       to Janis Legzdinsh for spotting this obscure bug.
+static bool EvalPackedScalar(const seg_pack_t *P, int first, int num,
+		const seg_t *part, double best_cost, eval_info_t *info)
+{
+	double split_cost = cur_info->split_cost;
+	double part_line  = PartLineIndex(part);
+
+	for (int k = first ; k < first + num ; k++)
+	{
+		double a = 0;
+		double b = 0;
 
-		if (fa <= DIST_EPSILON || fb <= DIST_EPSILON)
+		if (P->line[k] != part_line)
 		{
-			if (check->linedef != NULL && check->linedef->is_precious)
-				info->cost += 40.0 * split_cost * PRECIOUS_MULTIPLY;
+			a = part->PerpDist(P->sx[k], P->sy[k]);
+			b = part->PerpDist(P->ex[k], P->ey[k]);
 		}
 
-		/* check for right side */
-		if (a > -DIST_EPSILON && b > -DIST_EPSILON)
+		EvalOneSeg(info, part, P->segs[k], a, b, split_cost);
+
+		if (info->cost > best_cost)
+			return true;
+	}
+
+	return false;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define EVAL_SSE2  1
+#include <emmintrin.h>
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && ! defined(_MSC_VER)
+#define EVAL_AVX2  1
+#include <immintrin.h>
+#endif
+
+#endif
+
+
+#ifdef EVAL_SSE2
+static bool EvalPackedSSE2(const seg_pack_t *P, int first, int num,
+		const seg_t *part, double best_cost, eval_info_t *info)
+{
+	double split_cost = cur_info->split_cost;
+
+	const __m128d pdx  = _mm_set1_pd(part->pdx);
+	const __m128d pdy  = _mm_set1_pd(part->pdy);
+	const __m128d perp = _mm_set1_pd(part->p_perp);
+	const __m128d len  = _mm_set1_pd(part->p_length);
+	const __m128d line = _mm_set1_pd(PartLineIndex(part));
+
+	const __m128d pos_iffy = _mm_set1_pd( IFFY_LEN);
+	const __m128d neg_iffy = _mm_set1_pd(-IFFY_LEN);
+
+	int k   = first;
+	int end = first + num;
+
+	for ( ; k + 2 <= end ; k += 2)
+	{
+		__m128d same = _mm_cmpeq_pd(_mm_loadu_pd(&P->line[k]), line);
+
+		__m128d a = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(_mm_loadu_pd(&P->sx[k]), pdy),
+							_mm_mul_pd(_mm_loadu_pd(&P->sy[k]), pdx)), perp);
+		__m128d b = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(_mm_loadu_pd(&P->ex[k]), pdy),
+							_mm_mul_pd(_mm_loadu_pd(&P->ey[k]), pdx)), perp);
+
+		a = _mm_andnot_pd(same, _mm_div_pd(a, len));
+		b = _mm_andnot_pd(same, _mm_div_pd(b, len));
+
+		int right = _mm_movemask_pd(_mm_and_pd(_mm_cmpge_pd(a, pos_iffy), _mm_cmpge_pd(b, pos_iffy)));
+		int left  = _mm_movemask_pd(_mm_and_pd(_mm_cmple_pd(a, neg_iffy), _mm_cmple_pd(b, neg_iffy)));
+
+		int real = (P->real[k] ? 1 : 0) | (P->real[k+1] ? 2 : 0);
+
+		info->real_right += BitCount4(right &  real);
+		info->mini_right += BitCount4(right & ~real);
+		info->real_left  += BitCount4(left  &  real);
+		info->mini_left  += BitCount4(left  & ~real);
+
+		int others = ~(right | left) & 3;
+
+		if (others != 0)
 		{
-			info->BumpRight(check->linedef);
+			double A[2], B[2];
 
-			/* check for a near miss */
-			if ((a >= IFFY_LEN && b >= IFFY_LEN) ||
-				(a <= DIST_EPSILON && b >= IFFY_LEN) ||
-				(b <= DIST_EPSILON && a >= IFFY_LEN))
+			_mm_storeu_pd(A, a);
+			_mm_storeu_pd(B, b);
+
+			for (int i = 0 ; i < 2 ; i++)
 			{
-				continue;
+				if (others & (1 << i))
+				{
+					EvalOneSeg(info, part, P->segs[k+i], A[i], B[i], split_cost);
+
+					if (info->cost > best_cost)
+						return true;
+				}
 			}
+		}
+	}
 
-			info->near_miss++;
+	return EvalPackedScalar(P, k, end - k, part, best_cost, info);
+}
+#endif
 
-			// -AJA- near misses are bad, since they have the potential to
-			//       cause really short minisegs to be created in future
-			//       processing.  Thus the closer the near miss, the higher
-			//       the cost.
 
-			if (a <= DIST_EPSILON || b <= DIST_EPSILON)
-				qnty = IFFY_LEN / std::max(a, b);
-			else
-				qnty = IFFY_LEN / std::min(a, b);
+#ifdef EVAL_AVX2
+__attribute__((target("avx2")))
+static bool EvalPackedAVX2(const seg_pack_t *P, int first, int num,
+		const seg_t *part, double best_cost, eval_info_t *info)
+{
+	double split_cost = cur_info->split_cost;
 
-			info->cost += 70.0 * split_cost * (qnty * qnty - 1.0);
-			continue;
-		}
+	const __m256d pdx  = _mm256_set1_pd(part->pdx);
+	const __m256d pdy  = _mm256_set1_pd(part->pdy);
+	const __m256d perp = _mm256_set1_pd(part->p_perp);
+	const __m256d len  = _mm256_set1_pd(part->p_length);
+	const __m256d line = _mm256_set1_pd(PartLineIndex(part));
+
+	const __m256d pos_iffy = _mm256_set1_pd( IFFY_LEN);
+	const __m256d neg_iffy = _mm256_set1_pd(-IFFY_LEN);
+
+	int k   = first;
+	int end = first + num;
+
+	for ( ; k + 4 <= end ; k += 4)
+	{
+		__m256d same = _mm256_cmp_pd(_mm256_loadu_pd(&P->line[k]), line, _CMP_EQ_OQ);
+
+		__m256d a = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(_mm256_loadu_pd(&P->sx[k]), pdy),
+							_mm256_mul_pd(_mm256_loadu_pd(&P->sy[k]), pdx)), perp);
+		__m256d b = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(_mm256_loadu_pd(&P->ex[k]), pdy),
+							_mm256_mul_pd(_mm256_loadu_pd(&P->ey[k]), pdx)), perp);
 
-		/* check for left side */
-		if (a < DIST_EPSILON && b < DIST_EPSILON)
+		a = _mm256_andnot_pd(same, _mm256_div_pd(a, len));
+		b = _mm256_andnot_pd(same, _mm256_div_pd(b, len));
+
+		int right = _mm256_movemask_pd(_mm256_and_pd(_mm256_cmp_pd(a, pos_iffy, _CMP_GE_OQ),
+													 _mm256_cmp_pd(b, pos_iffy, _CMP_GE_OQ)));
+		int left  = _mm256_movemask_pd(_mm256_and_pd(_mm256_cmp_pd(a, neg_iffy, _CMP_LE_OQ),
+													 _mm256_cmp_pd(b, neg_iffy, _CMP_LE_OQ)));
+
+		int real = (P->real[k]   ? 1 : 0) | (P->real[k+1] ? 2 : 0) |
+				   (P->real[k+2] ? 4 : 0) | (P->real[k+3] ? 8 : 0);
+
+		info->real_right += BitCount4(right &  real);
+		info->mini_right += BitCount4(right & ~real);
+		info->real_left  += BitCount4(left  &  real);
+		info->mini_left  += BitCount4(left  & ~real);
+
+		int others = ~(right | left) & 15;
+
+		if (others != 0)
 		{
-			info->BumpLeft(check->linedef);
+			double A[4], B[4];
 
-			/* check for a near miss */
-			if ((a <= -IFFY_LEN && b <= -IFFY_LEN) ||
-					(a >= -DIST_EPSILON && b <= -IFFY_LEN) ||
-					(b >= -DIST_EPSILON && a <= -IFFY_LEN))
+			_mm256_storeu_pd(A, a);
+			_mm256_storeu_pd(B, b);
+
+			for (int i = 0 ; i < 4 ; i++)
 			{
-				continue;
+				if (others & (1 << i))
+				{
+					EvalOneSeg(info, part, P->segs[k+i], A[i], B[i], split_cost);
+
+					if (info->cost > best_cost)
+						return true;
+				}
 			}
+		}
+	}
 
-			info->near_miss++;
+	return EvalPackedScalar(P, k, end - k, part, best_cost, info);
+}
+#endif
 
-			// the closer the miss, the higher the cost (see note above)
-			if (a >= -DIST_EPSILON || b >= -DIST_EPSILON)
-				qnty = IFFY_LEN / -std::min(a, b);
-			else
-				qnty = IFFY_LEN / -std::max(a, b);
 
-			info->cost += 70.0 * split_cost * (qnty * qnty - 1.0);
-			continue;
-		}
+//
+// Choose the best version for this CPU.  NULL means the segs are not
+// packed at all and the plain loop in EvalPartitionWorker is used.
+//
+static eval_pack_func_t SelectEvalPacked()
+{
+#ifdef EVAL_AVX2
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		return EvalPackedAVX2;
+#endif
 
-		// When we reach here, we have a and b non-zero and opposite sign,
-		// hence this seg will be split by the partition line.
+#ifdef EVAL_SSE2
+	return EvalPackedSSE2;
+#else
+	return NULL;
+#endif
+}
 
-		info->splits++;
+static const eval_pack_func_t eval_packed = SelectEvalPacked();
 
-		// If the linedef associated with this seg has a tag >= 900, treat
-		// it as precious; i.e. don't split it unless all other options
-		// are exhausted.  This is used to protect deep water and invisible
-		// lifts/stairs from being messed up accidentally by splits.
 
-		if (check->linedef && check->linedef->is_precious)
-			info->cost += 100.0 * split_cost * PRECIOUS_MULTIPLY;
-		else
-			info->cost += 100.0 * split_cost;
+//
+// Returns true if a "bad seg" was found early.
+//
+bool EvalPartitionWorker(const seg_pack_t *pack, quadtree_c *tree, seg_t *part,
+		double best_cost, eval_info_t *info)
+{
+	double split_cost = cur_info->split_cost;
+
+	// -AJA- this is the heart of the superblock idea, it tests the
+	//       *whole* quad against the partition line to quickly handle
+	//       all the segs within it at once.  Only when the partition
+	//       line intercepts the box do we need to go deeper into it.
+
+	int side = tree->OnLineSide(part);
+
+	if (side < 0)
+	{
+		// LEFT
+
+		info->real_left += tree->real_num;
+		info->mini_left += tree->mini_num;
+
+		return false;
+	}
+	else if (side > 0)
+	{
+		// RIGHT
+
+		info->real_right += tree->real_num;
+		info->mini_right += tree->mini_num;
+
+		return false;
+	}
+
+	/* check partition against all Segs */
 
-		// -AJA- check if the split point is very close to one end, which
-		//       is an undesirable situation (producing very short segs).
-		//       This is perhaps _one_ source of those darn slime trails.
-		//       Hence the name "IFFY segs", and a rather hefty surcharge.
+	if (pack != NULL)
+	{
+		// This is the heart of my pruning idea - it catches
+		// bad segs early on. Killough
+
+		if (info->cost > best_cost)
+			return true;
 
-		if (fa < IFFY_LEN || fb < IFFY_LEN)
+		if (eval_packed(pack, tree->pack_first, tree->pack_num, part, best_cost, info))
+			return true;
+	}
+	else
+	{
+		for (seg_t *check=tree->list ; check ; check=check->next)
 		{
-			info->iffy++;
+			// This is the heart of my pruning idea - it catches
+			// bad segs early on. Killough
+
+			if (info->cost > best_cost)
+				return true;
+
+			double a = 0;
+			double b = 0;
+
+			/* get state of lines' relation to each other */
+			if (check->source_line != part->source_line)
+			{
+				a = part->PerpDist(check->psx, check->psy);
+				b = part->PerpDist(check->pex, check->pey);
+			}
 
-			// the closer to the end, the higher the cost
-			qnty = IFFY_LEN / std::min(fa, fb);
-			info->cost += 140.0 * split_cost * (qnty * qnty - 1.0);
+			EvalOneSeg(info, part, check, a, b, split_cost);
 		}
 	}
 
@@ -477,7 +751,7 @@ bool EvalPartitionWorker(quadtree_c *tree, seg_t *part, double best_cost, eval_i
 
 		if (tree->subs[c] != NULL && ! tree->subs[c]->Empty())
 		{
-			if (EvalPartitionWorker(tree->subs[c], part, best_cost, info))
+			if (EvalPartitionWorker(pack, tree->subs[c], part, best_cost, info))
 				return true;
 		}
 	}
@@ -493,12 +767,14 @@ bool EvalPartitionWorker(quadtree_c *tree, seg_t *part, double best_cost, eval_i
 //       right, and linedefs that are tagged 'precious'.
 //
 // Returns the computed cost, or a negative value if the seg should be
-// skipped altogether.
+// skipped altogether.  The call is counted in 'stats'.
 //
-double EvalPartition(quadtree_c *tree, seg_t *part, double best_cost)
+double EvalPartition(quadtree_c *tree, seg_t *part, double best_cost, level_stats_t *stats)
 {
 	eval_info_t info;
 
+	stats->eval_calls += 1;
+
 	/* initialise info structure */
 	info.cost       = 0;
 	info.splits     = 0;
@@ -510,8 +786,11 @@ double EvalPartition(quadtree_c *tree, seg_t *part, double best_cost)
 	info.mini_left  = 0;
 	info.mini_right = 0;
 
-	if (EvalPartitionWorker(tree, part, best_cost, &info))
+	if (EvalPartitionWorker(tree->pack, tree, part, best_cost, &info))
+	{
+		stats->eval_early += 1;
 		return -1.0;
+	}
 
 	/* make sure there is at least one real seg on each side */
 	if (info.real_left == 0 || info.real_right == 0)
@@ -620,10 +899,10 @@ seg_t *FindFastSeg(quadtree_c *tree)
 	double V_cost = -1.0;
 
 	if (best_H)
-		H_cost = EvalPartition(tree, best_H, 1.0e99);
+		H_cost = EvalPartition(tree, best_H, 1.0e99, &cur_level->stats);
 
 	if (best_V)
-		V_cost = EvalPartition(tree, best_V, 1.0e99);
+		V_cost = EvalPartition(tree, best_V, 1.0e99, &cur_level->stats);
 
 #if DEBUG_PICKNODE
 	cur_info->Debug("FindFastSeg: best_H=%p (cost %1.4f) | best_V=%p (cost %1.4f)\n",
@@ -640,68 +919,328 @@ seg_t *FindFastSeg(quadtree_c *tree)
 }
 
 
-/* returns false if cancelled */
-bool PickNodeWorker(quadtree_c *part_list,
-		quadtree_c *tree, seg_t ** best, double *best_cost)
+//
+// Gather the partition candidates: all the real segs in the tree.
+//
+static void CollectCandidates(quadtree_c *part_list, std::vector<seg_t *>& list)
 {
-	/* try each Seg as partition */
 	for (seg_t *part = part_list->list ; part ; part = part->next)
 	{
-		if (cur_info->cancelled)
-			return false;
-
-#if DEBUG_PICKNODE
-		cur_info->Debug("PickNode:   %sSEG %p  (%1.1f,%1.1f) -> (%1.1f,%1.1f)\n",
-				part->linedef ? "" : "MINI", part,
-				part->start->x, part->start->y, part->end->x, part->end->y);
-#endif
-
 		/* ignore minisegs as partition candidates */
-		if (part->linedef == NULL)
-			continue;
-
-		double cost = EvalPartition(tree, part, *best_cost);
-
-		/* seg unsuitable or too costly ? */
-		if (cost < 0 || cost >= *best_cost)
-			continue;
-
-		/* we have a new better choice */
-		(*best_cost) = cost;
-
-		/* remember which Seg */
-		(*best) = part;
+		if (part->linedef != NULL)
+			list.push_back(part);
 	}
 
-	/* recursively handle sub-blocks */
-
 	for (int c=0 ; c < 2 ; c++)
 	{
 		if (part_list->subs[c] != NULL && ! part_list->subs[c]->Empty())
-		{
-			if (! PickNodeWorker(part_list->subs[c], tree, best, best_cost))
-				return false;
-		}
+			CollectCandidates(part_list->subs[c], list);
 	}
-
-	return true;
 }
 
 
 //
-// Find the best seg in the seg_list to use as a partition line.
+// Segs of the same linedef (including partners), and segs of other
+// linedefs along the same infinite line, all give the same partition
+// line.  Going the other way merely swaps left and right, which does
+// not change the cost.  So only the first candidate of each line is
+// evaluated, and it would have been picked before the others anyway.
+//
+// The line is identified by the direction and offset of the linedef,
+// reduced to their lowest terms.  Linedefs with fractional coordinates
+// (only in UDMF maps) are only matched with themselves.
 //
-seg_t *PickNode(quadtree_c *tree, int depth)
-{
-	seg_t *best = NULL;
 
-	double best_cost = 1.0e99;
+class line_key_t
+{
+public:
+	int64_t dx, dy, c;
 
-#if DEBUG_PICKNODE
-	cur_info->Debug("PickNode: BEGUN (depth %d)\n", depth);
-#endif
+	bool operator== (const line_key_t& other) const
+	{
+		return dx == other.dx && dy == other.dy && c == other.c;
+	}
 
-	/* -AJA- here is the logic for "fast mode".  We look for segs which
+	struct hash
+	{
+		size_t operator() (const line_key_t& K) const
+		{
+			uint64_t h = (uint64_t)K.dx * 0x9E3779B97F4A7C15ULL;
+			h ^= (uint64_t)K.dy + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+			h ^= (uint64_t)K.c  + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+			return (size_t)h;
+		}
+	};
+};
+
+
+static line_key_t CandidateLine(const seg_t *part)
+{
+	const linedef_t *L = part->linedef;
+
+	line_key_t K;
+
+	double x1 = L->start->x;
+	double y1 = L->start->y;
+	double x2 = L->end->x;
+	double y2 = L->end->y;
+
+	if (x1 != floor(x1) || y1 != floor(y1) || x2 != floor(x2) || y2 != floor(y2))
+	{
+		K.dx = 0;
+		K.dy = 0;
+		K.c  = L->index;
+		return K;
+	}
+
+	int64_t dx = (int64_t)x2 - (int64_t)x1;
+	int64_t dy = (int64_t)y2 - (int64_t)y1;
+
+	int64_t a = std::abs(dx);
+	int64_t b = std::abs(dy);
+
+	while (b != 0)
+	{
+		int64_t t = a % b;
+		a = b;
+		b = t;
+	}
+
+	// zero-length linedefs never get any segs
+	SYS_ASSERT(a > 0);
+
+	dx /= a;
+	dy /= a;
+
+	if (dx < 0 || (dx == 0 && dy < 0))
+	{
+		dx = -dx;
+		dy = -dy;
+	}
+
+	K.dx = dx;
+	K.dy = dy;
+	K.c  = dy * (int64_t)x1 - dx * (int64_t)y1;
+
+	return K;
+}
+
+
+static void RemoveSameLines(std::vector<seg_t *>& list)
+{
+	std::unordered_set<line_key_t, line_key_t::hash> seen;
+
+	size_t count = 0;
+
+	for (size_t i = 0 ; i < list.size() ; i++)
+	{
+		if (seen.insert(CandidateLine(list[i])).second)
+			list[count++] = list[i];
+	}
+
+#if DEBUG_PICKNODE
+	cur_info->Debug("PickNode: %d candidates, %d different lines\n",
+			(int)list.size(), (int)count);
+#endif
+
+	list.resize(count);
+}
+
+
+/* returns false if cancelled */
+bool PickNodeWorker(quadtree_c *tree, const std::vector<seg_t *>& candidates,
+		seg_t ** best, double *best_cost)
+{
+	/* try each Seg as partition */
+	for (size_t i = 0 ; i < candidates.size() ; i++)
+	{
+		seg_t *part = candidates[i];
+
+		if (cur_info->cancelled)
+			return false;
+
+#if DEBUG_PICKNODE
+		cur_info->Debug("PickNode:   %sSEG %p  (%1.1f,%1.1f) -> (%1.1f,%1.1f)\n",
+				part->linedef ? "" : "MINI", part,
+				part->start->x, part->start->y, part->end->x, part->end->y);
+#endif
+
+		double cost = EvalPartition(tree, part, *best_cost, &cur_level->stats);
+
+		/* seg unsuitable or too costly ? */
+		if (cost < 0 || cost >= *best_cost)
+			continue;
+
+		/* we have a new better choice */
+		(*best_cost) = cost;
+
+		/* remember which Seg */
+		(*best) = part;
+	}
+
+	return true;
+}
+
+
+//
+// When building with several threads, the partition candidates of a
+// large group of segs are shared out between all the threads of the
+// pool.  The cost of the best candidate found so far is shared too,
+// so the early-out in EvalPartitionWorker works across the threads.
+//
+// A candidate whose cost equals the best cost never gets pruned, hence
+// the winner is the first candidate (in the order which PickNodeWorker
+// would visit them) having the lowest cost, just like PickNodeWorker.
+//
+
+#define PICK_TASK_MIN_SEGS  400
+
+// number of candidates a thread takes at once
+#define PICK_TASK_BATCH  8
+
+
+class pick_task_c : public task_c
+{
+public:
+	quadtree_c *tree;
+
+	const std::vector<seg_t *> *candidates;
+
+	// these are shared by all the tasks
+	std::atomic<size_t> *next_cand;
+	std::atomic<double> *bound;
+
+	// best candidate seen by this task (an index into candidates)
+	size_t best;
+	double best_cost;
+
+	// counts the evaluations, added to the level afterwards
+	level_stats_t stats;
+
+public:
+	void Run()
+	{
+		task_cpu_timer_c timer;
+
+		EvalCandidates();
+
+		stats.cpu[STAT_Nodes] += timer.Stop();
+	}
+
+private:
+	void EvalCandidates()
+	{
+		size_t total = candidates->size();
+
+		for (;;)
+		{
+			if (cur_info->cancelled)
+				return;
+
+			size_t first = next_cand->fetch_add(PICK_TASK_BATCH);
+
+			if (first >= total)
+				return;
+
+			size_t last = std::min(first + PICK_TASK_BATCH, total);
+
+			// batches are taken in increasing order, hence the first
+			// candidate with the lowest cost is kept.
+			for (size_t i = first ; i < last ; i++)
+			{
+				double cost = EvalPartition(tree, (*candidates)[i], bound->load(), &stats);
+
+				/* seg unsuitable or too costly ? */
+				if (cost < 0 || cost >= best_cost)
+					continue;
+
+				best = i;
+				best_cost = cost;
+
+				LowerBound(cost);
+			}
+		}
+	}
+
+	void LowerBound(double cost)
+	{
+		double cur = bound->load();
+
+		while (cost < cur && ! bound->compare_exchange_weak(cur, cost))
+		{ }
+	}
+};
+
+
+/* returns false if cancelled */
+static bool PickNodeParallel(quadtree_c *tree, const std::vector<seg_t *>& candidates,
+		seg_t ** best, double *best_cost)
+{
+	std::atomic<size_t> next_cand(0);
+	std::atomic<double> bound(*best_cost);
+
+	int count = cur_pool->NumThreads();
+
+	std::vector<pick_task_c> tasks(count);
+
+	for (int i = 0 ; i < count ; i++)
+	{
+		tasks[i].tree       = tree;
+		tasks[i].candidates = &candidates;
+		tasks[i].next_cand  = &next_cand;
+		tasks[i].bound      = &bound;
+		tasks[i].best       = candidates.size();
+		tasks[i].best_cost  = *best_cost;
+	}
+
+	for (int i = 1 ; i < count ; i++)
+		cur_pool->Push(&tasks[i]);
+
+	tasks[0].Run();
+
+	// wait in reverse order, since the pushed tasks are popped LIFO
+	for (int i = count-1 ; i >= 1 ; i--)
+		cur_pool->Wait(&tasks[i]);
+
+	for (int i = 0 ; i < count ; i++)
+		cur_level->stats.Add(tasks[i].stats);
+
+	if (cur_info->cancelled)
+		return false;
+
+	size_t best_idx = candidates.size();
+
+	for (int i = 0 ; i < count ; i++)
+	{
+		if (tasks[i].best_cost < *best_cost ||
+			(tasks[i].best_cost == *best_cost && tasks[i].best < best_idx))
+		{
+			best_idx   = tasks[i].best;
+			*best_cost = tasks[i].best_cost;
+		}
+	}
+
+	if (best_idx < candidates.size())
+		*best = candidates[best_idx];
+
+	return true;
+}
+
+
+//
+// Find the best seg in the seg_list to use as a partition line.
+//
+seg_t *PickNode(quadtree_c *tree, int depth)
+{
+	seg_t *best = NULL;
+
+	double best_cost = 1.0e99;
+
+#if DEBUG_PICKNODE
+	cur_info->Debug("PickNode: BEGUN (depth %d)\n", depth);
+#endif
+
+	/* -AJA- here is the logic for "fast mode".  We look for segs which
 	 *       are axis-aligned and roughly divide the current group into
 	 *       two halves.  This can save *heaps* of times on large levels.
 	 */
@@ -723,7 +1262,24 @@ seg_t *PickNode(quadtree_c *tree, int depth)
 		}
 	}
 
-	if (! PickNodeWorker(tree, tree, &best, &best_cost))
+	std::vector<seg_t *> candidates;
+
+	CollectCandidates(tree, candidates);
+	RemoveSameLines(candidates);
+
+	bool ok;
+
+	if (cur_pool != NULL && cur_pool->NumThreads() > 1 &&
+		tree->real_num >= PICK_TASK_MIN_SEGS)
+	{
+		ok = PickNodeParallel(tree, candidates, &best, &best_cost);
+	}
+	else
+	{
+		ok = PickNodeWorker(tree, candidates, &best, &best_cost);
+	}
+
+	if (! ok)
 	{
 		/* hack here : BuildNodes will detect the cancellation */
 		return NULL;
@@ -750,6 +1306,42 @@ seg_t *PickNode(quadtree_c *tree, int depth)
 // Apply the partition line to the given seg, taking the necessary
 // action (moving it into either the left list, right list, or
 // splitting it).
+//
+// Bounding boxes of the seg lists are kept up to date while the segs
+// are being divided, so the next level does not need to scan them
+// again (see FindLimits2).
+//
+static inline void ClearLimits(bbox_t *bbox)
+{
+	bbox->minx = bbox->miny = SHRT_MAX;
+	bbox->maxx = bbox->maxy = SHRT_MIN;
+}
+
+static inline void AddLimits(bbox_t *bbox, const seg_t *seg)
+{
+	double x1 = seg->start->x;
+	double y1 = seg->start->y;
+	double x2 = seg->end->x;
+	double y2 = seg->end->y;
+
+	int lx = (int) floor(std::min(x1, x2) - 0.2);
+	int ly = (int) floor(std::min(y1, y2) - 0.2);
+	int hx = (int)  ceil(std::max(x1, x2) + 0.2);
+	int hy = (int)  ceil(std::max(y1, y2) + 0.2);
+
+	if (lx < bbox->minx) bbox->minx = lx;
+	if (ly < bbox->miny) bbox->miny = ly;
+	if (hx > bbox->maxx) bbox->maxx = hx;
+	if (hy > bbox->maxy) bbox->maxy = hy;
+}
+
+static inline void SideAddSeg(seg_t ** list_ptr, bbox_t *bbox, seg_t *seg)
+{
+	ListAddSeg(list_ptr, seg);
+	AddLimits(bbox, seg);
+}
+
+
 //
 // -AJA- I have rewritten this routine based on the EvalPartition
 //       routine above (which I've also reworked, heavily).  I think
@@ -759,6 +1351,7 @@ seg_t *PickNode(quadtree_c *tree, int depth)
 //
 void DivideOneSeg(seg_t *seg, seg_t *part,
 		seg_t ** left_list, seg_t ** right_list,
+		bbox_t *left_box, bbox_t *right_box,
 		intersection_t ** cut_list)
 {
 	/* get state of lines' relation to each other */
@@ -780,9 +1373,9 @@ void DivideOneSeg(seg_t *seg, seg_t *part,
 		// whether it goes in the same direction or the opposite.
 
 		if (seg->pdx*part->pdx + seg->pdy*part->pdy < 0)
-			ListAddSeg(left_list, seg);
+			SideAddSeg(left_list, left_box, seg);
 		else
-			ListAddSeg(right_list, seg);
+			SideAddSeg(right_list, right_box, seg);
 
 		return;
 	}
@@ -795,7 +1388,7 @@ void DivideOneSeg(seg_t *seg, seg_t *part,
 		else if (b < DIST_EPSILON)
 			AddIntersection(cut_list, seg->end, part, self_ref);
 
-		ListAddSeg(right_list, seg);
+		SideAddSeg(right_list, right_box, seg);
 		return;
 	}
 
@@ -807,7 +1400,7 @@ void DivideOneSeg(seg_t *seg, seg_t *part,
 		else if (b > -DIST_EPSILON)
 			AddIntersection(cut_list, seg->end, part, self_ref);
 
-		ListAddSeg(left_list, seg);
+		SideAddSeg(left_list, left_box, seg);
 		return;
 	}
 
@@ -823,19 +1416,100 @@ void DivideOneSeg(seg_t *seg, seg_t *part,
 
 	if (a < 0)
 	{
-		ListAddSeg(left_list,  seg);
-		ListAddSeg(right_list, new_seg);
+		SideAddSeg(left_list,  left_box,  seg);
+		SideAddSeg(right_list, right_box, new_seg);
 	}
 	else
 	{
-		ListAddSeg(right_list, seg);
-		ListAddSeg(left_list,  new_seg);
+		SideAddSeg(right_list, right_box, seg);
+		SideAddSeg(left_list,  left_box,  new_seg);
 	}
 }
 
 
-void SeparateSegs(quadtree_c *tree, seg_t *part,
-		seg_t ** left_list, seg_t ** right_list,
+//
+// The left and right trees are copies of the divided tree: each node
+// gets a copy on both sides, and its segs go into these copies.  Then
+// the box of each copy is shrunk to fit its segs, and the empty copies
+// are removed.  Hence a seg which is not split keeps its place in the
+// tree, and only the nodes need to be copied.
+//
+static inline void MergeLimits(bbox_t *bbox, const bbox_t *other)
+{
+	if (other->minx < bbox->minx) bbox->minx = other->minx;
+	if (other->miny < bbox->miny) bbox->miny = other->miny;
+	if (other->maxx > bbox->maxx) bbox->maxx = other->maxx;
+	if (other->maxy > bbox->maxy) bbox->maxy = other->maxy;
+}
+
+static quadtree_c * CopyNode(const quadtree_c *tree)
+{
+	quadtree_c *copy = new quadtree_c(tree->x1, tree->y1, tree->x2, tree->y2);
+
+	copy->split_axis = tree->split_axis;
+	copy->split_mid  = tree->split_mid;
+
+	return copy;
+}
+
+static quadtree_c * FinishNode(quadtree_c *copy, const bbox_t *bbox)
+{
+	int own = 0;
+
+	for (seg_t *seg = copy->list ; seg != NULL ; seg = seg->next)
+		own++;
+
+	int sub_num[2] = { 0, 0 };
+
+	for (int c=0 ; c < 2 ; c++)
+	{
+		if (copy->subs[c] != NULL)
+			sub_num[c] = copy->subs[c]->real_num + copy->subs[c]->mini_num;
+	}
+
+	// remove an empty node, or a node with a single sub-tree
+	if (own == 0 && (copy->subs[0] == NULL || copy->subs[1] == NULL))
+	{
+		quadtree_c *sub = (copy->subs[0] != NULL) ? copy->subs[0] : copy->subs[1];
+
+		copy->subs[0] = NULL;
+		copy->subs[1] = NULL;
+
+		delete copy;
+		return sub;
+	}
+
+	copy->x1 = bbox->minx;
+	copy->y1 = bbox->miny;
+	copy->x2 = bbox->maxx;
+	copy->y2 = bbox->maxy;
+
+	int total = own + sub_num[0] + sub_num[1];
+
+	// when the division of the node does not suit the segs which are
+	// left in it, it is divided again like a node of a new tree.  this
+	// also turns a node with few segs back into a leaf.
+	bool redivide;
+
+	if (total <= QUAD_LEAF_SEGS)
+		redivide = (copy->subs[0] != NULL || copy->subs[1] != NULL);
+	else
+		redivide = (std::min(sub_num[0], sub_num[1]) * QUAD_UNEVEN < total);
+
+	if (redivide)
+		copy->Redivide();
+
+	// this is only an estimate until Recount() is called, since a seg
+	// having its partner in the tree may get split afterwards.
+	copy->real_num = total;
+	copy->mini_num = 0;
+
+	return copy;
+}
+
+static void SeparateNode(quadtree_c *tree, seg_t *part,
+		quadtree_c *left, quadtree_c *right,
+		bbox_t *left_box, bbox_t *right_box,
 		intersection_t ** cut_list)
 {
 	while (tree->list != NULL)
@@ -843,20 +1517,53 @@ void SeparateSegs(quadtree_c *tree, seg_t *part,
 		seg_t *seg = tree->list;
 		tree->list = seg->next;
 
-		seg->quad = NULL;
-		DivideOneSeg(seg, part, left_list, right_list, cut_list);
+		DivideOneSeg(seg, part, &left->list, &right->list, left_box, right_box, cut_list);
 	}
 
 	// recursively handle sub-blocks
-	if (tree->subs[0] != NULL)
+	for (int c=0 ; c < 2 ; c++)
 	{
-		SeparateSegs(tree->subs[0], part, left_list, right_list, cut_list);
-		SeparateSegs(tree->subs[1], part, left_list, right_list, cut_list);
+		if (tree->subs[c] == NULL)
+			continue;
+
+		quadtree_c *L = CopyNode(tree->subs[c]);
+		quadtree_c *R = CopyNode(tree->subs[c]);
+
+		bbox_t L_box, R_box;
+
+		ClearLimits(&L_box);
+		ClearLimits(&R_box);
+
+		SeparateNode(tree->subs[c], part, L, R, &L_box, &R_box, cut_list);
+
+		left ->subs[c] = FinishNode(L, &L_box);
+		right->subs[c] = FinishNode(R, &R_box);
+
+		MergeLimits(left_box,  &L_box);
+		MergeLimits(right_box, &R_box);
 	}
 
 	// this quadtree_c is empty now
 }
 
+void SeparateSegs(quadtree_c *tree, seg_t *part,
+		quadtree_c ** left_tree, quadtree_c ** right_tree,
+		intersection_t ** cut_list)
+{
+	quadtree_c *L = CopyNode(tree);
+	quadtree_c *R = CopyNode(tree);
+
+	bbox_t L_box, R_box;
+
+	ClearLimits(&L_box);
+	ClearLimits(&R_box);
+
+	SeparateNode(tree, part, L, R, &L_box, &R_box, cut_list);
+
+	*left_tree  = FinishNode(L, &L_box);
+	*right_tree = FinishNode(R, &R_box);
+}
+
 
 void FindLimits2(seg_t *list, bbox_t *bbox)
 {
@@ -870,31 +1577,15 @@ void FindLimits2(seg_t *list, bbox_t *bbox)
 		return;
 	}
 
-	bbox->minx = bbox->miny = SHRT_MAX;
-	bbox->maxx = bbox->maxy = SHRT_MIN;
+	ClearLimits(bbox);
 
 	for ( ; list != NULL ; list = list->next)
-	{
-		double x1 = list->start->x;
-		double y1 = list->start->y;
-		double x2 = list->end->x;
-		double y2 = list->end->y;
-
-		int lx = (int) floor(std::min(x1, x2) - 0.2);
-		int ly = (int) floor(std::min(y1, y2) - 0.2);
-		int hx = (int)  ceil(std::max(x1, x2) + 0.2);
-		int hy = (int)  ceil(std::max(y1, y2) + 0.2);
-
-		if (lx < bbox->minx) bbox->minx = lx;
-		if (ly < bbox->miny) bbox->miny = ly;
-		if (hx > bbox->maxx) bbox->maxx = hx;
-		if (hy > bbox->maxy) bbox->maxy = hy;
-	}
+		AddLimits(bbox, list);
 }
 
 
 void AddMinisegs(intersection_t *cut_list, seg_t *part,
-		seg_t ** left_list, seg_t ** right_list)
+		quadtree_c *left_tree, quadtree_c *right_tree)
 {
 	intersection_t *cut, *next;
 
@@ -948,6 +1639,8 @@ void AddMinisegs(intersection_t *cut_list, seg_t *part,
 		seg_t *seg   = NewSeg();
 		seg_t *buddy = NewSeg();
 
+		cur_level->stats.minisegs += 2;
+
 		seg->partner = buddy;
 		buddy->partner = seg;
 
@@ -966,9 +1659,9 @@ void AddMinisegs(intersection_t *cut_list, seg_t *part,
 		seg  ->Recompute();
 		buddy->Recompute();
 
-		// add the new segs to the appropriate lists
-		ListAddSeg(right_list, seg);
-		ListAddSeg(left_list, buddy);
+		// add the new segs to the appropriate trees
+		right_tree->AddSeg(seg);
+		 left_tree->AddSeg(buddy);
 
 #if DEBUG_CUTLIST
 		cur_info->Debug("AddMiniseg: %p RIGHT  (%1.1f,%1.1f) -> (%1.1f,%1.1f)\n",
@@ -1050,102 +1743,342 @@ int seg_t::PointOnLineSide(double x, double y) const
 
 /* ----- quad-tree routines ------------------------------------ */
 
+//
+// Every node of the BSP tree copies the nodes of its quadtree for both
+// halves (see SeparateSegs), so the quadtree nodes are recycled instead
+// of going back to the heap.  Each thread has its own pool (a tree is
+// only passed to another thread via Clone), and the memory is only
+// freed when the thread exits.
+//
+
+#define QUAD_BLOCK_NUM  1024
+
+class quad_pool_c
+{
+private:
+	std::vector<void *> blocks;
+
+	// free nodes are linked via their first sub-tree pointer
+	quadtree_c *free_list;
+
+public:
+	quad_pool_c() : blocks(), free_list(NULL)
+	{ }
+
+	~quad_pool_c()
+	{
+		for (size_t i = 0 ; i < blocks.size() ; i++)
+			UtilFree(blocks[i]);
+	}
+
+	void * Alloc()
+	{
+		if (free_list == NULL)
+		{
+			quadtree_c *block = (quadtree_c *)UtilCalloc(QUAD_BLOCK_NUM * sizeof(quadtree_c));
+
+			blocks.push_back(block);
+
+			for (int i = 0 ; i < QUAD_BLOCK_NUM ; i++)
+				Free(&block[i]);
+		}
+
+		quadtree_c *tree = free_list;
+		free_list = tree->subs[0];
+
+		return tree;
+	}
+
+	void Free(void *ptr)
+	{
+		quadtree_c *tree = (quadtree_c *)ptr;
+
+		tree->subs[0] = free_list;
+		free_list = tree;
+	}
+};
+
+static thread_local quad_pool_c quad_pool;
+
+
+void * quadtree_c::operator new(size_t size)
+{
+	SYS_ASSERT(size == sizeof(quadtree_c));
+
+	return quad_pool.Alloc();
+}
+
+void quadtree_c::operator delete(void *ptr)
+{
+	quad_pool.Free(ptr);
+}
+
+
 quadtree_c::quadtree_c(int _x1, int _y1, int _x2, int _y2) :
 	x1(_x1), y1(_y1),
 	x2(_x2), y2(_y2),
+	split_axis(-1), split_mid(0),
 	real_num(0), mini_num(0),
-	list(NULL)
+	list(NULL),
+	pack(NULL), pack_first(0), pack_num(0)
 {
-	int dx = x2 - x1;
-	int dy = y2 - y1;
+	subs[0] = NULL;
+	subs[1] = NULL;
+}
+
+
+quadtree_c::~quadtree_c()
+{
+	if (subs[0] != NULL) delete subs[0];
+	if (subs[1] != NULL) delete subs[1];
+
+	delete pack;
+}
+
 
-	if (dx <= 320 && dy <= 320)
+//
+// The tree is built in one go from a list of segs.  Each node with
+// too many segs is divided by a vertical or horizontal line through
+// the median of the seg centres, along the longer side of its box.
+// The segs lying wholly on one side go into a sub-tree, those crossing
+// the line stay in the node.  Sub-trees get the bounding box of their
+// own segs, so that OnLineSide() can skip as many segs as possible.
+//
+
+
+static inline double SegCentre(const seg_t *seg, int axis)
+{
+	if (axis == 0)
+		return (seg->start->x + seg->end->x) * 0.5;
+	else
+		return (seg->start->y + seg->end->y) * 0.5;
+}
+
+
+void quadtree_c::AddSegs(seg_t **segs, int count, std::vector<double>& centres)
+{
+	for (int i = 0 ; i < count ; i++)
 	{
-		// leaf node
-		subs[0] = NULL;
-		subs[1] = NULL;
+		if (segs[i]->linedef != NULL)
+			real_num++;
+		else
+			mini_num++;
 	}
-	else if (dx >= dy)
+
+	int kept = count;
+
+	if (count > QUAD_LEAF_SEGS)
+		kept = Divide(segs, count, centres);
+
+	// link the remaining segs into this node
+	for (int i = 0 ; i < kept ; i++)
 	{
-		subs[0] = new quadtree_c(x1, y1, x1 + dx/2, y2);
-		subs[1] = new quadtree_c(x1 + dx/2, y1, x2, y2);
+		ListAddSeg(&list, segs[i]);
+
+		segs[i]->quad = this;
 	}
-	else
+}
+
+
+int quadtree_c::Divide(seg_t **segs, int count, std::vector<double>& centres)
+{
+	int dx = x2 - x1;
+	int dy = y2 - y1;
+
+	// try the longer side first
+	for (int pass = 0 ; pass < 2 ; pass++)
 	{
-		subs[0] = new quadtree_c(x1, y1, x2, y1 + dy/2);
-		subs[1] = new quadtree_c(x1, y1 + dy/2, x2, y2);
+		int axis = (dx >= dy) ? pass : (1 - pass);
+
+		centres.resize(count);
+
+		for (int i = 0 ; i < count ; i++)
+			centres[i] = SegCentre(segs[i], axis);
+
+		std::nth_element(centres.begin(), centres.begin() + count/2, centres.end());
+
+		double mid = centres[count/2];
+
+		// order the segs as: crossing, lower, higher
+		seg_t **lower = std::stable_partition(segs, segs + count, [axis, mid](const seg_t *seg)
+		{
+			double lo = (axis == 0) ? std::min(seg->start->x, seg->end->x) : std::min(seg->start->y, seg->end->y);
+			double hi = (axis == 0) ? std::max(seg->start->x, seg->end->x) : std::max(seg->start->y, seg->end->y);
+
+			return ! (hi < mid || lo > mid);
+		});
+
+		seg_t **higher = std::stable_partition(lower, segs + count, [axis, mid](const seg_t *seg)
+		{
+			double hi = (axis == 0) ? std::max(seg->start->x, seg->end->x) : std::max(seg->start->y, seg->end->y);
+
+			return hi < mid;
+		});
+
+		int num_cross = (int)(lower  - segs);
+		int num_lower = (int)(higher - lower);
+		int num_high  = count - num_cross - num_lower;
+
+		if (num_lower == 0 && num_high == 0)
+			continue;
+
+		split_axis = axis;
+		split_mid  = mid;
+
+		if (num_lower > 0)
+			subs[0] = NewSubTree(lower, num_lower, centres);
+
+		if (num_high > 0)
+			subs[1] = NewSubTree(higher, num_high, centres);
+
+		return num_cross;
 	}
+
+	// no luck, keep all the segs here
+	return count;
 }
 
 
-quadtree_c::~quadtree_c()
+quadtree_c * quadtree_c::NewSubTree(seg_t **segs, int count, std::vector<double>& centres)
 {
-	if (subs[0] != NULL) delete subs[0];
-	if (subs[1] != NULL) delete subs[1];
+	bbox_t bbox;
+
+	ClearLimits(&bbox);
+
+	for (int i = 0 ; i < count ; i++)
+		AddLimits(&bbox, segs[i]);
+
+	quadtree_c *sub = new quadtree_c(bbox.minx, bbox.miny, bbox.maxx, bbox.maxy);
+
+	sub->AddSegs(segs, count, centres);
+
+	return sub;
+}
+
+
+void quadtree_c::AddList(seg_t *new_list)
+{
+	std::vector<seg_t *> segs;
+	std::vector<double>  centres;
+
+	for (seg_t *seg = new_list ; seg != NULL ; seg = seg->next)
+		segs.push_back(seg);
+
+	if (! segs.empty())
+		AddSegs(segs.data(), (int)segs.size(), centres);
 }
 
 
 void quadtree_c::AddSeg(seg_t *seg)
 {
-	// update seg counts
-	if (seg->linedef != NULL)
-		real_num++;
-	else
-		mini_num++;
+	bbox_t bbox = { x1, y1, x2, y2 };
 
-	if (subs[0] != NULL)
+	AddLimits(&bbox, seg);
+
+	x1 = bbox.minx; y1 = bbox.miny;
+	x2 = bbox.maxx; y2 = bbox.maxy;
+
+	if (split_axis >= 0)
 	{
-		double x_min = std::min(seg->start->x, seg->end->x);
-		double y_min = std::min(seg->start->y, seg->end->y);
+		double lo = (split_axis == 0) ? std::min(seg->start->x, seg->end->x) : std::min(seg->start->y, seg->end->y);
+		double hi = (split_axis == 0) ? std::max(seg->start->x, seg->end->x) : std::max(seg->start->y, seg->end->y);
+
+		int c = -1;
 
-		double x_max = std::max(seg->start->x, seg->end->x);
-		double y_max = std::max(seg->start->y, seg->end->y);
+		if (hi < split_mid)
+			c = 0;
+		else if (lo > split_mid)
+			c = 1;
 
-		if ((x2 - x1) >= (y2 - y1))
+		if (c >= 0)
 		{
-			if (x_min > subs[1]->x1)
+			if (subs[c] == NULL)
 			{
-				subs[1]->AddSeg(seg);
-				return;
-			}
-			else if (x_max < subs[0]->x2)
-			{
-				subs[0]->AddSeg(seg);
-				return;
+				ClearLimits(&bbox);
+				AddLimits(&bbox, seg);
+
+				subs[c] = new quadtree_c(bbox.minx, bbox.miny, bbox.maxx, bbox.maxy);
 			}
+
+			subs[c]->AddSeg(seg);
+			return;
 		}
+	}
+
+	ListAddSeg(&list, seg);
+
+	seg->quad = this;
+}
+
+
+void quadtree_c::Redivide()
+{
+	seg_t *all = NULL;
+
+	ConvertToList(&all);
+
+	for (int c=0 ; c < 2 ; c++)
+	{
+		delete subs[c];
+		subs[c] = NULL;
+	}
+
+	split_axis = -1;
+
+	real_num = 0;
+	mini_num = 0;
+
+	AddList(all);
+}
+
+
+void quadtree_c::Recount()
+{
+	real_num = 0;
+	mini_num = 0;
+
+	for (seg_t *seg = list ; seg != NULL ; seg = seg->next)
+	{
+		if (seg->linedef != NULL)
+			real_num++;
 		else
+			mini_num++;
+
+		seg->quad = this;
+	}
+
+	for (int c=0 ; c < 2 ; c++)
+	{
+		if (subs[c] != NULL)
 		{
-			if (y_min > subs[1]->y1)
-			{
-				subs[1]->AddSeg(seg);
-				return;
-			}
-			else if (y_max < subs[0]->y2)
-			{
-				subs[0]->AddSeg(seg);
-				return;
-			}
+			subs[c]->Recount();
+
+			real_num += subs[c]->real_num;
+			mini_num += subs[c]->mini_num;
 		}
 	}
+}
 
-	// link into this node
 
-	ListAddSeg(&list, seg);
+quadtree_c * quadtree_c::Clone() const
+{
+	quadtree_c *copy = new quadtree_c(x1, y1, x2, y2);
 
-	seg->quad = this;
-}
+	copy->split_axis = split_axis;
+	copy->split_mid  = split_mid;
 
+	copy->real_num = real_num;
+	copy->mini_num = mini_num;
 
-void quadtree_c::AddList(seg_t *new_list)
-{
-	while (new_list != NULL)
+	copy->list = list;
+
+	for (int c=0 ; c < 2 ; c++)
 	{
-		seg_t *seg = new_list;
-		new_list = seg->next;
+		if (subs[c] != NULL)
+			copy->subs[c] = subs[c]->Clone();
+	}
 
-		AddSeg(seg);
-   }
+	return copy;
 }
 
 
@@ -1159,16 +2092,61 @@ void quadtree_c::ConvertToList(seg_t **_list)
 		ListAddSeg(_list, seg);
 	}
 
-	if (subs[0] != NULL)
+	for (int c=0 ; c < 2 ; c++)
 	{
-		subs[0]->ConvertToList(_list);
-		subs[1]->ConvertToList(_list);
+		if (subs[c] != NULL)
+			subs[c]->ConvertToList(_list);
 	}
 
 	// this quadtree is empty now
 }
 
 
+static void PackSegs(quadtree_c *tree, seg_pack_t *P)
+{
+	tree->pack_first = (int)P->segs.size();
+
+	for (seg_t *seg = tree->list ; seg != NULL ; seg = seg->next)
+	{
+		P->sx.push_back(seg->psx);
+		P->sy.push_back(seg->psy);
+		P->ex.push_back(seg->pex);
+		P->ey.push_back(seg->pey);
+
+		P->line.push_back(seg->source_line ? (double)seg->source_line->index : -1.0);
+		P->real.push_back(seg->linedef ? 1 : 0);
+		P->segs.push_back(seg);
+	}
+
+	tree->pack_num = (int)P->segs.size() - tree->pack_first;
+
+	for (int c=0 ; c < 2 ; c++)
+	{
+		if (tree->subs[c] != NULL)
+			PackSegs(tree->subs[c], P);
+	}
+}
+
+
+void quadtree_c::Pack()
+{
+	if (pack == NULL)
+		pack = new seg_pack_t;
+
+	size_t total = (size_t)(real_num + mini_num);
+
+	pack->sx.reserve(total);
+	pack->sy.reserve(total);
+	pack->ex.reserve(total);
+	pack->ey.reserve(total);
+	pack->line.reserve(total);
+	pack->real.reserve(total);
+	pack->segs.reserve(total);
+
+	PackSegs(this, pack);
+}
+
+
 int quadtree_c::OnLineSide(const seg_t *part) const
 {
 	// expand bounds a bit, adds some safety and loses nothing
@@ -1330,6 +2308,9 @@ quadtree_c *TreeFromSegList(seg_t *list, const bbox_t *bounds)
 
 	tree->AddList(list);
 
+	if (eval_packed != NULL)
+		tree->Pack();
+
 	return tree;
 }
 
@@ -1582,30 +2563,61 @@ void DebugShowSegs(const seg_t *list)
 #endif
 
 
-build_result_e BuildNodes(seg_t *list, int depth, bbox_t *bounds /* output */,
-		node_t ** N, subsec_t ** S)
+// nodes with fewer segs are never split into tasks (see below)
+#define TASK_MIN_SEGS  1000
+
+static build_result_e BuildBothHalves(node_t *node, quadtree_c *lefts, quadtree_c *rights, int depth);
+
+
+static inline void TreeLimits(const quadtree_c *tree, bbox_t *bbox)
+{
+	bbox->minx = tree->x1;
+	bbox->miny = tree->y1;
+	bbox->maxx = tree->x2;
+	bbox->maxy = tree->y2;
+}
+
+
+//
+// the tree is either made by TreeFromSegList() for the whole level,
+// or is one half of the parent's tree (see SeparateSegs).  the tree
+// is always deleted here.
+//
+static build_result_e BuildNodesWorker(quadtree_c *tree, int depth,
+		node_t ** N, subsec_t ** S, bool as_tasks)
 {
 	*N = NULL;
 	*S = NULL;
 
 	if (cur_info->cancelled)
+	{
+		delete tree;
 		return BUILD_Cancelled;
+	}
+
+	// segs of the tree may have been split while the other half of the
+	// parent was built, and only now the segs stay the same.
+	tree->Recount();
+
+	if (eval_packed != NULL && tree->pack == NULL)
+		tree->Pack();
 
 #if DEBUG_BUILDER
 	cur_info->Debug("Build: BEGUN @ %d\n", depth);
-	DebugShowSegs(list);
 #endif
 
-	// determine bounds of segs
-	FindLimits2(list, bounds);
-
-	quadtree_c *tree = TreeFromSegList(list, bounds);
+	// only the upper part of the tree is split into tasks
+	if (tree->real_num + tree->mini_num < TASK_MIN_SEGS)
+		as_tasks = false;
 
 	/* pick partition line, NONE indicates convexicity */
 	seg_t *part = PickNode(tree, depth);
 
 	if (cur_info->cancelled)
+	{
+		delete tree;
 		return BUILD_Cancelled;
+	}
 
 	if (part == NULL)
 	{
@@ -1627,9 +2639,9 @@ build_result_e BuildNodes(seg_t *list, int depth, bbox_t *bounds /* output */,
 	node_t *node = NewNode();
 	*N = node;
 
-	/* divide the segs into two lists: left & right */
-	seg_t *lefts  = NULL;
-	seg_t *rights = NULL;
+	/* divide the segs into two trees: left & right */
+	quadtree_c *lefts  = NULL;
+	quadtree_c *rights = NULL;
 	intersection_t *cut_list = NULL;
 
 	SeparateSegs(tree, part, &lefts, &rights, &cut_list);
@@ -1645,29 +2657,45 @@ build_result_e BuildNodes(seg_t *list, int depth, bbox_t *bounds /* output */,
 		BugError("Separated seg-list has empty LEFT side\n");
 
 	if (cut_list != NULL)
-		AddMinisegs(cut_list, part, &lefts, &rights);
+		AddMinisegs(cut_list, part, lefts, rights);
+
+	// the boxes of the trees are the bounds of each half
+	TreeLimits(lefts,  &node->l.bounds);
+	TreeLimits(rights, &node->r.bounds);
 
 	node->SetPartition(part);
 
+	build_result_e ret;
+
+	if (as_tasks)
+	{
+		ret = BuildBothHalves(node, lefts, rights, depth);
+		if (ret != BUILD_OK)
+			return ret;
+	}
+	else
+	{
 #if DEBUG_BUILDER
-	cur_info->Debug("Build: Going LEFT\n");
+		cur_info->Debug("Build: Going LEFT\n");
 #endif
 
-	build_result_e ret;
-
-	// recursively build the left side
-	ret = BuildNodes(lefts, depth+1, &node->l.bounds, &node->l.node, &node->l.subsec);
-	if (ret != BUILD_OK)
-		return ret;
+		// recursively build the left side
+		ret = BuildNodesWorker(lefts, depth+1, &node->l.node, &node->l.subsec, false);
+		if (ret != BUILD_OK)
+		{
+			delete rights;
+			return ret;
+		}
 
 #if DEBUG_BUILDER
-	cur_info->Debug("Build: Going RIGHT\n");
+		cur_info->Debug("Build: Going RIGHT\n");
 #endif
 
-	// recursively build the right side
-	ret = BuildNodes(rights, depth+1, &node->r.bounds, &node->r.node, &node->r.subsec);
-	if (ret != BUILD_OK)
-		return ret;
+		// recursively build the right side
+		ret = BuildNodesWorker(rights, depth+1, &node->r.node, &node->r.subsec, false);
+		if (ret != BUILD_OK)
+			return ret;
+	}
 
 #if DEBUG_BUILDER
 	cur_info->Debug("Build: DONE\n");
@@ -1677,6 +2705,402 @@ build_result_e BuildNodes(seg_t *list, int depth, bbox_t *bounds /* output */,
 }
 
 
+build_result_e BuildNodes(seg_t *list, int depth, bbox_t *bounds /* output */,
+		node_t ** N, subsec_t ** S)
+{
+	// determine bounds of segs
+	FindLimits2(list, bounds);
+
+	quadtree_c *tree = TreeFromSegList(list, bounds);
+
+	return BuildNodesWorker(tree, depth, N, S, false);
+}
+
+
+//------------------------------------------------------------------------
+// TASKS : Build both halves of the large nodes at the same time
+//------------------------------------------------------------------------
+
+//
+// When several threads are used, each node in the upper part of the
+// BSP tree (having at least TASK_MIN_SEGS segs) turns its right half
+// into a task and pushes it onto the work-stealing deque of the
+// current thread, then builds the left half itself.  An idle thread
+// may steal the task and build it in the meantime.
+//
+// The two halves are not quite independent: segs lying along the
+// partition line have their partner on the other side, and splitting
+// a seg normally splits its partner too.  So these segs are marked as
+// "detached" before building the halves, which stops the splits from
+// being passed across.  When both halves are done, each pair is put
+// back together by splitting the pieces on one side at the vertices
+// of the other side.
+//
+// Which nodes become tasks only depends on the seg counts, and the
+// objects created by a task are added to the level after the ones of
+// the left half, hence the result does not depend on the number of
+// threads or on which thread built what.
+//
+
+
+class build_task_c : public task_c
+{
+public:
+	// this tree belongs to the thread which created the task, the
+	// task builds a copy of it.
+	quadtree_c *tree;
+	int depth;
+
+	// where the results go
+	node_t ** N;
+	subsec_t ** S;
+
+	// objects which got created while building the task
+	level_t objects;
+
+	build_result_e result;
+
+public:
+	build_task_c(quadtree_c *_tree, int _depth,
+			node_t ** _N, subsec_t ** _S) :
+		tree(_tree), depth(_depth),
+		N(_N), S(_S),
+		result(BUILD_OK)
+	{ }
+
+	~build_task_c()
+	{
+		delete tree;
+	}
+
+	void Run()
+	{
+		// everything created by the task goes into its own lists
+		level_t *saved_level = cur_level;
+
+		cur_level = &objects;
+
+		task_cpu_timer_c timer;
+
+		result = BuildNodesWorker(tree->Clone(), depth, N, S, true);
+
+		objects.stats.cpu[STAT_Nodes] += timer.Stop();
+
+		cur_level = saved_level;
+	}
+};
+
+
+static void AppendObjects(level_t *src)
+{
+	level_t *L = cur_level;
+
+	L->vertices.insert(L->vertices.end(), src->vertices.begin(), src->vertices.end());
+	L->segs    .insert(L->segs    .end(), src->segs    .begin(), src->segs    .end());
+	L->subsecs .insert(L->subsecs .end(), src->subsecs .begin(), src->subsecs .end());
+	L->nodes   .insert(L->nodes   .end(), src->nodes   .begin(), src->nodes   .end());
+	L->walltips.insert(L->walltips.end(), src->walltips.begin(), src->walltips.end());
+	L->cuts    .insert(L->cuts    .end(), src->cuts    .begin(), src->cuts    .end());
+
+	L->vertex_mem .Adopt(src->vertex_mem);
+	L->seg_mem    .Adopt(src->seg_mem);
+	L->subsec_mem .Adopt(src->subsec_mem);
+	L->node_mem   .Adopt(src->node_mem);
+	L->walltip_mem.Adopt(src->walltip_mem);
+
+	L->new_vert_count += src->new_vert_count;
+
+	L->stats.Add(src->stats);
+}
+
+
+static void CollectSegs(const quadtree_c *tree, std::vector<seg_t *>& segs)
+{
+	for (seg_t *seg = tree->list ; seg != NULL ; seg = seg->next)
+		segs.push_back(seg);
+
+	for (int c=0 ; c < 2 ; c++)
+	{
+		if (tree->subs[c] != NULL)
+			CollectSegs(tree->subs[c], segs);
+	}
+}
+
+
+//
+// Find the segs on the left side whose partner is on the right side,
+// and detach them.  The pairs are stored in 'pairs' (left seg first).
+//
+static void DetachPartners(const quadtree_c *lefts, const quadtree_c *rights, std::vector<seg_t *>& pairs)
+{
+	std::vector<seg_t *> segs;
+
+	CollectSegs(rights, segs);
+
+	std::unordered_set<const seg_t *> right_segs;
+
+	for (seg_t *seg : segs)
+	{
+		if (seg->partner != NULL && ! seg->detached)
+			right_segs.insert(seg);
+	}
+
+	segs.clear();
+
+	CollectSegs(lefts, segs);
+
+	for (seg_t *seg : segs)
+	{
+		if (seg->partner == NULL || seg->detached)
+			continue;
+
+		if (right_segs.count(seg->partner) == 0)
+			continue;
+
+		seg->detached = true;
+		seg->partner->detached = true;
+
+		pairs.push_back(seg);
+		pairs.push_back(seg->partner);
+	}
+}
+
+
+//
+// Split a seg which is already in a subsector at an existing vertex.
+// The new seg (the tail part) is linked into the list after the old seg.
+//
+static seg_t * SplitSegAtVertex(seg_t *old_seg, vertex_t *vert)
+{
+	seg_t *new_seg = NewSeg();
+
+	// copy seg info
+	// [ including the "next" field ]
+	new_seg[0] = old_seg[0];
+
+	old_seg->end   = vert;
+	new_seg->start = vert;
+
+	old_seg->Recompute();
+	new_seg->Recompute();
+
+	old_seg->next = new_seg;
+
+	return new_seg;
+}
+
+
+//
+// Split the pieces of a detached seg at the given vertices.
+// The pieces must be sorted by their lowest distance along the
+// 'base' seg, and so must the vertices.  When 'reversed' is true,
+// the pieces go in the opposite direction to the base seg.
+//
+static void SplitPieces(std::vector<seg_t *>& pieces, bool reversed,
+		const std::vector<vertex_t *>& verts, const seg_t *base)
+{
+	size_t k = 0;
+
+	for (size_t i = 0 ; i < verts.size() ; i++)
+	{
+		vertex_t *vert = verts[i];
+
+		double along = base->ParallelDist(vert->x, vert->y);
+
+		// find the piece which contains the vertex
+		for ( ; k < pieces.size() ; k++)
+		{
+			const vertex_t *high = reversed ? pieces[k]->start : pieces[k]->end;
+
+			if (base->ParallelDist(high->x, high->y) > along + DIST_EPSILON)
+				break;
+		}
+
+		if (k >= pieces.size())
+			break;
+
+		const vertex_t *low = reversed ? pieces[k]->end : pieces[k]->start;
+
+		// already split here?
+		if (base->ParallelDist(low->x, low->y) >= along - DIST_EPSILON)
+			continue;
+
+		seg_t *new_seg = SplitSegAtVertex(pieces[k], vert);
+
+		// keep the pieces sorted, 'k' becomes the upper part
+		if (reversed)
+			pieces.insert(pieces.begin() + k, new_seg);
+		else
+			pieces.insert(pieces.begin() + k + 1, new_seg);
+
+		k++;
+	}
+}
+
+
+//
+// Put a detached pair back together.  'A' contains the pieces of the
+// left seg, 'B' the pieces of its partner on the right side.
+//
+static void StitchPair(std::vector<seg_t *>& A, std::vector<seg_t *>& B)
+{
+	const seg_t *base = A[0];
+
+	// sort the pieces by distance along the base seg
+	std::sort(A.begin(), A.end(), [base](const seg_t *X, const seg_t *Y)
+	{
+		return base->ParallelDist(X->start->x, X->start->y) <
+		       base->ParallelDist(Y->start->x, Y->start->y);
+	});
+
+	std::sort(B.begin(), B.end(), [base](const seg_t *X, const seg_t *Y)
+	{
+		return base->ParallelDist(X->end->x, X->end->y) <
+		       base->ParallelDist(Y->end->x, Y->end->y);
+	});
+
+	// collect the split points of each side
+	std::vector<vertex_t *> A_verts;
+	std::vector<vertex_t *> B_verts;
+
+	for (size_t i = 0 ; i + 1 < A.size() ; i++)
+		A_verts.push_back(A[i]->end);
+
+	for (size_t i = 0 ; i + 1 < B.size() ; i++)
+		B_verts.push_back(B[i]->start);
+
+	SplitPieces(A, false, B_verts, base);
+	SplitPieces(B, true,  A_verts, base);
+
+	if (A.size() != B.size())
+		BugError("Failed to stitch seg %p (%d != %d pieces)\n",
+				base, (int)A.size(), (int)B.size());
+
+	for (size_t i = 0 ; i < A.size() ; i++)
+	{
+		A[i]->partner = B[i];
+		B[i]->partner = A[i];
+
+		A[i]->detached = false;
+		B[i]->detached = false;
+	}
+}
+
+
+//
+// Put the pairs detached by DetachPartners() back together.  All the
+// segs split from them were created after 'first_seg'.
+//
+static void StitchPartners(const std::vector<seg_t *>& pairs, size_t first_seg)
+{
+	if (pairs.empty())
+		return;
+
+	// pieces[i] are the pieces of pairs[i]
+	std::vector< std::vector<seg_t *> > pieces(pairs.size());
+
+	std::unordered_map<const seg_t *, size_t> lookup;
+
+	for (size_t i = 0 ; i < pairs.size() ; i++)
+	{
+		pieces[i].push_back(pairs[i]);
+		lookup[pairs[i]] = i;
+	}
+
+	for (size_t k = first_seg ; k < cur_level->segs.size() ; k++)
+	{
+		seg_t *seg = cur_level->segs[k];
+
+		if (! seg->detached)
+			continue;
+
+		// a piece keeps the partner of the seg it was split from,
+		// but pieces detached by an outer node won't be found.
+		auto it = lookup.find(seg->partner);
+
+		if (it != lookup.end())
+			pieces[it->second ^ 1].push_back(seg);
+	}
+
+	for (size_t i = 0 ; i < pairs.size() ; i += 2)
+		StitchPair(pieces[i], pieces[i+1]);
+}
+
+
+static build_result_e BuildBothHalves(node_t *node, quadtree_c *lefts, quadtree_c *rights, int depth)
+{
+	std::vector<seg_t *> pairs;
+
+	DetachPartners(lefts, rights, pairs);
+
+	size_t first_seg = cur_level->segs.size();
+
+	build_task_c *task = new build_task_c(rights, depth+1,
+			&node->r.node, &node->r.subsec);
+
+	cur_pool->Push(task);
+
+#if DEBUG_BUILDER
+	cur_info->Debug("Build: Going LEFT (right is a task)\n");
+#endif
+
+	build_result_e ret = BuildNodesWorker(lefts, depth+1,
+			&node->l.node, &node->l.subsec, true);
+
+	// the right half must be finished, even when cancelled
+	cur_pool->Wait(task);
+
+	// add the objects of the right half after those of the left half
+	AppendObjects(&task->objects);
+
+	if (ret == BUILD_OK)
+		ret = task->result;
+
+	delete task;
+
+	if (ret == BUILD_OK)
+		StitchPartners(pairs, first_seg);
+
+	return ret;
+}
+
+
+build_result_e BuildNodesThreaded(seg_t *list, bbox_t *bounds /* output */,
+		node_t ** N, subsec_t ** S)
+{
+	int count = cur_info->threads;
+
+	if (count <= 0)
+		count = (int)std::thread::hardware_concurrency();
+
+	count = std::max(1, count);
+
+	build_result_e ret;
+
+	{
+		task_pool_c pool(count);
+
+		FindLimits2(list, bounds);
+
+		quadtree_c *tree = TreeFromSegList(list, bounds);
+
+		ret = BuildNodesWorker(tree, 0, N, S, true);
+	}
+
+	// the new vertices and subsectors were numbered within each task,
+	// but they are now in their final order.
+	for (int i = num_old_vert ; i < num_vertices ; i++)
+		lev_vertices[i]->index = i - num_old_vert;
+
+	for (int i = 0 ; i < num_subsecs ; i++)
+		lev_subsecs[i]->index = i;
+
+	SYS_ASSERT(num_new_vert == num_vertices - num_old_vert);
+
+	return ret;
+}
+
+
 void ClockwiseBspTree()
 {
 	int cur_seg_index = 0;
@@ -48,6 +48,90 @@ typedef struct raw_wad_entry_s
 } PACKEDATTR raw_wad_entry_t;
 
 
+/* ----- The ZIP structures ---------------------- */
+
+#define ZIP_LOCAL_MAGIC    0x04034b50
+#define ZIP_CENTRAL_MAGIC  0x02014b50
+#define ZIP_END_MAGIC      0x06054b50
+
+#define ZIP_METHOD_STORE    0
+#define ZIP_METHOD_DEFLATE  8
+
+// general purpose flags
+#define ZIP_FLAG_ENCRYPTED   0x0001
+#define ZIP_FLAG_DESCRIPTOR  0x0008  // sizes and CRC follow the data
+#define ZIP_FLAG_UTF8        0x0800
+
+// local file header, the name and extra field follow it, then the
+// (compressed) data of the file.
+typedef struct raw_zip_local_s
+{
+	uint32_t magic;
+
+	uint16_t version;
+	uint16_t flags;
+	uint16_t method;
+	uint16_t mod_time;
+	uint16_t mod_date;
+
+	uint32_t crc;
+	uint32_t comp_size;
+	uint32_t size;
+
+	uint16_t name_len;
+	uint16_t extra_len;
+
+} PACKEDATTR raw_zip_local_t;
+
+
+// entry of the central directory, the name, extra field and
+// comment follow it.
+typedef struct raw_zip_central_s
+{
+	uint32_t magic;
+
+	uint16_t made_by;
+	uint16_t version;
+	uint16_t flags;
+	uint16_t method;
+	uint16_t mod_time;
+	uint16_t mod_date;
+
+	uint32_t crc;
+	uint32_t comp_size;
+	uint32_t size;
+
+	uint16_t name_len;
+	uint16_t extra_len;
+	uint16_t comment_len;
+
+	uint16_t disk;
+	uint16_t int_attr;
+	uint32_t ext_attr;
+	uint32_t local_pos;
+
+} PACKEDATTR raw_zip_central_t;
+
+
+// end of central directory record, at the very end of the file
+// (only followed by the comment of the archive).
+typedef struct raw_zip_end_s
+{
+	uint32_t magic;
+
+	uint16_t disk;
+	uint16_t dir_disk;
+	uint16_t disk_entries;
+	uint16_t num_entries;
+
+	uint32_t dir_size;
+	uint32_t dir_start;
+
+	uint16_t comment_len;
+
+} PACKEDATTR raw_zip_end_t;
+
+
 
 // Lump order in a map WAD: each map needs a couple of lumps
 // to provide a complete scene geometry description.
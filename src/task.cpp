@@ -0,0 +1,216 @@
+//------------------------------------------------------------------------
+//  Work-stealing thread pool
+//------------------------------------------------------------------------
+//
+//  ELFBSP  Copyright (C) 2025       Guilherme Miranda
+//
+//  This program is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU General Public License
+//  as published by the Free Software Foundation; either version 2
+//  of the License, or (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//------------------------------------------------------------------------
+
+#include "system.hpp"
+#include "task.hpp"
+#include "utility.hpp"
+
+namespace elfbsp
+{
+
+thread_local task_pool_c * cur_pool;
+
+// index of the current thread in cur_pool
+static thread_local int cur_worker;
+
+// true while a task_cpu_timer_c is measuring on this thread
+static thread_local bool cur_task_timed;
+
+
+task_pool_c::task_pool_c(int count) :
+	num_threads(count),
+	deques(count), deque_locks(count),
+	pending(0), finished(false)
+{
+	cur_pool   = this;
+	cur_worker = 0;
+
+	for (int i = 1 ; i < count ; i++)
+		threads.push_back(std::thread(&task_pool_c::WorkerLoop, this, i));
+}
+
+
+task_pool_c::~task_pool_c()
+{
+	{
+		std::lock_guard<std::mutex> guard(idle_lock);
+		finished = true;
+	}
+
+	idle_cond.notify_all();
+
+	for (size_t i = 0 ; i < threads.size() ; i++)
+		threads[i].join();
+
+	cur_pool = NULL;
+}
+
+
+void task_pool_c::Push(task_c *task)
+{
+	{
+		std::lock_guard<std::mutex> guard(deque_locks[cur_worker]);
+		deques[cur_worker].push_back(task);
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(idle_lock);
+		pending++;
+	}
+
+	idle_cond.notify_one();
+}
+
+
+task_c * task_pool_c::Steal(int thief)
+{
+	for (int k = 0 ; k < num_threads ; k++)
+	{
+		int victim = (thief + k) % num_threads;
+
+		std::lock_guard<std::mutex> guard(deque_locks[victim]);
+
+		if (! deques[victim].empty())
+		{
+			task_c *task = deques[victim].front();
+			deques[victim].pop_front();
+
+			pending--;
+			return task;
+		}
+	}
+
+	return NULL;
+}
+
+
+void task_pool_c::Run(task_c *task)
+{
+	task->Run();
+
+	{
+		std::lock_guard<std::mutex> guard(idle_lock);
+		task->done = true;
+	}
+
+	idle_cond.notify_all();
+}
+
+
+void task_pool_c::Wait(task_c *task)
+{
+	bool is_ours = false;
+
+	// the task is usually still at the back of our deque
+	{
+		std::lock_guard<std::mutex> guard(deque_locks[cur_worker]);
+
+		std::deque<task_c *>& D = deques[cur_worker];
+
+		if (! D.empty() && D.back() == task)
+		{
+			D.pop_back();
+			pending--;
+
+			is_ours = true;
+		}
+	}
+
+	if (is_ours)
+	{
+		Run(task);
+		return;
+	}
+
+	// another thread is running it, help with other tasks meanwhile
+	while (! task->done)
+	{
+		task_c *other = Steal(cur_worker);
+
+		if (other != NULL)
+		{
+			Run(other);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> guard(idle_lock);
+
+		idle_cond.wait(guard, [this, task] { return task->done || pending > 0; });
+	}
+}
+
+
+void task_pool_c::WorkerLoop(int index)
+{
+	cur_pool   = this;
+	cur_worker = index;
+
+	for (;;)
+	{
+		task_c *task = Steal(index);
+
+		if (task != NULL)
+		{
+			Run(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> guard(idle_lock);
+
+		idle_cond.wait(guard, [this] { return finished || pending > 0; });
+
+		if (finished)
+			return;
+	}
+}
+
+
+//------------------------------------------------------------------------
+
+task_cpu_timer_c::task_cpu_timer_c() :
+	active(cur_worker != 0 && ! cur_task_timed), start(0)
+{
+	if (active)
+	{
+		cur_task_timed = true;
+		start = TimeThreadCPU();
+	}
+}
+
+
+task_cpu_timer_c::~task_cpu_timer_c()
+{
+	Stop();
+}
+
+
+double task_cpu_timer_c::Stop()
+{
+	if (! active)
+		return 0;
+
+	active = false;
+	cur_task_timed = false;
+
+	return TimeThreadCPU() - start;
+}
+
+}  // namespace elfbsp
+
+//--- editor settings ---
+// vi:ts=4:sw=4:noexpandtab
@@ -0,0 +1,134 @@
+//------------------------------------------------------------------------
+//  Work-stealing thread pool
+//------------------------------------------------------------------------
+//
+//  ELFBSP  Copyright (C) 2025       Guilherme Miranda
+//
+//  This program is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU General Public License
+//  as published by the Free Software Foundation; either version 2
+//  of the License, or (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//------------------------------------------------------------------------
+
+#ifndef __ELFBSP_TASK_H__
+#define __ELFBSP_TASK_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace elfbsp
+{
+
+// a piece of work which may be run by any thread of a pool
+class task_c
+{
+public:
+	std::atomic<bool> done;
+
+public:
+	task_c() : done(false)
+	{ }
+
+	virtual ~task_c()
+	{ }
+
+	virtual void Run() = 0;
+};
+
+
+class task_pool_c
+{
+private:
+	int num_threads;
+
+	// thread #0 is the one which created the pool, it is not in here
+	std::vector<std::thread> threads;
+
+	// each thread has its own deque.  the owner pushes and pops tasks
+	// at the back, other threads steal them from the front.
+	std::vector< std::deque<task_c *> > deques;
+	std::vector< std::mutex > deque_locks;
+
+	// idle threads sleep here until a task is pushed or done
+	std::mutex idle_lock;
+	std::condition_variable idle_cond;
+
+	// number of tasks in all the deques
+	std::atomic<int> pending;
+
+	bool finished;
+
+public:
+	// create a pool with 'count' threads in total, the current thread
+	// being one of them.  it becomes the pool of the current thread
+	// (cur_pool) until it is destroyed.
+	task_pool_c(int count);
+	~task_pool_c();
+
+	int NumThreads() const { return num_threads; }
+
+	// add a task to the deque of the current thread
+	void Push(task_c *task);
+
+	// wait for a task to be done, running it now if no other thread
+	// has taken it yet.  other tasks may be run while waiting.
+	void Wait(task_c *task);
+
+private:
+	task_c * Steal(int thief);
+
+	void Run(task_c *task);
+	void WorkerLoop(int index);
+
+private:
+	// deliberately don't implement these
+	task_pool_c(const task_pool_c& other);
+	task_pool_c& operator= (const task_pool_c& other);
+};
+
+
+// the pool which the current thread belongs to, or NULL
+extern thread_local task_pool_c * cur_pool;
+
+
+class task_cpu_timer_c
+{
+	// measures the CPU time used by a task, for the statistics.  only
+	// the outermost task run by a worker thread is measured: the thread
+	// which created the pool is timed by its own caller, and a task run
+	// while waiting inside another one is part of that one's time.
+
+private:
+	bool active;
+	double start;
+
+public:
+	task_cpu_timer_c();
+	~task_cpu_timer_c();
+
+	// stop measuring, and return the CPU time in seconds (zero when
+	// this task is not measured).
+	double Stop();
+
+private:
+	// deliberately don't implement these
+	task_cpu_timer_c(const task_cpu_timer_c& other);
+	task_cpu_timer_c& operator= (const task_cpu_timer_c& other);
+};
+
+}  // namespace elfbsp
+
+#endif /* __ELFBSP_TASK_H__ */
+
+//--- editor settings ---
+// vi:ts=4:sw=4:noexpandtab
@@ -19,17 +19,24 @@
 //------------------------------------------------------------------------
 
 #include <cctype>
+#include <cerrno>
 
 #include "local.hpp"
 #include "system.hpp"
 #include "utility.hpp"
 
+#include <chrono>
+#include <mutex>
+
 #ifdef WIN32
 #include <io.h>
+#include <psapi.h>
 #else  // UNIX or MACOSX
 #include <dirent.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #endif
 
@@ -37,6 +44,15 @@
 #include <sys/param.h>
 #endif
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+
+// from <linux/fs.h>, clone all of a file (share its data blocks)
+#ifndef FICLONE
+#define FICLONE  _IOW(0x94, 9, int)
+#endif
+#endif
+
 namespace elfbsp
 {
 
@@ -147,10 +163,61 @@ bool FileExists(const char *filename)
 }
 
 
-bool FileCopy(const char *src_name, const char *dest_name)
+#ifdef __linux__
+//
+// let the kernel copy the file: a reflink when the filesystem supports
+// it (btrfs, xfs...), which shares the data instead of copying it,
+// otherwise copy_file_range() which at least avoids user space.
+// returns false when neither can be used, and nothing was copied.
+//
+static bool KernelFileCopy(int src_fd, int dest_fd, bool *was_OK)
 {
-	char buffer[1024];
+	if (ioctl(dest_fd, FICLONE, src_fd) == 0)
+	{
+		*was_OK = true;
+		return true;
+	}
+
+	struct stat info;
+
+	if (fstat(src_fd, &info) != 0)
+		return false;
+
+	off_t left   = info.st_size;
+	bool  copied = false;
 
+	while (left > 0)
+	{
+		ssize_t done = copy_file_range(src_fd, NULL, dest_fd, NULL, (size_t)left, 0);
+
+		if (done < 0 && errno == EINTR)
+			continue;
+
+		// nothing copied at all: some filesystems (procfs, FUSE, some
+		// network ones) and older kernels give 0 or an error here,
+		// so let the caller do a normal copy.
+		if (done <= 0 && ! copied)
+			return false;
+
+		// the file became shorter, or an error after copying some
+		if (done <= 0)
+		{
+			*was_OK = false;
+			return true;
+		}
+
+		left  -= done;
+		copied = true;
+	}
+
+	*was_OK = true;
+	return true;
+}
+#endif
+
+
+bool FileCopy(const char *src_name, const char *dest_name)
+{
 	FILE *src = fopen(src_name, "rb");
 	if (! src)
 		return false;
@@ -162,20 +229,38 @@ bool FileCopy(const char *src_name, const char *dest_name)
 		return false;
 	}
 
+	bool was_OK = false;
+
+#ifdef __linux__
+	if (KernelFileCopy(fileno(src), fileno(dest), &was_OK))
+	{
+		if (fclose(dest) != 0)
+			was_OK = false;
+
+		fclose(src);
+
+		return was_OK;
+	}
+#endif
+
+	std::vector<char> buffer(65536);
+
 	while (true)
 	{
-		size_t rlen = fread(buffer, 1, sizeof(buffer), src);
+		size_t rlen = fread(buffer.data(), 1, buffer.size(), src);
 		if (rlen == 0)
 			break;
 
-		size_t wlen = fwrite(buffer, 1, rlen, dest);
+		size_t wlen = fwrite(buffer.data(), 1, rlen, dest);
 		if (wlen != rlen)
 			break;
 	}
 
-	bool was_OK = !ferror(src) && !ferror(dest);
+	was_OK = !ferror(src) && !ferror(dest);
+
+	if (fclose(dest) != 0)
+		was_OK = false;
 
-	fclose(dest);
 	fclose(src);
 
 	return was_OK;
@@ -203,6 +288,153 @@ bool FileDelete(const char *filename)
 #endif
 }
 
+
+//
+// Positioned reads and writes go straight to the file descriptor with
+// pread() and pwrite() on POSIX systems, so the STDIO buffer of the
+// FILE is never involved.  Windows keeps using STDIO, with a flush
+// after every write.
+//
+int FileSeek(FILE *fp, int64_t offset, int whence)
+{
+#ifdef WIN32
+	return _fseeki64(fp, offset, whence);
+#else
+	return fseeko(fp, (off_t)offset, whence);
+#endif
+}
+
+
+int64_t FileTell(FILE *fp)
+{
+#ifdef WIN32
+	return _ftelli64(fp);
+#else
+	return (int64_t)ftello(fp);
+#endif
+}
+
+
+bool FileReadAt(FILE *fp, int64_t pos, void *data, size_t len)
+{
+	SYS_ASSERT(pos >= 0);
+
+	if (len == 0)
+		return true;
+
+#ifdef WIN32
+	if (FileSeek(fp, pos, SEEK_SET) != 0)
+		return false;
+
+	return (fread(data, len, 1, fp) == 1);
+#else
+	uint8_t *dest = (uint8_t *)data;
+
+	while (len > 0)
+	{
+		ssize_t got = pread(fileno(fp), dest, len, (off_t)pos);
+
+		if (got < 0 && errno == EINTR)
+			continue;
+
+		if (got <= 0)
+			return false;
+
+		dest += got;
+		pos  += (int64_t)got;
+		len  -= (size_t)got;
+	}
+
+	return true;
+#endif
+}
+
+
+bool FileWriteAt(FILE *fp, int64_t pos, const void *data, size_t len)
+{
+	SYS_ASSERT(pos >= 0);
+
+	if (len == 0)
+		return true;
+
+#ifdef WIN32
+	if (FileSeek(fp, pos, SEEK_SET) != 0)
+		return false;
+
+	if (fwrite(data, len, 1, fp) != 1)
+		return false;
+
+	if (fflush(fp) != 0)
+		return false;
+#else
+	const uint8_t *src = (const uint8_t *)data;
+
+	while (len > 0)
+	{
+		ssize_t done = pwrite(fileno(fp), src, len, (off_t)pos);
+
+		if (done < 0 && errno == EINTR)
+			continue;
+
+		if (done <= 0)
+			return false;
+
+		src += done;
+		pos += (int64_t)done;
+		len -= (size_t)done;
+	}
+#endif
+
+	return true;
+}
+
+
+bool FileSync(FILE *fp)
+{
+	if (fflush(fp) != 0)
+		return false;
+
+#ifdef WIN32
+	return (_commit(_fileno(fp)) == 0);
+#else
+	return (fsync(fileno(fp)) == 0);
+#endif
+}
+
+
+bool FileLoad(FILE *fp, std::vector<uint8_t>& data)
+{
+	data.clear();
+
+	for (;;)
+	{
+		size_t pos = data.size();
+
+		data.resize(pos + 65536);
+
+		size_t got = fread(data.data() + pos, 1, 65536, fp);
+
+		data.resize(pos + got);
+
+		if (got == 0)
+			break;
+	}
+
+	return ! ferror(fp);
+}
+
+
+bool FileTruncate(FILE *fp, int64_t size)
+{
+	fflush(fp);
+
+#ifdef WIN32
+	return (_chsize_s(_fileno(fp), size) == 0);
+#else
+	return (ftruncate(fileno(fp), (off_t)size) == 0);
+#endif
+}
+
 //------------------------------------------------------------------------
 // STRINGS
 //------------------------------------------------------------------------
@@ -296,6 +528,169 @@ void UtilFree(void *data)
 }
 
 
+//------------------------------------------------------------------------
+// ARENAS
+//------------------------------------------------------------------------
+
+#define ARENA_CHUNK_SIZE  (256 * 1024)
+
+class arena_spare_c
+{
+	// chunks released by the arenas of this thread, ready to be
+	// re-used.  They are freed when the thread finishes.
+
+public:
+	std::vector<char *> chunks;
+
+public:
+	~arena_spare_c()
+	{
+		for (size_t i = 0 ; i < chunks.size() ; i++)
+			UtilFree(chunks[i]);
+	}
+};
+
+static thread_local arena_spare_c arena_spare;
+
+
+arena_c::arena_c() : chunks(), pos(NULL), left(0)
+{ }
+
+
+arena_c::~arena_c()
+{
+	Release();
+}
+
+
+void *arena_c::Alloc(size_t size)
+{
+	// keep everything aligned for doubles and pointers
+	size = (size + 7) & ~(size_t)7;
+
+	SYS_ASSERT(size <= ARENA_CHUNK_SIZE);
+
+	if (size > left)
+	{
+		char *chunk;
+
+		if (! arena_spare.chunks.empty())
+		{
+			chunk = arena_spare.chunks.back();
+			arena_spare.chunks.pop_back();
+		}
+		else
+		{
+			chunk = (char *) UtilCalloc(ARENA_CHUNK_SIZE);
+		}
+
+		chunks.push_back(chunk);
+
+		pos  = chunk;
+		left = ARENA_CHUNK_SIZE;
+	}
+
+	void *ret = pos;
+
+	pos  += size;
+	left -= size;
+
+	// re-used chunks contain old objects
+	memset(ret, 0, size);
+
+	return ret;
+}
+
+
+void arena_c::Release()
+{
+	arena_spare.chunks.insert(arena_spare.chunks.end(), chunks.begin(), chunks.end());
+
+	chunks.clear();
+
+	pos  = NULL;
+	left = 0;
+}
+
+
+void arena_c::Adopt(arena_c& other)
+{
+	// the free space of the other arena is lost, but new objects
+	// keep going into our current chunk.
+	chunks.insert(chunks.begin(), other.chunks.begin(), other.chunks.end());
+
+	other.chunks.clear();
+
+	other.pos  = NULL;
+	other.left = 0;
+}
+
+
+//------------------------------------------------------------------------
+// TIMING
+//------------------------------------------------------------------------
+
+double TimeWall()
+{
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+
+	return std::chrono::duration<double>(now).count();
+}
+
+
+double TimeThreadCPU()
+{
+#ifdef WIN32
+	FILETIME created, ended, kernel, user;
+
+	if (! GetThreadTimes(GetCurrentThread(), &created, &ended, &kernel, &user))
+		return 0;
+
+	// these are in units of 100 nanoseconds
+	ULARGE_INTEGER k, u;
+
+	k.LowPart  = kernel.dwLowDateTime;
+	k.HighPart = kernel.dwHighDateTime;
+	u.LowPart  = user.dwLowDateTime;
+	u.HighPart = user.dwHighDateTime;
+
+	return (double)(k.QuadPart + u.QuadPart) * 1.0e-7;
+#else
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return 0;
+
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1.0e-9;
+#endif
+}
+
+
+long long PeakMemory()
+{
+#ifdef WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+
+	if (! GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return 0;
+
+	return (long long)pmc.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+
+#ifdef __APPLE__
+	// already in bytes
+	return (long long)usage.ru_maxrss;
+#else
+	return (long long)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+
 //------------------------------------------------------------------------
 // MATH STUFF
 //------------------------------------------------------------------------
@@ -365,6 +760,52 @@ void Adler32_Finish(uint32_t *crc)
 	/* nothing to do */
 }
 
+
+//------------------------------------------------------------------------
+//  CRC-32 CHECKSUM Code
+//------------------------------------------------------------------------
+
+// this is the CRC used by ZIP files (and PNG, gzip, etc...)
+
+static uint32_t crc32_table[256];
+
+static void CRC32_Init()
+{
+	for (uint32_t n = 0 ; n < 256 ; n++)
+	{
+		uint32_t c = n;
+
+		for (int k = 0 ; k < 8 ; k++)
+			c = (c & 1) ? (0xEDB88320U ^ (c >> 1)) : (c >> 1);
+
+		crc32_table[n] = c;
+	}
+}
+
+void CRC32_Begin(uint32_t *crc)
+{
+	static std::once_flag table_once;
+
+	std::call_once(table_once, CRC32_Init);
+
+	*crc = 0xFFFFFFFFU;
+}
+
+void CRC32_AddBlock(uint32_t *crc, const uint8_t *data, size_t length)
+{
+	uint32_t c = *crc;
+
+	for ( ; length > 0 ; data++, length--)
+		c = crc32_table[(c ^ *data) & 0xFF] ^ (c >> 8);
+
+	*crc = c;
+}
+
+void CRC32_Finish(uint32_t *crc)
+{
+	*crc ^= 0xFFFFFFFFU;
+}
+
 } // namespace elfbsp
 
 //--- editor settings ---
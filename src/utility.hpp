@@ -21,7 +21,10 @@
 #ifndef __ELFBSP_UTILITY_H__
 #define __ELFBSP_UTILITY_H__
 
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <vector>
 
 namespace elfbsp
 {
@@ -45,11 +48,65 @@ bool FileCopy  (const char *src_name, const char *dest_name);
 bool FileRename(const char *old_name, const char *new_name);
 bool FileDelete(const char *filename);
 
+// positioned file access, with 64-bit offsets.  the STDIO position of
+// the file is not used (except on Windows).  these return false (or a
+// non-zero value for FileSeek) on error.
+int     FileSeek(FILE *fp, int64_t offset, int whence);
+int64_t FileTell(FILE *fp);
+bool    FileReadAt (FILE *fp, int64_t pos, void *data, size_t len);
+bool    FileWriteAt(FILE *fp, int64_t pos, const void *data, size_t len);
+bool    FileTruncate(FILE *fp, int64_t size);
+
+// flush everything written to the file to the disk.
+// returns false on error.
+bool FileSync(FILE *fp);
+
+// read everything from the current position of a file (which may be
+// a pipe) until its end.  returns false on error.
+bool FileLoad(FILE *fp, std::vector<uint8_t>& data);
+
 // memory allocation, guaranteed to not return NULL.
 void *UtilCalloc(int size);
 void *UtilRealloc(void *old, int size);
 void UtilFree(void *data);
 
+// an arena hands out memory for lots of small objects which are all
+// freed at the same time.  The memory is zeroed like UtilCalloc().
+// Released memory is kept by the current thread and gets re-used by
+// the arenas it creates later.
+class arena_c
+{
+private:
+	std::vector<char *> chunks;
+
+	// free space in the last chunk
+	char  *pos;
+	size_t left;
+
+public:
+	arena_c();
+	~arena_c();
+
+	void *Alloc(size_t size);
+
+	// free all the objects at once
+	void Release();
+
+	// take over all the objects of another arena, which becomes empty.
+	void Adopt(arena_c& other);
+
+private:
+	// deliberately don't implement these
+	arena_c(const arena_c& other);
+	arena_c& operator= (const arena_c& other);
+};
+
+// timing and memory use.  the CPU time is only for the calling thread.
+// the peak memory is for the whole process, in bytes (zero if unknown).
+double TimeWall();
+double TimeThreadCPU();
+long long PeakMemory();
+
 // math stuff
 int RoundPOW2(int x);
 double ComputeAngle(double dx, double dy);
@@ -63,6 +120,10 @@ void Adler32_Begin(uint32_t *crc);
 void Adler32_AddBlock(uint32_t *crc, const uint8_t *data, int length);
 void Adler32_Finish(uint32_t *crc);
 
+void CRC32_Begin(uint32_t *crc);
+void CRC32_AddBlock(uint32_t *crc, const uint8_t *data, size_t length);
+void CRC32_Finish(uint32_t *crc);
+
 } // namespace elfbsp
 
 #endif  /* __ELFBSP_UTILITY_H__ */
@@ -23,6 +23,11 @@
 #include "utility.hpp"
 #include "wad.hpp"
 
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #define DEBUG_WAD  0
 
 namespace elfbsp
@@ -44,12 +49,26 @@ void LumpWarning(const char *fmt, ...)
 #endif
 
 
+//
+// Offsets within the file are 64-bit, but the header and directory
+// only have room for 32-bit ones.
+//
+static uint32_t DiskOffset(int64_t pos)
+{
+	if (pos < 0 || pos > (int64_t)UINT32_MAX)
+		cur_info->FatalError("WAD file too large (offset %lld is beyond 4 GB).\n", (long long)pos);
+
+	return (uint32_t)pos;
+}
+
+
 //------------------------------------------------------------------------
 //  LUMP Handling
 //------------------------------------------------------------------------
 
-Lump_c::Lump_c(Wad_file *_par, const char *_name, int _start, int _len) :
-	parent(_par), lumpname(), l_start(_start), l_length(_len)
+Lump_c::Lump_c(Wad_file *_par, const char *_name, int64_t _start, int _len) :
+	parent(_par), lumpname(), l_start(_start), l_length(_len),
+	l_key(0), l_index(-1), is_held(false), held()
 {
 	// ensure lump name is uppercase
 	Rename(_name);
@@ -57,7 +76,7 @@ Lump_c::Lump_c(Wad_file *_par, const char *_name, int _start, int _len) :
 
 
 Lump_c::Lump_c(Wad_file *_par, const raw_wad_entry_t *entry) :
-	parent(_par), lumpname()
+	parent(_par), lumpname(), l_key(0), l_index(-1), is_held(false), held()
 {
 	// handle the entry name, which can lack a terminating NUL
 	char buffer[10];
@@ -67,11 +86,11 @@ Lump_c::Lump_c(Wad_file *_par, const raw_wad_entry_t *entry) :
 	// ensure lump name is uppercase
 	Rename(buffer);
 
-	l_start  = LE_U32(entry->pos);
-	l_length = LE_U32(entry->size);
+	l_start  = (int64_t)LE_U32(entry->pos);
+	l_length = (int)LE_U32(entry->size);
 
 #if DEBUG_WAD
-	cur_info->Debug("new lump '%s' @ %d len:%d\n", Name(), l_start, l_length);
+	cur_info->Debug("new lump '%s' @ %lld len:%d\n", Name(), (long long)l_start, l_length);
 #endif
 }
 
@@ -88,14 +107,21 @@ void Lump_c::MakeEntry(raw_wad_entry_t *entry)
 	memset(entry->name, 0, 8);
 	memcpy(entry->name, lumpname.c_str(), lumpname.size());
 
-	entry->pos  = LE_U32(l_start);
-	entry->size = LE_U32(l_length);
+	entry->pos  = LE_U32(DiskOffset(l_start));
+	entry->size = LE_U32((uint32_t)l_length);
 }
 
 
 bool Lump_c::Match(const char *s) const
 {
-	return (0 == StringCaseCmp(lumpname.c_str(), s));
+	if (l_key != LumpNameKey(s))
+		return false;
+
+	// only names longer than 8 characters need a full check
+	if (lumpname.size() > 8 || strlen(s) > 8)
+		return (0 == StringCaseCmp(lumpname.c_str(), s));
+
+	return true;
 }
 
 
@@ -107,6 +133,8 @@ void Lump_c::Rename(const char *new_name)
 	const char * s;
 	for (s = new_name ; *s != 0 ; s++)
 		lumpname.push_back(toupper(*s));
+
+	l_key = LumpNameKey(lumpname.c_str());
 }
 
 
@@ -114,7 +142,11 @@ bool Lump_c::Seek(int offset)
 {
 	SYS_ASSERT(offset >= 0);
 
-	return (fseek(parent->fp, l_start + offset, SEEK_SET) == 0);
+	if (offset > l_length)
+		return false;
+
+	parent->read_pos = l_start + offset;
+	return true;
 }
 
 
@@ -122,40 +154,76 @@ bool Lump_c::Read(void *data, int len)
 {
 	SYS_ASSERT(data && len > 0);
 
-	return (fread(data, len, 1, parent->fp) == 1);
+	if (! ReadData((int)(parent->read_pos - l_start), data, (size_t)len))
+		return false;
+
+	parent->read_pos += len;
+	return true;
 }
 
 
-bool Lump_c::GetLine(char *buffer, size_t buf_size)
+bool Lump_c::ReadData(int offset, void *data, size_t len)
 {
-	int cur_pos = (int)ftell(parent->fp);
+	if (! is_held)
+		return parent->ReadAt(l_start + offset, data, len);
 
-	if (cur_pos < 0)
+	if (offset < 0 || (size_t)offset + len > held.size())
 		return false;
 
-	cur_pos -= l_start;
+	memcpy(data, held.data() + offset, len);
+	return true;
+}
 
-	if (cur_pos >= l_length)
-		return false;  // EOF
 
-	char *dest = buffer;
-	char *dest_end = buffer + buf_size - 1;
+const uint8_t * Lump_c::Data() const
+{
+	if (is_held)
+		return held.empty() ? NULL : held.data();
 
-	for (; cur_pos < l_length && dest < dest_end ; cur_pos++)
+	if (parent->mem != NULL)
 	{
-		*dest++ = fgetc(parent->fp);
+		if (l_length <= 0 || (uint64_t)l_start + (uint64_t)l_length > (uint64_t)parent->mem->size())
+			return NULL;
 
-		if (dest[-1] == '\n')
-			break;
+		return parent->mem->data() + l_start;
+	}
 
-		if (ferror(parent->fp))
-			return false;
+	if (parent->map_data == NULL || l_length <= 0)
+		return NULL;
+
+	if ((uint64_t)l_start + (uint64_t)l_length > (uint64_t)parent->map_size)
+		return NULL;
+
+	return parent->map_data + l_start;
+}
+
+
+bool Lump_c::GetLine(char *buffer, size_t buf_size)
+{
+	int64_t offset = parent->read_pos - l_start;
+
+	if (offset < 0 || offset >= l_length)
+		return false;  // EOF
+
+	int cur_pos = (int)offset;
+
+	int want = std::min(l_length - cur_pos, (int)buf_size - 1);
+
+	if (! ReadData(cur_pos, buffer, (size_t)want))
+		return false;
+
+	// stop after the first newline
+	int len = 0;
 
-		if (feof(parent->fp))
+	while (len < want)
+	{
+		if (buffer[len++] == '\n')
 			break;
 	}
 
-	*dest = 0;
+	buffer[len] = 0;
+
+	parent->read_pos += len;
 
 	return true;  // OK
 }
@@ -164,10 +232,15 @@ bool Lump_c::GetLine(char *buffer, size_t buf_size)
 bool Lump_c::Write(const void *data, int len)
 {
 	SYS_ASSERT(data && len > 0);
+	SYS_ASSERT(parent->write_lump == this);
+
+	const byte *bytes = (const byte *)data;
+
+	parent->write_buf.insert(parent->write_buf.end(), bytes, bytes + len);
 
 	l_length += len;
 
-	return (fwrite(data, len, 1, parent->fp) == 1);
+	return true;
 }
 
 
@@ -189,10 +262,7 @@ void Lump_c::Printf(const char *msg, ...)
 
 bool Lump_c::Finish()
 {
-	if (l_length == 0)
-		l_start = 0;
-
-	return parent->FinishLump(l_length);
+	return parent->FinishLump(this);
 }
 
 
@@ -204,8 +274,15 @@ Wad_file::Wad_file(const char *_name, char _mode, FILE * _fp) :
 	filename(_name), mode(_mode), fp(_fp), kind('P'),
 	total_size(0), directory(),
 	dir_start(0), dir_count(0),
+	map_data(NULL), map_size(0), mem(NULL), read_pos(0),
 	levels(), patches(), sprites(), flats(), tx_tex(),
-	begun_write(false), insert_point(-1)
+	begun_write(false), begun_max_size(-1),
+	write_lump(NULL), write_buf(),
+	in_session(false), session_dirty(false), session_compact(false),
+	session_dir(), reserved(),
+	space_valid(false), space_shared(false), space_end(0),
+	used_space(), free_space(), free_sizes(),
+	insert_point(-1)
 {
 	// nothing needed
 }
@@ -214,13 +291,20 @@ Wad_file::~Wad_file()
 {
 	FileMessage("Closing WAD file: %s\n", filename.c_str());
 
-	fclose(fp);
+	if (in_session)
+		CommitSession();
+
+	UnmapFile();
+
+	if (fp != NULL)
+		fclose(fp);
 
 	// free the directory
 	for (int k = 0 ; k < NumLumps() ; k++)
 		delete directory[k];
 
 	directory.clear();
+	name_index.clear();
 }
 
 
@@ -260,13 +344,13 @@ retry:
 	Wad_file *w = new Wad_file(filename, mode, fp);
 
 	// determine total size (seek to end)
-	if (fseek(fp, 0, SEEK_END) != 0)
+	if (FileSeek(fp, 0, SEEK_END) != 0)
 		cur_info->FatalError("Error determining WAD size.\n");
 
-	w->total_size = (int)ftell(fp);
+	w->total_size = FileTell(fp);
 
 #if DEBUG_WAD
-	cur_info->Debug("total_size = %d\n", w->total_size);
+	cur_info->Debug("total_size = %lld\n", (long long)w->total_size);
 #endif
 
 	if (w->total_size < 0)
@@ -276,10 +360,76 @@ retry:
 	w->DetectLevels();
 	w->ProcessNamespaces();
 
+	w->MapFile();
+
 	return w;
 }
 
 
+Wad_file * Wad_file::OpenMemory(const char *name, std::vector<byte> *data)
+{
+	SYS_ASSERT(data != NULL);
+
+	FileMessage("Opening WAD in memory: %s\n", name);
+
+	if (data->size() < sizeof(raw_wad_header_t))
+		return NULL;
+
+	Wad_file *w = new Wad_file(name, 'a', NULL);
+
+	w->mem = data;
+	w->total_size = (int64_t)data->size();
+
+	w->ReadDirectory();
+	w->DetectLevels();
+	w->ProcessNamespaces();
+
+	return w;
+}
+
+
+//
+// The mapping is shared with the file, so anything written later is
+// seen through it, as long as it lies within the size of the file at
+// the time of mapping.  Lumps which are beyond it are read with plain
+// file reads instead, as is everything when mapping fails.
+//
+void Wad_file::MapFile()
+{
+#ifndef WIN32
+	if (total_size <= 0)
+		return;
+
+	// too big for the address space, use plain reads
+	if ((uint64_t)total_size > (uint64_t)SIZE_MAX)
+		return;
+
+	void *addr = mmap(NULL, (size_t)total_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+
+	if (addr == MAP_FAILED)
+	{
+		FileMessage("Mapping file failed: %s\n", strerror(errno));
+		return;
+	}
+
+	map_data = (const uint8_t *)addr;
+	map_size = (size_t)total_size;
+#endif
+}
+
+
+void Wad_file::UnmapFile()
+{
+#ifndef WIN32
+	if (map_data != NULL)
+		munmap((void *)map_data, map_size);
+#endif
+
+	map_data = NULL;
+	map_size = 0;
+}
+
+
 Wad_file * Wad_file::Create(const char *filename, char mode)
 {
 	FileMessage("Creating new WAD file: %s\n", filename);
@@ -334,28 +484,28 @@ bool Wad_file::Validate(const char *filename)
 }
 
 
-static int WhatLevelPart(const char *name)
+static int WhatLevelPart(const Lump_c *lump)
 {
-	if (StringCaseCmp(name, "THINGS")   == 0) return 1;
-	if (StringCaseCmp(name, "LINEDEFS") == 0) return 2;
-	if (StringCaseCmp(name, "SIDEDEFS") == 0) return 3;
-	if (StringCaseCmp(name, "VERTEXES") == 0) return 4;
-	if (StringCaseCmp(name, "SECTORS")  == 0) return 5;
+	if (lump->MatchKey(LumpNameKey("THINGS")))   return 1;
+	if (lump->MatchKey(LumpNameKey("LINEDEFS"))) return 2;
+	if (lump->MatchKey(LumpNameKey("SIDEDEFS"))) return 3;
+	if (lump->MatchKey(LumpNameKey("VERTEXES"))) return 4;
+	if (lump->MatchKey(LumpNameKey("SECTORS")))  return 5;
 
 	return 0;
 }
 
-static bool IsLevelLump(const char *name)
+static bool IsLevelLump(const Lump_c *lump)
 {
-	if (StringCaseCmp(name, "SEGS")     == 0) return true;
-	if (StringCaseCmp(name, "SSECTORS") == 0) return true;
-	if (StringCaseCmp(name, "NODES")    == 0) return true;
-	if (StringCaseCmp(name, "REJECT")   == 0) return true;
-	if (StringCaseCmp(name, "BLOCKMAP") == 0) return true;
-	if (StringCaseCmp(name, "BEHAVIOR") == 0) return true;
-	if (StringCaseCmp(name, "SCRIPTS")  == 0) return true;
-
-	return WhatLevelPart(name) != 0;
+	if (lump->MatchKey(LumpNameKey("SEGS")))     return true;
+	if (lump->MatchKey(LumpNameKey("SSECTORS"))) return true;
+	if (lump->MatchKey(LumpNameKey("NODES")))    return true;
+	if (lump->MatchKey(LumpNameKey("REJECT")))   return true;
+	if (lump->MatchKey(LumpNameKey("BLOCKMAP"))) return true;
+	if (lump->MatchKey(LumpNameKey("BEHAVIOR"))) return true;
+	if (lump->MatchKey(LumpNameKey("SCRIPTS")))  return true;
+
+	return WhatLevelPart(lump) != 0;
 }
 
 
@@ -370,20 +520,30 @@ Lump_c * Wad_file::GetLump(int index)
 
 Lump_c * Wad_file::FindLump(const char *name)
 {
-	for (int k = 0 ; k < NumLumps() ; k++)
-		if (directory[k]->Match(name))
-			return directory[k];
+	int index = FindLumpNum(name);
 
-	return NULL;  // not found
+	if (index < 0)
+		return NULL;  // not found
+
+	return directory[index];
 }
 
 int Wad_file::FindLumpNum(const char *name)
 {
-	for (int k = 0 ; k < NumLumps() ; k++)
-		if (directory[k]->Match(name))
-			return k;
+	int index = -1;
 
-	return -1;  // not found
+	// when the same name occurs several times, use the earliest one
+	auto range = name_index.equal_range(LumpNameKey(name));
+
+	for (auto it = range.first ; it != range.second ; ++it)
+	{
+		Lump_c *lump = it->second;
+
+		if (lump->Match(name) && (index < 0 || lump->l_index < index))
+			index = lump->l_index;
+	}
+
+	return index;
 }
 
 
@@ -394,11 +554,13 @@ int Wad_file::LevelLookupLump(int lev_num, const char *name)
 	int start  = LevelHeader(lev_num);
 	int finish = LevelLastLump(lev_num);
 
+	uint64_t key = LumpNameKey(name);
+
 	for (int k = start+1 ; k <= finish ; k++)
 	{
 		SYS_ASSERT(0 <= k && k < NumLumps());
 
-		if (directory[k]->Match(name))
+		if (directory[k]->l_key == key && directory[k]->Match(name))
 			return k;
 	}
 
@@ -408,6 +570,8 @@ int Wad_file::LevelLookupLump(int lev_num, const char *name)
 
 int Wad_file::LevelFind(const char *name)
 {
+	uint64_t key = LumpNameKey(name);
+
 	for (int k = 0 ; k < (int)levels.size() ; k++)
 	{
 		int index = levels[k];
@@ -415,7 +579,7 @@ int Wad_file::LevelFind(const char *name)
 		SYS_ASSERT(0 <= index && index < NumLumps());
 		SYS_ASSERT(directory[index]);
 
-		if (directory[index]->Match(name))
+		if (directory[index]->l_key == key && directory[index]->Match(name))
 			return k;
 	}
 
@@ -434,7 +598,7 @@ int Wad_file::LevelLastLump(int lev_num)
 		while (count < MAX_LUMPS_IN_A_LEVEL &&
 			   start+count < NumLumps())
 		{
-			if (directory[start+count]->Match("ENDMAP"))
+			if (directory[start+count]->MatchKey(LumpNameKey("ENDMAP")))
 			{
 				count++;
 				break;
@@ -447,7 +611,7 @@ int Wad_file::LevelLastLump(int lev_num)
 	{
 		while (count < MAX_LUMPS_IN_A_LEVEL &&
 			   start+count < NumLumps() &&
-			   IsLevelLump(directory[start+count]->Name()) )
+			   IsLevelLump(directory[start+count]) )
 		{
 			count++;
 		}
@@ -507,17 +671,13 @@ map_format_e Wad_file::LevelFormat(int lev_num)
 
 	if (start + 2 < (int)NumLumps())
 	{
-		const char *name = GetLump(start + 1)->Name();
-
-		if (StringCaseCmp(name, "TEXTMAP") == 0)
+		if (GetLump(start + 1)->MatchKey(LumpNameKey("TEXTMAP")))
 			return MAPF_UDMF;
 	}
 
 	if (start + LL_BEHAVIOR < (int)NumLumps())
 	{
-		const char *name = GetLump(start + LL_BEHAVIOR)->Name();
-
-		if (StringCaseCmp(name, "BEHAVIOR") == 0)
+		if (GetLump(start + LL_BEHAVIOR)->MatchKey(LumpNameKey("BEHAVIOR")))
 			return MAPF_Hexen;
 	}
 
@@ -561,38 +721,49 @@ void Wad_file::ReadDirectory()
 {
 	// WISH: no fatal errors
 
-	rewind(fp);
-
 	raw_wad_header_t header;
 
-	if (fread(&header, sizeof(header), 1, fp) != 1)
+	if (! ReadAt(0, &header, sizeof(header)))
 		cur_info->FatalError("Error reading WAD header.\n");
 
 	// WISH: check ident for PWAD or IWAD
 
 	kind = header.ident[0];
 
-	dir_start = LE_S32(header.dir_start);
-	dir_count = LE_S32(header.num_entries);
+	uint32_t num_entries = LE_U32(header.num_entries);
+
+	dir_start = (int64_t)LE_U32(header.dir_start);
+
+	// the whole directory must lie within the file
+	int64_t dir_end = dir_start + (int64_t)num_entries * (int64_t)sizeof(raw_wad_entry_t);
+
+	if (num_entries > 0 && dir_end > total_size)
+		cur_info->FatalError("Bad WAD header, too many entries (%u)\n", num_entries);
+
+	dir_count = (int)num_entries;
 
-	if (dir_count < 0 || dir_count > 32000)
-		cur_info->FatalError("Bad WAD header, too many entries (%d)\n", dir_count);
+	// read the whole directory in one go
+	std::vector<raw_wad_entry_t> entries((size_t)dir_count);
 
-	if (fseek(fp, dir_start, SEEK_SET) != 0)
-		cur_info->FatalError("Error seeking to WAD directory.\n");
+	if (! ReadAt(dir_start, entries.data(), entries.size() * sizeof(raw_wad_entry_t)))
+		cur_info->FatalError("Error reading WAD directory.\n");
 
 	for (int i = 0 ; i < dir_count ; i++)
 	{
-		raw_wad_entry_t entry;
+		const raw_wad_entry_t& entry = entries[i];
 
-		if (fread(&entry, sizeof(entry), 1, fp) != 1)
-			cur_info->FatalError("Error reading WAD directory.\n");
+		if (LE_U32(entry.size) > (uint32_t)INT_MAX)
+			cur_info->FatalError("Bad WAD directory, lump too large.\n");
 
 		Lump_c *lump = new Lump_c(this, &entry);
 
 		// WISH: check if entry is valid
 
+		lump->l_index = (int)directory.size();
+
 		directory.push_back(lump);
+
+		IndexLump(lump);
 	}
 }
 
@@ -610,7 +781,7 @@ void Wad_file::DetectLevels()
 		int part_count = 0;
 
 		// check for UDMF levels
-		if (directory[k+1]->Match("TEXTMAP"))
+		if (directory[k+1]->MatchKey(LumpNameKey("TEXTMAP")))
 		{
 			levels.push_back(k);
 #if DEBUG_WAD
@@ -625,7 +796,7 @@ void Wad_file::DetectLevels()
 			if (k+i >= NumLumps())
 				break;
 
-			int part = WhatLevelPart(directory[k+i]->Name());
+			int part = WhatLevelPart(directory[k+i]);
 
 			if (part == 0)
 				break;
@@ -686,13 +857,15 @@ void Wad_file::ProcessNamespaces()
 
 	for (int k = 0 ; k < NumLumps() ; k++)
 	{
-		const char *name = directory[k]->Name();
+		Lump_c *lump = directory[k];
+
+		const char *name = lump->Name();
 
 		// skip the sub-namespace markers
 		if (IsDummyMarker(name))
 			continue;
 
-		if (StringCaseCmp(name, "P_START") == 0 || StringCaseCmp(name, "PP_START") == 0)
+		if (lump->Match("P_START") || lump->Match("PP_START"))
 		{
 			if (active && active != 'P')
 				LumpWarning("missing %c_END marker.\n", active);
@@ -700,7 +873,7 @@ void Wad_file::ProcessNamespaces()
 			active = 'P';
 			continue;
 		}
-		else if (StringCaseCmp(name, "P_END") == 0 || StringCaseCmp(name, "PP_END") == 0)
+		else if (lump->Match("P_END") || lump->Match("PP_END"))
 		{
 			if (active != 'P')
 				LumpWarning("stray P_END marker found.\n");
@@ -709,7 +882,7 @@ void Wad_file::ProcessNamespaces()
 			continue;
 		}
 
-		if (StringCaseCmp(name, "S_START") == 0 || StringCaseCmp(name, "SS_START") == 0)
+		if (lump->Match("S_START") || lump->Match("SS_START"))
 		{
 			if (active && active != 'S')
 				LumpWarning("missing %c_END marker.\n", active);
@@ -717,7 +890,7 @@ void Wad_file::ProcessNamespaces()
 			active = 'S';
 			continue;
 		}
-		else if (StringCaseCmp(name, "S_END") == 0 || StringCaseCmp(name, "SS_END") == 0)
+		else if (lump->Match("S_END") || lump->Match("SS_END"))
 		{
 			if (active != 'S')
 				LumpWarning("stray S_END marker found.\n");
@@ -726,7 +899,7 @@ void Wad_file::ProcessNamespaces()
 			continue;
 		}
 
-		if (StringCaseCmp(name, "F_START") == 0 || StringCaseCmp(name, "FF_START") == 0)
+		if (lump->Match("F_START") || lump->Match("FF_START"))
 		{
 			if (active && active != 'F')
 				LumpWarning("missing %c_END marker.\n", active);
@@ -734,7 +907,7 @@ void Wad_file::ProcessNamespaces()
 			active = 'F';
 			continue;
 		}
-		else if (StringCaseCmp(name, "F_END") == 0 || StringCaseCmp(name, "FF_END") == 0)
+		else if (lump->Match("F_END") || lump->Match("FF_END"))
 		{
 			if (active != 'F')
 				LumpWarning("stray F_END marker found.\n");
@@ -743,7 +916,7 @@ void Wad_file::ProcessNamespaces()
 			continue;
 		}
 
-		if (StringCaseCmp(name, "TX_START") == 0)
+		if (lump->Match("TX_START"))
 		{
 			if (active && active != 'T')
 				LumpWarning("missing %c_END marker.\n", active);
@@ -751,7 +924,7 @@ void Wad_file::ProcessNamespaces()
 			active = 'T';
 			continue;
 		}
-		else if (StringCaseCmp(name, "TX_END") == 0)
+		else if (lump->Match("TX_END"))
 		{
 			if (active != 'T')
 				LumpWarning("stray TX_END marker found.\n");
@@ -810,9 +983,6 @@ void Wad_file::BeginWrite()
 	if (begun_write)
 		BugError("Wad_file::BeginWrite() called again without EndWrite()\n");
 
-	// put the size into a quantum state
-	total_size = 0;
-
 	begun_write = true;
 }
 
@@ -822,15 +992,101 @@ void Wad_file::EndWrite()
 	if (! begun_write)
 		BugError("Wad_file::EndWrite() called without BeginWrite()\n");
 
+	if (write_lump != NULL)
+		BugError("Wad_file::EndWrite() called with an unfinished lump\n");
+
 	begun_write = false;
 
-	WriteDirectory();
+	if (in_session)
+	{
+		// only remember it, CommitSession() will write it
+		if (! session_compact)
+			MakeDirectory(session_dir);
+
+		session_dirty = true;
+	}
+	else
+	{
+		std::vector<raw_wad_entry_t> entries;
+
+		MakeDirectory(entries);
+		WriteDirectory(entries, false);
+	}
 
 	// reset the insertion point
 	insert_point = -1;
 }
 
 
+void Wad_file::BeginSession(bool compact)
+{
+	if (mode == 'r')
+		BugError("Wad_file::BeginSession() called on read-only file\n");
+
+	if (in_session || begun_write)
+		BugError("Wad_file::BeginSession() called at wrong time\n");
+
+	in_session      = true;
+	session_dirty   = false;
+	session_compact = compact;
+
+	// nothing is written to the file in compact mode
+	if (! compact)
+		ReserveOnDisk();
+}
+
+
+void Wad_file::CommitSession()
+{
+	if (! in_session)
+		BugError("Wad_file::CommitSession() called without BeginSession()\n");
+
+	// a level which was being written (when a fatal error occurs) is
+	// not part of the stored directory, and hence it is dropped.
+	// in compact mode, the whole session is dropped.
+	bool aborted = begun_write;
+
+	begun_write = false;
+	write_lump  = NULL;
+
+	in_session = false;
+
+	if (session_dirty && session_compact)
+	{
+		if (! aborted)
+			WriteCompacted();
+	}
+	else if (session_dirty)
+	{
+		WriteDirectory(session_dir, true);
+	}
+
+	session_dirty = false;
+	session_dir.clear();
+
+	reserved.clear();
+	space_valid = false;
+}
+
+
+void Wad_file::ReserveOnDisk()
+{
+	reserved.clear();
+	space_valid = false;
+
+	for (int k = 0 ; k < NumLumps() ; k++)
+	{
+		Lump_c *lump = directory[k];
+
+		if (lump->Length() > 0)
+			reserved.push_back(std::make_pair(lump->l_start, lump->l_start + lump->l_length));
+	}
+
+	if (dir_count > 0)
+		reserved.push_back(std::make_pair(dir_start, dir_start + (int64_t)dir_count * (int64_t)sizeof(raw_wad_entry_t)));
+}
+
+
 void Wad_file::RenameLump(int index, const char *new_name)
 {
 	SYS_ASSERT(begun_write);
@@ -839,7 +1095,11 @@ void Wad_file::RenameLump(int index, const char *new_name)
 	Lump_c *lump = directory[index];
 	SYS_ASSERT(lump);
 
+	UnindexLump(lump);
+
 	lump->Rename(new_name);
+
+	IndexLump(lump);
 }
 
 
@@ -853,7 +1113,14 @@ void Wad_file::RemoveLumps(int index, int count)
 
 	for (i = 0 ; i < count ; i++)
 	{
-		delete directory[index + i];
+		Lump_c *lump = directory[index + i];
+
+		if (! lump->is_held)
+			FreeSpace(lump->l_start, lump->l_length);
+
+		UnindexLump(lump);
+
+		delete lump;
 	}
 
 	for (i = index ; i+count < NumLumps() ; i++)
@@ -861,6 +1128,8 @@ void Wad_file::RemoveLumps(int index, int count)
 
 	directory.resize(directory.size() - (size_t)count);
 
+	Renumber(index);
+
 	// fix various arrays containing lump indices
 	FixGroup(levels,  index, 0, count);
 	FixGroup(patches, index, 0, count);
@@ -897,7 +1166,7 @@ void Wad_file::RemoveZNodes(int lev_num)
 
 	for ( ; start <= finish ; start++)
 	{
-		if (StringCaseCmp(directory[start]->Name(), "ZNODES") == 0)
+		if (directory[start]->MatchKey(LumpNameKey("ZNODES")))
 		{
 			RemoveLumps(start, 1);
 			break;
@@ -936,15 +1205,44 @@ void Wad_file::FixGroup(std::vector<int>& group, int index,
 }
 
 
+void Wad_file::Renumber(int start)
+{
+	for (int k = start ; k < NumLumps() ; k++)
+		directory[k]->l_index = k;
+}
+
+
+void Wad_file::IndexLump(Lump_c *lump)
+{
+	name_index.insert(std::make_pair(lump->l_key, lump));
+}
+
+
+void Wad_file::UnindexLump(Lump_c *lump)
+{
+	auto range = name_index.equal_range(lump->l_key);
+
+	for (auto it = range.first ; it != range.second ; ++it)
+	{
+		if (it->second == lump)
+		{
+			name_index.erase(it);
+			return;
+		}
+	}
+
+	BugError("Wad_file: lump %s missing from the name index\n", lump->Name());
+}
+
+
 Lump_c * Wad_file::AddLump(const char *name, int max_size)
 {
 	SYS_ASSERT(begun_write);
 
-	begun_max_size = max_size;
-
-	int start = PositionForWrite(max_size);
+	// the position is decided when the lump is finished
+	Lump_c *lump = new Lump_c(this, name, 0, 0);
 
-	Lump_c *lump = new Lump_c(this, name, start, 0);
+	BeginLump(lump, max_size);
 
 	// check if the insert_point is still valid
 	if (insert_point >= NumLumps())
@@ -961,13 +1259,19 @@ Lump_c * Wad_file::AddLump(const char *name, int max_size)
 
 		directory.insert(directory.begin() + insert_point, lump);
 
+		Renumber(insert_point);
+
 		insert_point++;
 	}
 	else  // add to end
 	{
+		lump->l_index = NumLumps();
+
 		directory.push_back(lump);
 	}
 
+	IndexLump(lump);
+
 	return lump;
 }
 
@@ -976,12 +1280,14 @@ void Wad_file::RecreateLump(Lump_c *lump, int max_size)
 {
 	SYS_ASSERT(begun_write);
 
-	begun_max_size = max_size;
-
-	int start = PositionForWrite(max_size);
+	// this frees the space of the old contents
+	if (! lump->is_held)
+		FreeSpace(lump->l_start, lump->l_length);
 
-	lump->l_start  = start;
+	lump->l_start  = 0;
 	lump->l_length = 0;
+
+	BeginLump(lump, max_size);
 }
 
 
@@ -1012,125 +1318,218 @@ void Wad_file::InsertPoint(int index)
 }
 
 
-int Wad_file::HighWaterMark()
+static inline int64_t AlignSpace(int64_t offset)
 {
-	int offset = (int)sizeof(raw_wad_header_t);
+	return ((offset + 3) / 4) * 4;
+}
 
-	for (int k = 0 ; k < NumLumps() ; k++)
-	{
-		Lump_c *lump = directory[k];
 
-		// ignore zero-length lumps (their offset could be anything)
-		if (lump->Length() <= 0)
-			continue;
+int64_t Wad_file::FindFreeSpace(int length)
+{
+	if (! space_valid)
+		BuildSpace();
 
-		int l_end = lump->l_start + lump->l_length;
+	int64_t need = AlignSpace(length);
 
-		l_end = ((l_end + 3) / 4) * 4;
+	// find the smallest gap which is big enough (the lowest one when
+	// several have the same size)
+	auto it = free_sizes.lower_bound(std::make_pair(need, (int64_t)0));
 
-		if (offset < l_end)
-			offset = l_end;
-	}
+	if (it != free_sizes.end())
+		return AlignSpace(it->second);
 
-	return offset;
+	return AlignSpace(space_end);
 }
 
 
-int Wad_file::FindFreeSpace(int length)
+void Wad_file::UseSpace(int64_t start, int length)
 {
-	length = ((length + 3) / 4) * 4;
+	if (! space_valid)
+		BuildSpace();
 
-	// collect non-zero length lumps and sort by their offset
-	std::vector<Lump_c *> sorted_dir;
+	int64_t end = start + AlignSpace(length);
 
-	for (int k = 0 ; k < NumLumps() ; k++)
+	used_space.insert(std::make_pair(start, end));
+
+	if (start >= space_end)
 	{
-		Lump_c *lump = directory[k];
+		// keep the alignment bytes as a (tiny) gap
+		if (start > space_end)
+			AddGap(space_end, start);
 
-		if (lump->Length() > 0)
-			sorted_dir.push_back(lump);
+		space_end = end;
+		return;
 	}
 
-	std::sort(sorted_dir.begin(), sorted_dir.end(), Lump_c::offset_CMP_pred());
+	// remove the space from the gap containing it
+	auto it = free_space.upper_bound(start);
 
+	SYS_ASSERT(it != free_space.begin());
+	--it;
 
-	int offset = (int)sizeof(raw_wad_header_t);
+	int64_t gap_start = it->first;
+	int64_t gap_end   = it->second;
 
-	for (unsigned int k = 0 ; k < sorted_dir.size() ; k++)
-	{
-		Lump_c *lump = sorted_dir[k];
+	SYS_ASSERT(gap_start <= start && end <= gap_end);
 
-		int l_start = lump->l_start;
-		int l_end   = lump->l_start + lump->l_length;
+	RemoveGap(it);
 
-		l_end = ((l_end + 3) / 4) * 4;
+	if (gap_start < start)
+		AddGap(gap_start, start);
 
-		if (l_end <= offset)
-			continue;
+	if (end < gap_end)
+		AddGap(end, gap_end);
+}
 
-		if (l_start >= offset + length)
-			continue;
 
-		// the lump overlapped the current gap, so bump offset
+void Wad_file::FreeSpace(int64_t start, int length)
+{
+	if (! space_valid || length <= 0)
+		return;
 
-		offset = l_end;
+	// when lumps overlap, it is hard to tell what is really free,
+	// so simply build it all again when next needed.
+	if (space_shared)
+	{
+		space_valid = false;
+		return;
 	}
 
-	return offset;
+	auto it = used_space.find(start);
+
+	if (it == used_space.end())
+	{
+		space_valid = false;
+		return;
+	}
+
+	int64_t end = it->second;
+
+	used_space.erase(it);
+
+	// another lump (or reserved space) can share the same data
+	if (used_space.count(start) > 0)
+		return;
+
+	AddGap(start, end);
 }
 
 
-int Wad_file::PositionForWrite(int max_size)
+void Wad_file::BuildSpace()
 {
-	int want_pos;
+	used_space.clear();
+	free_space.clear();
+	free_sizes.clear();
 
-	if (max_size <= 0)
-		want_pos = HighWaterMark();
-	else
-		want_pos = FindFreeSpace(max_size);
+	std::vector< std::pair<int64_t, int64_t> > used(reserved);
+
+	for (int k = 0 ; k < NumLumps() ; k++)
+	{
+		Lump_c *lump = directory[k];
+
+		// the lump being written has no place yet
+		if (lump == write_lump || lump->is_held || lump->Length() <= 0)
+			continue;
 
-	// determine if position is past end of file
-	// (difference should only be a few bytes)
-	//
-	// Note: doing this for every new lump may be a little expensive,
-	//       but trying to optimise it away will just make the code
-	//       needlessly complex and hard to follow.
+		used.push_back(std::make_pair(lump->l_start, lump->l_start + lump->l_length));
+	}
 
-	if (fseek(fp, 0, SEEK_END) < 0)
-		cur_info->FatalError("Error seeking to new write position.\n");
+	std::sort(used.begin(), used.end());
 
-	total_size = (int)ftell(fp);
+	space_shared = false;
 
-	if (total_size < 0)
-		cur_info->FatalError("Error seeking to new write position.\n");
+	int64_t offset = (int64_t)sizeof(raw_wad_header_t);
 
-	if (want_pos > total_size)
+	for (size_t k = 0 ; k < used.size() ; k++)
 	{
-		SYS_ASSERT(want_pos < total_size + 8);
+		int64_t l_start = used[k].first;
+		int64_t l_end   = used[k].second;
+
+		used_space.insert(used[k]);
+
+		if (l_start > offset)
+		{
+			free_space[offset] = l_start;
+			free_sizes.insert(std::make_pair(l_start - AlignSpace(offset), offset));
+		}
+		else if (l_start < offset && ! (k > 0 && used[k] == used[k-1]))
+		{
+			space_shared = true;
+		}
 
-		WritePadding(want_pos - total_size);
+		offset = std::max(offset, l_end);
 	}
-	else if (want_pos == total_size)
+
+	space_end   = offset;
+	space_valid = true;
+}
+
+
+void Wad_file::AddGap(int64_t start, int64_t end)
+{
+	// merge with the neighbouring gaps
+	auto next = free_space.lower_bound(start);
+
+	if (next != free_space.end() && next->first == end)
 	{
-		/* ready to write */
+		auto after = std::next(next);
+
+		end = next->second;
+		RemoveGap(next);
+
+		next = after;
 	}
-	else
+
+	if (next != free_space.begin())
 	{
-		if (fseek(fp, want_pos, SEEK_SET) < 0)
-			cur_info->FatalError("Error seeking to new write position.\n");
+		auto prev = std::prev(next);
+
+		if (prev->second == start)
+		{
+			start = prev->first;
+			RemoveGap(prev);
+		}
 	}
 
-#if DEBUG_WAD
-	cur_info->Debug("POSITION FOR WRITE: %d  (total_size %d)\n", want_pos, total_size);
-#endif
+	// a gap at the end simply reduces the used space
+	if (end >= space_end)
+	{
+		space_end = start;
+		return;
+	}
 
-	return want_pos;
+	free_space[start] = end;
+	free_sizes.insert(std::make_pair(end - AlignSpace(start), start));
 }
 
 
-bool Wad_file::FinishLump(int final_size)
+void Wad_file::RemoveGap(std::map<int64_t, int64_t>::iterator it)
 {
-	fflush(fp);
+	free_sizes.erase(std::make_pair(it->second - AlignSpace(it->first), it->first));
+	free_space.erase(it);
+}
+
+
+void Wad_file::BeginLump(Lump_c *lump, int max_size)
+{
+	if (write_lump != NULL)
+		BugError("Wad_file: new lump begun before the previous one was finished\n");
+
+	write_lump = lump;
+	write_buf.clear();
+
+	lump->is_held = false;
+	lump->held.clear();
+
+	begun_max_size = max_size;
+}
+
+
+bool Wad_file::FinishLump(Lump_c *lump)
+{
+	SYS_ASSERT(lump == write_lump);
+
+	int final_size = lump->l_length;
 
 	// sanity check
 	if (begun_max_size >= 0)
@@ -1138,27 +1537,99 @@ bool Wad_file::FinishLump(int final_size)
 			BugError("Internal Error: wrote too much in lump (%d > %d)\n",
 					 final_size, begun_max_size);
 
-	int pos = (int)ftell(fp);
+	if (final_size == 0)
+	{
+		lump->l_start = 0;
+		write_lump = NULL;
+		return true;
+	}
+
+	// in compact mode, the data stays in memory until the commit
+	if (in_session && session_compact)
+	{
+		lump->l_start = 0;
+		lump->is_held = true;
+		lump->held.swap(write_buf);
+
+		write_buf.clear();
+		write_lump = NULL;
+		return true;
+	}
+
+	// the exact size is known now, so any gap which is big enough
+	// can be used.
+	int64_t pos = FindFreeSpace(final_size);
+
+	write_lump = NULL;
 
-	if (pos & 3)
+	UseSpace(pos, final_size);
+
+	// the position is always a multiple of four, except when the
+	// file itself had an odd size, so pad the file out to it.
+	if (pos > total_size)
 	{
-		WritePadding(4 - (pos & 3));
+		static const byte zeros[4] = { 0,0,0,0 };
+
+		SYS_ASSERT(pos < total_size + 4);
+
+		if (! WriteAt(total_size, zeros, (size_t)(pos - total_size)))
+			cur_info->FatalError("Error writing WAD padding.\n");
 	}
 
-	fflush(fp);
-	return true;
+	// pad the lump to a multiple of four, then write it in one go
+	write_buf.resize(((write_buf.size() + 3) / 4) * 4, 0);
+
+#if DEBUG_WAD
+	cur_info->Debug("WRITE LUMP: %s @ %lld  len:%d\n", lump->Name(), (long long)pos, final_size);
+#endif
+
+	lump->l_start = pos;
+
+	return WriteAt(pos, write_buf.data(), write_buf.size());
+}
+
+
+bool Wad_file::ReadAt(int64_t pos, void *data, size_t len)
+{
+	SYS_ASSERT(pos >= 0);
+
+	if (mem != NULL)
+	{
+		if (len == 0)
+			return true;
+
+		if ((uint64_t)pos + len > (uint64_t)mem->size())
+			return false;
+
+		memcpy(data, mem->data() + pos, len);
+		return true;
+	}
+
+	return FileReadAt(fp, pos, data, len);
 }
 
 
-int Wad_file::WritePadding(int count)
+bool Wad_file::WriteAt(int64_t pos, const void *data, size_t len)
 {
-	static byte zeros[8] = { 0,0,0,0,0,0,0,0 };
+	int64_t end = pos + (int64_t)len;
+
+	if (mem != NULL)
+	{
+		if ((uint64_t)end > (uint64_t)mem->size())
+			mem->resize((size_t)end);
 
-	SYS_ASSERT(1 <= count && count <= 8);
+		if (len > 0)
+			memcpy(mem->data() + pos, data, len);
+	}
+	else if (! FileWriteAt(fp, pos, data, len))
+	{
+		return false;
+	}
 
-	fwrite(zeros, count, 1, fp);
+	if (total_size < end)
+		total_size = end;
 
-	return count;
+	return true;
 }
 
 
@@ -1176,60 +1647,300 @@ int Wad_file::WritePadding(int count)
 //
 
 
-void Wad_file::WriteDirectory()
+void Wad_file::MakeDirectory(std::vector<raw_wad_entry_t>& entries)
 {
-	dir_start = PositionForWrite();
-	dir_count = NumLumps();
+	entries.resize(directory.size());
+
+	for (int k = 0 ; k < NumLumps() ; k++)
+	{
+		Lump_c *lump = directory[k];
+		SYS_ASSERT(lump);
+
+		lump->MakeEntry(&entries[k]);
+	}
+}
+
+
+void Wad_file::WriteDirectory(const std::vector<raw_wad_entry_t>& entries, bool sync)
+{
+	dir_count = (int)entries.size();
+	dir_start = FindFreeSpace(dir_count * (int)sizeof(raw_wad_entry_t));
 
 #if DEBUG_WAD
 	cur_info->Debug("WriteDirectory...\n");
-	cur_info->Debug("dir_start:%d  dir_count:%d\n", dir_start, dir_count);
+	cur_info->Debug("dir_start:%lld  dir_count:%d\n", (long long)dir_start, dir_count);
 #endif
 
-	for (int k = 0 ; k < dir_count ; k++)
+	if (dir_start > total_size)
 	{
-		Lump_c *lump = directory[k];
-		SYS_ASSERT(lump);
+		static const byte zeros[4] = { 0,0,0,0 };
 
-		raw_wad_entry_t entry;
+		SYS_ASSERT(dir_start < total_size + 4);
 
-		lump->MakeEntry(&entry);
-
-		if (fwrite(&entry, sizeof(entry), 1, fp) != 1)
+		if (! WriteAt(total_size, zeros, (size_t)(dir_start - total_size)))
 			cur_info->FatalError("Error writing WAD directory.\n");
 	}
 
-	fflush(fp);
-
-	total_size = (int)ftell(fp);
+	if (! WriteAt(dir_start, entries.data(), entries.size() * sizeof(raw_wad_entry_t)))
+		cur_info->FatalError("Error writing WAD directory.\n");
 
 #if DEBUG_WAD
-	cur_info->Debug("total_size: %d\n", total_size);
+	cur_info->Debug("total_size: %lld\n", (long long)total_size);
 #endif
 
-	if (total_size < 0)
-		cur_info->FatalError("Error determining WAD size.\n");
+	// the lumps and directory must be on disk before the header
+	// refers to them
+	if (sync)
+		SyncFile();
 
 	// update header at start of file
 
-	rewind(fp);
-
 	raw_wad_header_t header;
 
 	memcpy(header.ident, (kind == 'I') ? "IWAD" : "PWAD", 4);
 
-	header.dir_start   = LE_U32(dir_start);
-	header.num_entries = LE_U32(dir_count);
+	header.dir_start   = LE_U32(DiskOffset(dir_start));
+	header.num_entries = LE_U32((uint32_t)dir_count);
 
-	if (fwrite(&header, sizeof(header), 1, fp) != 1)
+	if (! WriteAt(0, &header, sizeof(header)))
 		cur_info->FatalError("Error writing WAD header.\n");
 
-	fflush(fp);
+	if (sync)
+		SyncFile();
+}
+
+
+void Wad_file::SyncFile()
+{
+	if (mem == NULL)
+		FileSync(fp);
+}
+
+
+bool Wad_file::CopyLump(Lump_c *lump, FILE *dest, int64_t pos)
+{
+	int len = lump->Length();
+
+	if (lump->is_held)
+		return FileWriteAt(dest, pos, lump->held.data(), (size_t)len);
+
+#ifdef __linux__
+	// let the kernel copy it, without passing through user space
+	loff_t in_pos  = lump->l_start;
+	loff_t out_pos = pos;
+
+	while (len > 0)
+	{
+		ssize_t done = copy_file_range(fileno(fp), &in_pos, fileno(dest), &out_pos, (size_t)len, 0);
+
+		if (done < 0 && errno == EINTR)
+			continue;
+
+		// not supported here, fall back to a plain copy
+		if (done <= 0)
+			break;
+
+		len -= (int)done;
+	}
+
+	if (len == 0)
+		return true;
+
+	int offset = lump->Length() - len;
+
+	pos += offset;
+#else
+	int offset = 0;
+#endif
+
+	const uint8_t *data = lump->Data();
+
+	if (data != NULL)
+		return FileWriteAt(dest, pos, data + offset, (size_t)len);
+
+	std::vector<byte> buffer((size_t)len);
+
+	if (! lump->ReadData(offset, buffer.data(), (size_t)len))
+		return false;
+
+	return FileWriteAt(dest, pos, buffer.data(), (size_t)len);
+}
+
+
+//
+// The new file is written next to the old one, then renamed over it,
+// so the wad is either completely old or completely new.
+//
+void Wad_file::WriteCompacted()
+{
+	if (mem != NULL)
+	{
+		CompactMemory();
+		return;
+	}
+
+	std::string temp_name = filename + ".tmp";
+
+	FileMessage("Writing compacted WAD file: %s\n", temp_name.c_str());
+
+	FILE *dest = fopen(temp_name.c_str(), "w+b");
+	if (dest == NULL)
+		cur_info->FatalError("Cannot create file: %s\n", temp_name.c_str());
+
+	// the lumps follow the header, in directory order
+	int64_t pos = (int64_t)sizeof(raw_wad_header_t);
+
+	std::vector<int64_t> new_start((size_t)NumLumps(), 0);
+
+	for (int k = 0 ; k < NumLumps() ; k++)
+	{
+		Lump_c *lump = directory[k];
+
+		if (lump->Length() <= 0)
+			continue;
+
+		if (! CopyLump(lump, dest, pos))
+			cur_info->FatalError("Error writing WAD file: %s\n", temp_name.c_str());
+
+		new_start[k] = pos;
+		pos += lump->Length();
+	}
+
+	// the directory comes last
+	std::vector<raw_wad_entry_t> entries;
+
+	MakeDirectory(entries);
+
+	for (int k = 0 ; k < NumLumps() ; k++)
+		entries[k].pos = LE_U32(DiskOffset(new_start[k]));
+
+	int64_t new_dir_start = pos;
+	int     new_dir_count = (int)entries.size();
+
+	raw_wad_header_t header;
+
+	memcpy(header.ident, (kind == 'I') ? "IWAD" : "PWAD", 4);
+
+	header.dir_start   = LE_U32(DiskOffset(new_dir_start));
+	header.num_entries = LE_U32((uint32_t)new_dir_count);
+
+	if (! FileWriteAt(dest, new_dir_start, entries.data(), entries.size() * sizeof(raw_wad_entry_t)) ||
+		! FileWriteAt(dest, 0, &header, sizeof(header)))
+	{
+		cur_info->FatalError("Error writing WAD file: %s\n", temp_name.c_str());
+	}
+
+#ifndef WIN32
+	// keep the permissions of the original file
+	struct stat info;
+
+	if (fstat(fileno(fp), &info) == 0)
+		fchmod(fileno(dest), info.st_mode & 07777);
+#endif
+
+	FileSync(dest);
+
+	// switch over to the new file
+	UnmapFile();
+
+	fclose(fp);
+	fclose(dest);
+
+#ifdef WIN32
+	bool renamed = MoveFileExA(temp_name.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	bool renamed = rename(temp_name.c_str(), filename.c_str()) == 0;
+#endif
+
+	if (! renamed)
+		cur_info->FatalError("Cannot replace file: %s\n", filename.c_str());
+
+	fp = fopen(filename.c_str(), "r+b");
+	if (fp == NULL)
+		cur_info->FatalError("Cannot open file: %s\n", filename.c_str());
+
+	AdoptCompacted(new_start, new_dir_start, new_dir_count);
+
+	MapFile();
+}
+
+
+void Wad_file::CompactMemory()
+{
+	std::vector<byte> fresh(sizeof(raw_wad_header_t), 0);
+
+	std::vector<int64_t> new_start((size_t)NumLumps(), 0);
+
+	for (int k = 0 ; k < NumLumps() ; k++)
+	{
+		Lump_c *lump = directory[k];
+
+		if (lump->Length() <= 0)
+			continue;
+
+		const uint8_t *data = lump->Data();
+
+		if (data == NULL)
+			cur_info->FatalError("Error reading lump %s in WAD: %s\n", lump->Name(), filename.c_str());
+
+		new_start[k] = (int64_t)fresh.size();
+		fresh.insert(fresh.end(), data, data + lump->Length());
+	}
+
+	std::vector<raw_wad_entry_t> entries;
+
+	MakeDirectory(entries);
+
+	for (int k = 0 ; k < NumLumps() ; k++)
+		entries[k].pos = LE_U32(DiskOffset(new_start[k]));
+
+	int64_t new_dir_start = (int64_t)fresh.size();
+	int     new_dir_count = (int)entries.size();
+
+	const byte *raw_dir = (const byte *)entries.data();
+
+	fresh.insert(fresh.end(), raw_dir, raw_dir + entries.size() * sizeof(raw_wad_entry_t));
+
+	raw_wad_header_t header;
+
+	memcpy(header.ident, (kind == 'I') ? "IWAD" : "PWAD", 4);
+
+	header.dir_start   = LE_U32(DiskOffset(new_dir_start));
+	header.num_entries = LE_U32((uint32_t)new_dir_count);
+
+	memcpy(fresh.data(), &header, sizeof(header));
+
+	mem->swap(fresh);
+
+	AdoptCompacted(new_start, new_dir_start, new_dir_count);
+}
+
+
+void Wad_file::AdoptCompacted(const std::vector<int64_t>& new_start, int64_t new_dir_start, int new_dir_count)
+{
+	for (int k = 0 ; k < NumLumps() ; k++)
+	{
+		Lump_c *lump = directory[k];
+
+		lump->l_start = new_start[k];
+		lump->is_held = false;
+
+		std::vector<byte>().swap(lump->held);
+	}
+
+	space_valid = false;
+
+	dir_start  = new_dir_start;
+	dir_count  = new_dir_count;
+	total_size = new_dir_start + (int64_t)new_dir_count * (int64_t)sizeof(raw_wad_entry_t);
 }
 
 
 bool Wad_file::Backup(const char *new_filename)
 {
+	if (mem != NULL)
+		return false;
+
 	fflush(fp);
 
 	return FileCopy(PathName(), new_filename);
@@ -20,7 +20,11 @@
 #ifndef __ELFBSP_WAD_H__
 #define __ELFBSP_WAD_H__
 
+#include <map>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "raw_def.hpp"
@@ -42,6 +46,26 @@ typedef enum
 } map_format_e;
 
 
+// pack a lump name into a number, upper-cased, for quick comparisons.
+// only the first 8 characters are used.
+constexpr uint64_t LumpNameKey(const char *name)
+{
+	uint64_t key = 0;
+
+	for (int i = 0 ; i < 8 && name[i] != 0 ; i++)
+	{
+		char c = name[i];
+
+		if (c >= 'a' && c <= 'z')
+			c = (char)(c - 'a' + 'A');
+
+		key |= (uint64_t)(uint8_t)c << (i * 8);
+	}
+
+	return key;
+}
+
+
 class Lump_c
 {
 friend class Wad_file;
@@ -51,15 +75,27 @@ private:
 
 	std::string lumpname;
 
-	int l_start;
-	int l_length;
+	int64_t l_start;
+	int     l_length;
+
+	// the packed name, and the index in the wad's directory
+	uint64_t l_key;
+	int l_index;
+
+	// when true, the data of the lump is only kept in memory (in the
+	// compact mode of a write session) and l_start is meaningless.
+	bool is_held;
+	std::vector<byte> held;
 
 	// constructor is private
-	Lump_c(Wad_file *_par, const char *_name, int _start, int _len);
+	Lump_c(Wad_file *_par, const char *_name, int64_t _start, int _len);
 	Lump_c(Wad_file *_par, const raw_wad_entry_t *entry);
 
 	void MakeEntry(raw_wad_entry_t *entry);
 
+	// read data at the given offset in the lump.
+	bool ReadData(int offset, void *data, size_t len);
+
 public:
 	~Lump_c();
 
@@ -69,6 +105,9 @@ public:
 	// case insensitive match on the lump name
 	bool Match(const char *s) const;
 
+	// match on a name packed by LumpNameKey()
+	bool MatchKey(uint64_t key) const { return l_key == key && lumpname.size() <= 8; }
+
 	// do not call this directly, use Wad_file::RenameLump()
 	void Rename(const char *new_name);
 
@@ -82,15 +121,26 @@ public:
 	// read a line of text, returns true if OK, false on EOF
 	bool GetLine(char *buffer, size_t buf_size);
 
+	// give the contents of the lump straight from the memory-mapped
+	// wad (no copying) or from the data held in memory for a new lump
+	// in compact mode, or NULL when that is not possible, e.g. the
+	// wad is not mapped or the lump was added after opening it.  The
+	// Seek() and Read() methods must be used then.  The data remains
+	// valid until the wad is closed, except in a wad opened with
+	// Wad_file::OpenMemory(), where writing a lump can move it.
+	const uint8_t * Data() const;
+
 	// write some data to the lump.  Only the lump which had just
 	// been created with Wad_file::AddLump() or RecreateLump() can be
-	// written to.
+	// written to.  The data is collected in memory, nothing goes to
+	// the file until Finish() is called.
 	bool Write(const void *data, int len);
 
 	// write some text to the lump
 	void Printf(const char *msg, ...);
 
 	// mark the lump as finished (after writing data to it).
+	// this finds a place for the lump and writes it out in one go.
 	bool Finish();
 
 	// predicate for std::sort()
@@ -127,15 +177,30 @@ private:
 
 	char kind;  // 'P' for PWAD, 'I' for IWAD
 
-	// zero means "currently unknown", which only occurs after a
-	// call to BeginWrite() and before any call to AddLump() or
-	// the finalizing EndWrite().
-	int total_size;
+	// size of the file, kept up to date as lumps are written.
+	// offsets are 64-bit, though the directory can only store offsets
+	// below 4 GB.
+	int64_t total_size;
 
 	std::vector<Lump_c *> directory;
 
-	int dir_start;
-	int dir_count;
+	// all the lumps by their packed name
+	std::unordered_multimap<uint64_t, Lump_c *> name_index;
+
+	int64_t dir_start;
+	int     dir_count;
+
+	// the file mapped into memory for reading, NULL when not mapped.
+	// it only covers the size of the file when opened.
+	const uint8_t * map_data;
+	size_t map_size;
+
+	// for a wad held in memory (see OpenMemory), this is the data and
+	// 'fp' is NULL.  writes go straight into it.
+	std::vector<byte> * mem;
+
+	// position for Lump_c::Read(), set by Lump_c::Seek()
+	int64_t read_pos;
 
 	// these are lump indices (into 'directory' vector)
 	std::vector<int> levels;
@@ -147,6 +212,35 @@ private:
 	bool begun_write;
 	int  begun_max_size;
 
+	// the lump currently being written, and its data
+	Lump_c * write_lump;
+	std::vector<byte> write_buf;
+
+	// in a write session, EndWrite() only stores the directory here,
+	// it is written to the file by CommitSession().
+	bool in_session;
+	bool session_dirty;
+	bool session_compact;
+	std::vector<raw_wad_entry_t> session_dir;
+
+	// space used by the on-disk directory and the lumps it refers to
+	// (start and end offsets).  nothing is written there during a
+	// session, so the file stays valid until the final commit.
+	std::vector< std::pair<int64_t, int64_t> > reserved;
+
+	// the space used in the file, by lumps and reserved space (start
+	// and end offsets), and the gaps between it.  gaps are kept both
+	// by their offset (for merging) and their usable size (for quick
+	// placement).  everything from 'space_end' onwards is free.
+	// these are built when first needed, then kept up to date.
+	bool space_valid;
+	bool space_shared;  // some space is used by overlapping lumps
+	int64_t space_end;
+
+	std::multimap<int64_t, int64_t> used_space;
+	std::map<int64_t, int64_t> free_space;
+	std::set< std::pair<int64_t, int64_t> > free_sizes;
+
 	// when >= 0, the next added lump is placed _before_ this
 	int insert_point;
 
@@ -168,13 +262,20 @@ public:
 	//
 	static Wad_file * Open(const char *filename, char mode = 'a');
 
+	// open a wad which is held in memory, e.g. one which was stored
+	// inside a package.  it can be read and written, and the vector
+	// receives all changes (it must stay alive until the wad is
+	// closed).  'name' is only used in messages.  returns NULL if the
+	// data is too small to be a wad.
+	static Wad_file * OpenMemory(const char *name, std::vector<byte> *data);
+
 	// check the given wad file exists and is a WAD file
 	static bool Validate(const char *filename);
 
 	const char *PathName() const { return filename.c_str(); }
 	bool IsReadOnly() const { return mode == 'r'; }
 
-	int TotalSize() const { return total_size; }
+	int64_t TotalSize() const { return total_size; }
 
 	int NumLumps() const { return (int)directory.size(); }
 	Lump_c * GetLump(int index);
@@ -215,6 +316,19 @@ public:
 	void BeginWrite();
 	void EndWrite();
 
+	// a write session groups many BeginWrite() / EndWrite() pairs,
+	// e.g. all the levels of a file.  the on-disk directory and the
+	// data it refers to is left alone until CommitSession(), which
+	// writes the new directory then updates the header, so a crash
+	// leaves the wad in its old state.  Closing the wad also commits.
+	//
+	// with 'compact', new lumps are kept in memory and the commit
+	// writes a fresh wad (all lumps in directory order, without any
+	// gaps) which replaces the file.  the file is left untouched when
+	// the session ends in the middle of a BeginWrite / EndWrite pair.
+	void BeginSession(bool compact = false);
+	void CommitSession();
+
 	// change name of a lump (can be a level marker too)
 	void RenameLump(int index, const char *new_name);
 
@@ -257,35 +371,76 @@ private:
 	// read the existing directory.
 	void ReadDirectory();
 
+	// map the file into memory (when possible) for reading lumps.
+	void MapFile();
+	void UnmapFile();
+
 	void DetectLevels();
 	void ProcessNamespaces();
 
-	// look at all the lumps and determine the lowest offset from
-	// start of file where we can write new data.  The directory itself
-	// is ignored for this.
-	int HighWaterMark();
+	// determine where a lump of the given length will fit, using the
+	// smallest gap which is big enough, otherwise after the last lump.
+	// The directory itself is ignored since it will be re-written at
+	// EndWrite(), except for reserved space in a write session.
+	int64_t FindFreeSpace(int length);
+
+	// mark space as used (after placing a lump there) or free again
+	// (when a lump is recreated or removed).
+	void UseSpace (int64_t start, int length);
+	void FreeSpace(int64_t start, int length);
+
+	// build the used space and gaps from the directory.
+	void BuildSpace();
+
+	void AddGap   (int64_t start, int64_t end);
+	void RemoveGap(std::map<int64_t, int64_t>::iterator it);
 
-	// look at all lumps in directory and determine the lowest offset
-	// where a lump of the given length will fit.  Returns same as
-	// HighWaterMark() when no largest gaps exist.  The directory itself
-	// is ignored since it will be re-written at EndWrite().
-	int FindFreeSpace(int length);
+	// read or write data at the given position in the file.
+	// returns true if OK, false on error.
+	bool ReadAt (int64_t pos, void *data, size_t len);
+	bool WriteAt(int64_t pos, const void *data, size_t len);
 
-	// find a place (possibly at end of WAD) where we can write some
-	// data of max_size (-1 means unlimited), and seek to that spot
-	// (possibly writing some padding zeros -- the difference should
-	// be no more than a few bytes).  Returns new position.
-	int PositionForWrite(int max_size = -1);
+	// prepare to collect the data of a new or recreated lump.
+	void BeginLump(Lump_c *lump, int max_size);
 
-	bool FinishLump(int final_size);
-	int  WritePadding(int count);
+	// find a place for the lump now that its final size is known,
+	// and write the collected data there.
+	bool FinishLump(Lump_c *lump);
+
+	// build the directory entries for all the lumps.
+	void MakeDirectory(std::vector<raw_wad_entry_t>& entries);
 
 	// write the new directory, updating the dir_xxx variables
-	// (including the CRC).
-	void WriteDirectory();
+	// (including the CRC).  with 'sync', the directory is flushed to
+	// disk before the header is updated to point at it.
+	void WriteDirectory(const std::vector<raw_wad_entry_t>& entries, bool sync);
+
+	// flush everything written so far to the disk.
+	void SyncFile();
+
+	// remember the space used by the on-disk directory and lumps.
+	void ReserveOnDisk();
+
+	// write all lumps into a new file and replace the current one.
+	// for a wad in memory, the data is replaced instead.
+	void WriteCompacted();
+	void CompactMemory();
+
+	// update the lumps and directory after writing them compacted.
+	void AdoptCompacted(const std::vector<int64_t>& new_start, int64_t new_dir_start, int new_dir_count);
+
+	// append the data of a lump to the given file, at 'pos'.
+	bool CopyLump(Lump_c *lump, FILE *dest, int64_t pos);
 
 	void FixGroup(std::vector<int>& group, int index, int num_added, int num_removed);
 
+	// update the index of lumps from 'start' onwards, after lumps are
+	// inserted or removed.
+	void Renumber(int start);
+
+	void IndexLump  (Lump_c *lump);
+	void UnindexLump(Lump_c *lump);
+
 private:
 	// deliberately don't implement these
 	Wad_file(const Wad_file& other);
@@ -0,0 +1,1361 @@
+//------------------------------------------------------------------------
+//  ZIP Reading / Writing
+//------------------------------------------------------------------------
+//
+//  ELFBSP  Copyright (C) 2025  Guilherme Miranda
+//
+//  This program is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU General Public License
+//  as published by the Free Software Foundation; either version 2
+//  of the License, or (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//------------------------------------------------------------------------
+
+#include <queue>
+
+#include "local.hpp"
+#include "raw_def.hpp"
+#include "system.hpp"
+#include "utility.hpp"
+#include "zip.hpp"
+
+namespace elfbsp
+{
+
+//------------------------------------------------------------------------
+//  DEFLATE Tables
+//------------------------------------------------------------------------
+
+#define MAX_CODE_BITS   15
+#define MAX_CLEN_BITS   7
+
+#define NUM_LIT_CODES   286
+#define NUM_DIST_CODES  30
+#define NUM_CLEN_CODES  19
+
+// length codes 257..285
+static const short length_base[29] =
+{
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const short length_extra[29] =
+{
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const short dist_base[30] =
+{
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+	8193, 12289, 16385, 24577
+};
+
+static const short dist_extra[30] =
+{
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// the order in which the lengths of the code length codes are stored
+static const byte clen_order[NUM_CLEN_CODES] =
+{
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+
+//------------------------------------------------------------------------
+//  INFLATE
+//------------------------------------------------------------------------
+
+//
+// This is a plain decoder in the style of "puff" by Mark Adler,
+// decoding the Huffman codes one bit at a time.  It is not the
+// fastest, but map wads are small.
+//
+
+struct huffman_t
+{
+	// number of codes of each length
+	short count[MAX_CODE_BITS + 1];
+
+	// the symbols, ordered by their code
+	short symbol[NUM_LIT_CODES + 2];
+};
+
+
+//
+// build a decoding table from the code lengths.  returns false when
+// there are too many codes of some length.  incomplete codes are
+// allowed, they only matter when a missing code is actually used.
+//
+static bool BuildHuffman(huffman_t& h, const byte *lengths, int n)
+{
+	int len, sym;
+
+	for (len = 0 ; len <= MAX_CODE_BITS ; len++)
+		h.count[len] = 0;
+
+	for (sym = 0 ; sym < n ; sym++)
+		h.count[lengths[sym]]++;
+
+	int left = 1;
+
+	for (len = 1 ; len <= MAX_CODE_BITS ; len++)
+	{
+		left = (left << 1) - h.count[len];
+
+		if (left < 0)
+			return false;
+	}
+
+	short offsets[MAX_CODE_BITS + 1];
+
+	offsets[1] = 0;
+
+	for (len = 1 ; len < MAX_CODE_BITS ; len++)
+		offsets[len + 1] = (short)(offsets[len] + h.count[len]);
+
+	for (sym = 0 ; sym < n ; sym++)
+		if (lengths[sym] != 0)
+			h.symbol[offsets[lengths[sym]]++] = (short)sym;
+
+	return true;
+}
+
+
+class inflater_c
+{
+private:
+	const byte *in;
+	size_t in_len;
+	size_t in_pos;
+
+	uint32_t bit_buf;
+	int bit_count;
+
+	std::vector<byte>& out;
+	size_t out_limit;
+
+	// set when the input runs out
+	bool failed;
+
+public:
+	inflater_c(const byte *data, size_t length, std::vector<byte>& _out, size_t limit) :
+		in(data), in_len(length), in_pos(0), bit_buf(0), bit_count(0),
+		out(_out), out_limit(limit), failed(false)
+	{ }
+
+	bool Run();
+
+private:
+	int  Bits(int need);
+	int  Decode(const huffman_t& h);
+
+	bool Stored();
+	bool Fixed();
+	bool Dynamic();
+	bool Codes(const huffman_t& lencode, const huffman_t& distcode);
+};
+
+
+int inflater_c::Bits(int need)
+{
+	uint32_t value = bit_buf;
+
+	while (bit_count < need)
+	{
+		if (in_pos >= in_len)
+		{
+			failed = true;
+			return 0;
+		}
+
+		value |= (uint32_t)in[in_pos++] << bit_count;
+		bit_count += 8;
+	}
+
+	bit_buf = value >> need;
+	bit_count -= need;
+
+	return (int)(value & ((1U << need) - 1));
+}
+
+
+int inflater_c::Decode(const huffman_t& h)
+{
+	int code  = 0;  // bits read so far
+	int first = 0;  // first code of the current length
+	int index = 0;  // index of that code in the symbol table
+
+	for (int len = 1 ; len <= MAX_CODE_BITS ; len++)
+	{
+		code |= Bits(1);
+
+		if (failed)
+			return -1;
+
+		int count = h.count[len];
+
+		if (code - count < first)
+			return h.symbol[index + (code - first)];
+
+		index += count;
+		first += count;
+
+		first <<= 1;
+		code  <<= 1;
+	}
+
+	return -1;  // no such code
+}
+
+
+bool inflater_c::Stored()
+{
+	// skip to the next byte boundary
+	bit_buf   = 0;
+	bit_count = 0;
+
+	if (in_pos + 4 > in_len)
+		return false;
+
+	size_t len  = in[in_pos]   | (in[in_pos+1] << 8);
+	size_t nlen = in[in_pos+2] | (in[in_pos+3] << 8);
+
+	in_pos += 4;
+
+	if (len != (~nlen & 0xFFFF))
+		return false;
+
+	if (in_pos + len > in_len || out.size() + len > out_limit)
+		return false;
+
+	out.insert(out.end(), in + in_pos, in + in_pos + len);
+	in_pos += len;
+
+	return true;
+}
+
+
+bool inflater_c::Codes(const huffman_t& lencode, const huffman_t& distcode)
+{
+	for (;;)
+	{
+		int sym = Decode(lencode);
+
+		if (sym < 0)
+			return false;
+
+		if (sym == 256)
+			return true;
+
+		if (sym < 256)
+		{
+			if (out.size() >= out_limit)
+				return false;
+
+			out.push_back((byte)sym);
+			continue;
+		}
+
+		sym -= 257;
+
+		if (sym >= 29)
+			return false;
+
+		size_t len = (size_t)(length_base[sym] + Bits(length_extra[sym]));
+
+		int dsym = Decode(distcode);
+
+		if (dsym < 0 || dsym >= NUM_DIST_CODES)
+			return false;
+
+		size_t dist = (size_t)(dist_base[dsym] + Bits(dist_extra[dsym]));
+
+		if (failed || dist > out.size() || out.size() + len > out_limit)
+			return false;
+
+		// the copy can overlap what it produces
+		size_t from = out.size() - dist;
+
+		for (size_t i = 0 ; i < len ; i++)
+		{
+			byte b = out[from + i];
+			out.push_back(b);
+		}
+	}
+}
+
+
+bool inflater_c::Fixed()
+{
+	byte lengths[NUM_LIT_CODES + 2];
+
+	int sym = 0;
+
+	for ( ; sym < 144 ; sym++) lengths[sym] = 8;
+	for ( ; sym < 256 ; sym++) lengths[sym] = 9;
+	for ( ; sym < 280 ; sym++) lengths[sym] = 7;
+	for ( ; sym < 288 ; sym++) lengths[sym] = 8;
+
+	huffman_t lencode, distcode;
+
+	BuildHuffman(lencode, lengths, 288);
+
+	for (sym = 0 ; sym < NUM_DIST_CODES ; sym++)
+		lengths[sym] = 5;
+
+	BuildHuffman(distcode, lengths, NUM_DIST_CODES);
+
+	return Codes(lencode, distcode);
+}
+
+
+bool inflater_c::Dynamic()
+{
+	int nlen  = Bits(5) + 257;
+	int ndist = Bits(5) + 1;
+	int nclen = Bits(4) + 4;
+
+	if (failed || nlen > NUM_LIT_CODES || ndist > NUM_DIST_CODES)
+		return false;
+
+	byte lengths[NUM_LIT_CODES + NUM_DIST_CODES];
+
+	memset(lengths, 0, sizeof(lengths));
+
+	int index;
+
+	for (index = 0 ; index < nclen ; index++)
+		lengths[clen_order[index]] = (byte)Bits(3);
+
+	huffman_t lencode, distcode;
+
+	if (failed || ! BuildHuffman(lencode, lengths, NUM_CLEN_CODES))
+		return false;
+
+	// the code lengths of both codes are stored as one sequence
+	for (index = 0 ; index < nlen + ndist ; )
+	{
+		int sym = Decode(lencode);
+
+		if (sym < 0)
+			return false;
+
+		if (sym < 16)
+		{
+			lengths[index++] = (byte)sym;
+			continue;
+		}
+
+		byte len = 0;
+		int  repeat;
+
+		if (sym == 16)
+		{
+			if (index == 0)
+				return false;
+
+			len    = lengths[index - 1];
+			repeat = 3 + Bits(2);
+		}
+		else if (sym == 17)
+		{
+			repeat = 3 + Bits(3);
+		}
+		else
+		{
+			repeat = 11 + Bits(7);
+		}
+
+		if (failed || index + repeat > nlen + ndist)
+			return false;
+
+		while (repeat-- > 0)
+			lengths[index++] = len;
+	}
+
+	// there must be an end-of-block code
+	if (lengths[256] == 0)
+		return false;
+
+	if (! BuildHuffman(lencode, lengths, nlen) ||
+		! BuildHuffman(distcode, lengths + nlen, ndist))
+	{
+		return false;
+	}
+
+	return Codes(lencode, distcode);
+}
+
+
+bool inflater_c::Run()
+{
+	int last;
+
+	do
+	{
+		last = Bits(1);
+
+		int type = Bits(2);
+
+		if (failed)
+			return false;
+
+		bool ok;
+
+		switch (type)
+		{
+			case 0:  ok = Stored();  break;
+			case 1:  ok = Fixed();   break;
+			case 2:  ok = Dynamic(); break;
+			default: ok = false;     break;
+		}
+
+		if (! ok || failed)
+			return false;
+	}
+	while (! last);
+
+	return true;
+}
+
+
+bool InflateData(const byte *data, size_t length, std::vector<byte>& out, size_t size)
+{
+	out.clear();
+	out.reserve(size);
+
+	inflater_c inf(data, length, out, size);
+
+	if (! inf.Run())
+		return false;
+
+	return (out.size() == size);
+}
+
+
+//------------------------------------------------------------------------
+//  DEFLATE
+//------------------------------------------------------------------------
+
+//
+// A simple compressor: greedy LZ77 matching with hash chains, and a
+// dynamic Huffman code for each block of symbols.
+//
+
+#define WINDOW_SIZE   32768
+#define MIN_MATCH     3
+#define MAX_MATCH     258
+
+#define HASH_BITS     15
+#define MAX_CHAIN     64
+
+#define BLOCK_TOKENS  16384
+
+
+class bit_writer_c
+{
+private:
+	std::vector<byte>& out;
+
+	uint64_t buf;
+	int count;
+
+public:
+	bit_writer_c(std::vector<byte>& _out) : out(_out), buf(0), count(0)
+	{ }
+
+	// store some bits, the lowest ones first
+	void Put(uint32_t value, int bits)
+	{
+		buf |= (uint64_t)value << count;
+		count += bits;
+
+		while (count >= 8)
+		{
+			out.push_back((byte)(buf & 0xFF));
+
+			buf >>= 8;
+			count -= 8;
+		}
+	}
+
+	void Flush()
+	{
+		if (count > 0)
+			out.push_back((byte)(buf & 0xFF));
+
+		buf   = 0;
+		count = 0;
+	}
+};
+
+
+// a literal byte (when length is zero) or a match
+struct deflate_token_t
+{
+	uint16_t length;
+	uint16_t value;  // the literal byte, or the distance
+};
+
+
+static inline int LengthSymbol(int length)
+{
+	int k = 28;
+
+	while (length_base[k] > length)
+		k--;
+
+	return k;
+}
+
+
+static inline int DistSymbol(int dist)
+{
+	int k = NUM_DIST_CODES - 1;
+
+	while (dist_base[k] > dist)
+		k--;
+
+	return k;
+}
+
+
+//
+// compute the code lengths of a Huffman code for the given symbol
+// frequencies, with no code longer than 'max_bits'.  when that limit
+// is exceeded, the frequencies are flattened and it is tried again.
+// there are always at least two codes, since a decoder may refuse an
+// incomplete code.
+//
+static void BuildLengths(const uint32_t *freq, int n, int max_bits, byte *lengths)
+{
+	std::vector<uint32_t> weight(freq, freq + n);
+
+	int used = 0;
+
+	for (int i = 0 ; i < n ; i++)
+		if (weight[i] > 0)
+			used++;
+
+	for (int i = 0 ; i < n && used < 2 ; i++)
+	{
+		if (weight[i] == 0)
+		{
+			weight[i] = 1;
+			used++;
+		}
+	}
+
+	std::vector<int> parent((size_t)n * 2, -1);
+	std::vector<int> depth ((size_t)n * 2, 0);
+
+	for (;;)
+	{
+		typedef std::pair<uint64_t, int> heap_item_t;
+
+		std::priority_queue< heap_item_t, std::vector<heap_item_t>, std::greater<heap_item_t> > queue;
+
+		for (int i = 0 ; i < n ; i++)
+			if (weight[i] > 0)
+				queue.push(heap_item_t(weight[i], i));
+
+		int next = n;
+
+		while (queue.size() > 1)
+		{
+			heap_item_t A = queue.top(); queue.pop();
+			heap_item_t B = queue.top(); queue.pop();
+
+			parent[A.second] = next;
+			parent[B.second] = next;
+
+			queue.push(heap_item_t(A.first + B.first, next));
+			next++;
+		}
+
+		// parents are always made after their children
+		int root = next - 1;
+
+		depth[root] = 0;
+
+		for (int k = root - 1 ; k >= n ; k--)
+			depth[k] = depth[parent[k]] + 1;
+
+		int longest = 0;
+
+		for (int i = 0 ; i < n ; i++)
+		{
+			lengths[i] = 0;
+
+			if (weight[i] > 0)
+			{
+				lengths[i] = (byte)(depth[parent[i]] + 1);
+				longest = std::max(longest, (int)lengths[i]);
+			}
+		}
+
+		if (longest <= max_bits)
+			return;
+
+		for (int i = 0 ; i < n ; i++)
+			if (weight[i] > 0)
+				weight[i] = (weight[i] >> 1) | 1;
+	}
+}
+
+
+//
+// compute the canonical codes from the code lengths.  the codes are
+// bit-reversed, since the bit writer stores the lowest bit first.
+//
+static void MakeCodes(const byte *lengths, int n, uint16_t *codes)
+{
+	int bl_count[MAX_CODE_BITS + 1];
+	int next_code[MAX_CODE_BITS + 1];
+
+	memset(bl_count, 0, sizeof(bl_count));
+
+	for (int i = 0 ; i < n ; i++)
+		bl_count[lengths[i]]++;
+
+	bl_count[0] = 0;
+
+	int code = 0;
+
+	for (int bits = 1 ; bits <= MAX_CODE_BITS ; bits++)
+	{
+		code = (code + bl_count[bits - 1]) << 1;
+		next_code[bits] = code;
+	}
+
+	for (int i = 0 ; i < n ; i++)
+	{
+		int len = lengths[i];
+
+		codes[i] = 0;
+
+		if (len == 0)
+			continue;
+
+		int value = next_code[len]++;
+		int rev   = 0;
+
+		for (int b = 0 ; b < len ; b++)
+			rev |= ((value >> b) & 1) << (len - 1 - b);
+
+		codes[i] = (uint16_t)rev;
+	}
+}
+
+
+static void WriteBlock(bit_writer_c& bw, const std::vector<deflate_token_t>& tokens, bool final)
+{
+	uint32_t lit_freq [NUM_LIT_CODES];
+	uint32_t dist_freq[NUM_DIST_CODES];
+
+	memset(lit_freq,  0, sizeof(lit_freq));
+	memset(dist_freq, 0, sizeof(dist_freq));
+
+	for (const deflate_token_t& T : tokens)
+	{
+		if (T.length == 0)
+		{
+			lit_freq[T.value]++;
+		}
+		else
+		{
+			lit_freq[257 + LengthSymbol(T.length)]++;
+			dist_freq[DistSymbol(T.value)]++;
+		}
+	}
+
+	lit_freq[256] = 1;  // end of block
+
+	byte lengths[NUM_LIT_CODES + NUM_DIST_CODES];
+
+	byte *lit_len  = lengths;
+	byte *dist_len = lengths + NUM_LIT_CODES;
+
+	BuildLengths(lit_freq,  NUM_LIT_CODES,  MAX_CODE_BITS, lit_len);
+	BuildLengths(dist_freq, NUM_DIST_CODES, MAX_CODE_BITS, dist_len);
+
+	int nlen = NUM_LIT_CODES;
+	while (nlen > 257 && lit_len[nlen - 1] == 0)
+		nlen--;
+
+	int ndist = NUM_DIST_CODES;
+	while (ndist > 1 && dist_len[ndist - 1] == 0)
+		ndist--;
+
+	// the code lengths of both codes are stored as one sequence,
+	// which is run-length encoded with the symbols 16, 17 and 18.
+	byte all[NUM_LIT_CODES + NUM_DIST_CODES];
+
+	memcpy(all, lit_len, (size_t)nlen);
+	memcpy(all + nlen, dist_len, (size_t)ndist);
+
+	int total = nlen + ndist;
+
+	std::vector< std::pair<int, int> > runs;  // symbol and extra bits
+
+	for (int i = 0 ; i < total ; )
+	{
+		int len = all[i];
+		int run = 1;
+
+		while (i + run < total && all[i + run] == len)
+			run++;
+
+		if (len == 0 && run >= 3)
+		{
+			run = std::min(run, 138);
+
+			if (run >= 11)
+				runs.push_back(std::make_pair(18, run - 11));
+			else
+				runs.push_back(std::make_pair(17, run - 3));
+
+			i += run;
+		}
+		else if (len != 0 && run >= 4)
+		{
+			runs.push_back(std::make_pair(len, 0));
+
+			run = std::min(run - 1, 6);
+			runs.push_back(std::make_pair(16, run - 3));
+
+			i += 1 + run;
+		}
+		else
+		{
+			runs.push_back(std::make_pair(len, 0));
+			i += 1;
+		}
+	}
+
+	uint32_t clen_freq[NUM_CLEN_CODES];
+	memset(clen_freq, 0, sizeof(clen_freq));
+
+	for (size_t k = 0 ; k < runs.size() ; k++)
+		clen_freq[runs[k].first]++;
+
+	byte clen_len[NUM_CLEN_CODES];
+
+	BuildLengths(clen_freq, NUM_CLEN_CODES, MAX_CLEN_BITS, clen_len);
+
+	int nclen = NUM_CLEN_CODES;
+	while (nclen > 4 && clen_len[clen_order[nclen - 1]] == 0)
+		nclen--;
+
+	uint16_t lit_code [NUM_LIT_CODES];
+	uint16_t dist_code[NUM_DIST_CODES];
+	uint16_t clen_code[NUM_CLEN_CODES];
+
+	MakeCodes(lit_len,  NUM_LIT_CODES,  lit_code);
+	MakeCodes(dist_len, NUM_DIST_CODES, dist_code);
+	MakeCodes(clen_len, NUM_CLEN_CODES, clen_code);
+
+	// block header
+	bw.Put(final ? 1 : 0, 1);
+	bw.Put(2, 2);
+
+	bw.Put((uint32_t)(nlen - 257), 5);
+	bw.Put((uint32_t)(ndist - 1), 5);
+	bw.Put((uint32_t)(nclen - 4), 4);
+
+	for (int k = 0 ; k < nclen ; k++)
+		bw.Put(clen_len[clen_order[k]], 3);
+
+	for (size_t k = 0 ; k < runs.size() ; k++)
+	{
+		int sym = runs[k].first;
+
+		bw.Put(clen_code[sym], clen_len[sym]);
+
+		if (sym == 16) bw.Put((uint32_t)runs[k].second, 2);
+		if (sym == 17) bw.Put((uint32_t)runs[k].second, 3);
+		if (sym == 18) bw.Put((uint32_t)runs[k].second, 7);
+	}
+
+	// the data itself
+	for (const deflate_token_t& T : tokens)
+	{
+		if (T.length == 0)
+		{
+			bw.Put(lit_code[T.value], lit_len[T.value]);
+			continue;
+		}
+
+		int sym = LengthSymbol(T.length);
+
+		bw.Put(lit_code[257 + sym], lit_len[257 + sym]);
+		bw.Put((uint32_t)(T.length - length_base[sym]), length_extra[sym]);
+
+		int dsym = DistSymbol(T.value);
+
+		bw.Put(dist_code[dsym], dist_len[dsym]);
+		bw.Put((uint32_t)(T.value - dist_base[dsym]), dist_extra[dsym]);
+	}
+
+	bw.Put(lit_code[256], lit_len[256]);
+}
+
+
+static inline uint32_t HashBytes(const byte *p)
+{
+	return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & ((1 << HASH_BITS) - 1);
+}
+
+
+void DeflateData(const byte *data, size_t length, std::vector<byte>& out)
+{
+	out.clear();
+
+	bit_writer_c bw(out);
+
+	// the most recent position of each hash, and the previous one
+	// with the same hash for each position in the window.
+	std::vector<int64_t> head((size_t)1 << HASH_BITS, -1);
+	std::vector<int64_t> prev(WINDOW_SIZE, -1);
+
+	std::vector<deflate_token_t> tokens;
+	tokens.reserve(BLOCK_TOKENS);
+
+	int64_t pos = 0;
+	int64_t end = (int64_t)length;
+
+	auto Insert = [&](int64_t p)
+	{
+		if (p + MIN_MATCH > end)
+			return;
+
+		uint32_t h = HashBytes(data + p);
+
+		prev[p & (WINDOW_SIZE - 1)] = head[h];
+		head[h] = p;
+	};
+
+	while (pos < end)
+	{
+		int best_len  = 0;
+		int best_dist = 0;
+
+		if (pos + MIN_MATCH <= end)
+		{
+			int max_len = (int)std::min((int64_t)MAX_MATCH, end - pos);
+
+			int64_t cand  = head[HashBytes(data + pos)];
+			int     chain = MAX_CHAIN;
+
+			while (cand >= 0 && pos - cand <= WINDOW_SIZE && chain-- > 0)
+			{
+				const byte *A = data + cand;
+				const byte *B = data + pos;
+
+				if (A[best_len] == B[best_len])
+				{
+					int len = 0;
+
+					while (len < max_len && A[len] == B[len])
+						len++;
+
+					if (len > best_len)
+					{
+						best_len  = len;
+						best_dist = (int)(pos - cand);
+
+						if (len == max_len)
+							break;
+					}
+				}
+
+				int64_t older = prev[cand & (WINDOW_SIZE - 1)];
+
+				// the slot may have been re-used by a newer position
+				if (older >= cand)
+					break;
+
+				cand = older;
+			}
+		}
+
+		deflate_token_t T;
+
+		if (best_len >= MIN_MATCH)
+		{
+			T.length = (uint16_t)best_len;
+			T.value  = (uint16_t)best_dist;
+
+			for (int k = 0 ; k < best_len ; k++)
+				Insert(pos + k);
+
+			pos += best_len;
+		}
+		else
+		{
+			T.length = 0;
+			T.value  = data[pos];
+
+			Insert(pos);
+			pos += 1;
+		}
+
+		tokens.push_back(T);
+
+		if (tokens.size() >= BLOCK_TOKENS)
+		{
+			WriteBlock(bw, tokens, false);
+			tokens.clear();
+		}
+	}
+
+	WriteBlock(bw, tokens, true);
+
+	bw.Flush();
+}
+
+
+//------------------------------------------------------------------------
+//  ZIP Reading Interface
+//------------------------------------------------------------------------
+
+Zip_file::Zip_file(const char *_name, FILE * _fp) :
+	filename(_name), fp(_fp), total_size(0),
+	entries(), dir_start(0), comment()
+{
+	// nothing needed
+}
+
+
+Zip_file::~Zip_file()
+{
+	fclose(fp);
+}
+
+
+Zip_file * Zip_file::Open(const char *filename)
+{
+	FILE *fp = fopen(filename, "r+b");
+
+	if (fp == NULL)
+		return NULL;
+
+	Zip_file *z = new Zip_file(filename, fp);
+
+	if (FileSeek(fp, 0, SEEK_END) != 0)
+	{
+		delete z;
+		return NULL;
+	}
+
+	z->total_size = FileTell(fp);
+
+	if (z->total_size < 0 || ! z->ReadDirectory())
+	{
+		delete z;
+		return NULL;
+	}
+
+	return z;
+}
+
+
+bool Zip_file::ReadDirectory()
+{
+	// the end record is followed by a comment of up to 64K, so look
+	// for it (backwards) in that part of the file.
+	int64_t tail = std::min(total_size, (int64_t)(65535 + sizeof(raw_zip_end_t)));
+
+	if (tail < (int64_t)sizeof(raw_zip_end_t))
+		return false;
+
+	std::vector<byte> buffer((size_t)tail);
+
+	if (! FileReadAt(fp, total_size - tail, buffer.data(), buffer.size()))
+		return false;
+
+	raw_zip_end_t end;
+
+	int64_t k;
+
+	for (k = tail - (int64_t)sizeof(end) ; k >= 0 ; k--)
+	{
+		if (buffer[k] != 'P' || buffer[k+1] != 'K' || buffer[k+2] != 5 || buffer[k+3] != 6)
+			continue;
+
+		memcpy(&end, &buffer[k], sizeof(end));
+
+		if (k + (int64_t)sizeof(end) + LE_U16(end.comment_len) <= tail)
+			break;
+	}
+
+	if (k < 0)
+		return false;
+
+	// multi-part archives are not supported
+	if (LE_U16(end.disk) != 0 || LE_U16(end.dir_disk) != 0 ||
+		LE_U16(end.disk_entries) != LE_U16(end.num_entries))
+	{
+		return false;
+	}
+
+	// neither is ZIP64
+	if (LE_U16(end.num_entries) == 0xFFFF ||
+		LE_U32(end.dir_start)   == 0xFFFFFFFF ||
+		LE_U32(end.dir_size)    == 0xFFFFFFFF)
+	{
+		return false;
+	}
+
+	const byte *raw_comment = &buffer[k + sizeof(end)];
+
+	comment.assign(raw_comment, raw_comment + LE_U16(end.comment_len));
+
+	dir_start = LE_U32(end.dir_start);
+
+	int64_t dir_size = LE_U32(end.dir_size);
+
+	if (dir_start + dir_size > total_size - tail + k)
+		return false;
+
+	std::vector<byte> dir((size_t)dir_size);
+
+	if (! FileReadAt(fp, dir_start, dir.data(), dir.size()))
+		return false;
+
+	size_t pos = 0;
+
+	for (int i = 0 ; i < LE_U16(end.num_entries) ; i++)
+	{
+		entry_t E;
+
+		if (pos + sizeof(E.central) > dir.size())
+			return false;
+
+		memcpy(&E.central, &dir[pos], sizeof(E.central));
+
+		if (LE_U32(E.central.magic) != ZIP_CENTRAL_MAGIC)
+			return false;
+
+		size_t name_len  = LE_U16(E.central.name_len);
+		size_t extra_len = (size_t)LE_U16(E.central.extra_len) + LE_U16(E.central.comment_len);
+
+		pos += sizeof(E.central);
+
+		if (pos + name_len + extra_len > dir.size())
+			return false;
+
+		E.name.assign((const char *)&dir[pos], name_len);
+		pos += name_len;
+
+		E.central_extra.assign(&dir[pos], &dir[pos] + extra_len);
+		pos += extra_len;
+
+		E.replaced = false;
+
+		entries.push_back(E);
+	}
+
+	return true;
+}
+
+
+const char * Zip_file::EntryName(int index) const
+{
+	SYS_ASSERT(0 <= index && index < NumEntries());
+
+	return entries[index].name.c_str();
+}
+
+
+int64_t Zip_file::EntryDataPos(const entry_t& E)
+{
+	// the local header has its own copy of the name and extra field,
+	// which need not be the same as in the central directory.
+	raw_zip_local_t local;
+
+	int64_t pos = LE_U32(E.central.local_pos);
+
+	if (! FileReadAt(fp, pos, &local, sizeof(local)))
+		return -1;
+
+	if (LE_U32(local.magic) != ZIP_LOCAL_MAGIC)
+		return -1;
+
+	return pos + (int64_t)sizeof(local) + LE_U16(local.name_len) + LE_U16(local.extra_len);
+}
+
+
+bool Zip_file::ReadEntry(int index, std::vector<byte>& data)
+{
+	SYS_ASSERT(0 <= index && index < NumEntries());
+
+	entry_t& E = entries[index];
+
+	if (LE_U16(E.central.flags) & ZIP_FLAG_ENCRYPTED)
+		return false;
+
+	size_t comp_size = LE_U32(E.central.comp_size);
+	size_t size      = LE_U32(E.central.size);
+
+	std::vector<byte> raw;
+
+	if (E.replaced)
+	{
+		raw = E.new_data;
+	}
+	else
+	{
+		int64_t pos = EntryDataPos(E);
+
+		if (pos < 0 || pos + (int64_t)comp_size > total_size)
+			return false;
+
+		raw.resize(comp_size);
+
+		if (! FileReadAt(fp, pos, raw.data(), comp_size))
+			return false;
+	}
+
+	switch (LE_U16(E.central.method))
+	{
+		case ZIP_METHOD_STORE:
+			if (comp_size != size)
+				return false;
+
+			data.swap(raw);
+			break;
+
+		case ZIP_METHOD_DEFLATE:
+			if (! InflateData(raw.data(), raw.size(), data, size))
+				return false;
+			break;
+
+		default:
+			return false;
+	}
+
+	uint32_t crc;
+
+	CRC32_Begin(&crc);
+	CRC32_AddBlock(&crc, data.data(), data.size());
+	CRC32_Finish(&crc);
+
+	return (crc == LE_U32(E.central.crc));
+}
+
+
+//------------------------------------------------------------------------
+//  ZIP Writing Interface
+//------------------------------------------------------------------------
+
+void Zip_file::ReplaceEntry(int index, const std::vector<byte>& data)
+{
+	SYS_ASSERT(0 <= index && index < NumEntries());
+
+	entry_t& E = entries[index];
+
+	if ((uint64_t)data.size() > 0xFFFFFFFFULL)
+		cur_info->FatalError("Entry too large for ZIP file: %s\n", E.name.c_str());
+
+	// entries which were stored are kept that way, others are
+	// compressed (unless that does not help).
+	uint16_t method = ZIP_METHOD_STORE;
+
+	if (LE_U16(E.central.method) != ZIP_METHOD_STORE)
+	{
+		DeflateData(data.data(), data.size(), E.new_data);
+
+		if (E.new_data.size() < data.size())
+			method = ZIP_METHOD_DEFLATE;
+	}
+
+	if (method == ZIP_METHOD_STORE)
+		E.new_data = data;
+
+	uint32_t crc;
+
+	CRC32_Begin(&crc);
+	CRC32_AddBlock(&crc, data.data(), data.size());
+	CRC32_Finish(&crc);
+
+	// the sizes are always in the local header, and encryption or
+	// hints about the compression level no longer apply.
+	uint16_t flags = LE_U16(E.central.flags) & ZIP_FLAG_UTF8;
+
+	E.central.version   = LE_U16(20);
+	E.central.flags     = LE_U16(flags);
+	E.central.method    = LE_U16(method);
+	E.central.crc       = LE_U32(crc);
+	E.central.comp_size = LE_U32((uint32_t)E.new_data.size());
+	E.central.size      = LE_U32((uint32_t)data.size());
+
+	E.replaced = true;
+}
+
+
+bool Zip_file::WriteEntry(entry_t& E, int64_t pos)
+{
+	raw_zip_local_t local;
+
+	local.magic     = LE_U32(ZIP_LOCAL_MAGIC);
+	local.version   = E.central.version;
+	local.flags     = E.central.flags;
+	local.method    = E.central.method;
+	local.mod_time  = E.central.mod_time;
+	local.mod_date  = E.central.mod_date;
+	local.crc       = E.central.crc;
+	local.comp_size = E.central.comp_size;
+	local.size      = E.central.size;
+	local.name_len  = E.central.name_len;
+	local.extra_len = LE_U16(0);
+
+	int64_t name_pos = pos + (int64_t)sizeof(local);
+	int64_t data_pos = name_pos + (int64_t)E.name.size();
+
+	return FileWriteAt(fp, pos, &local, sizeof(local)) &&
+		FileWriteAt(fp, name_pos, E.name.data(), E.name.size()) &&
+		FileWriteAt(fp, data_pos, E.new_data.data(), E.new_data.size());
+}
+
+
+void Zip_file::Commit()
+{
+	int count = NumEntries();
+	int k;
+
+	bool changed = false;
+
+	for (k = 0 ; k < count ; k++)
+		if (entries[k].replaced)
+			changed = true;
+
+	if (! changed)
+		return;
+
+	// nothing the current central directory refers to is touched:
+	// the new entries go after the end of the file, followed by the
+	// new central directory.  until the new end record is written,
+	// the file is still the old ZIP with some junk appended, and on
+	// an error it is cut back to its old size.
+
+	int64_t old_size = total_size;
+	int64_t end_pos  = total_size;
+
+	std::vector<uint32_t> new_pos((size_t)count);
+
+	bool write_ok = true;
+
+	for (k = 0 ; k < count && write_ok ; k++)
+	{
+		entry_t& E = entries[k];
+
+		if (! E.replaced)
+			continue;
+
+		new_pos[k] = (uint32_t)end_pos;
+
+		int64_t need = (int64_t)(sizeof(raw_zip_local_t) + E.name.size() + E.new_data.size());
+
+		if (end_pos + need > (int64_t)0xFFFFFFFF)
+		{
+			FileTruncate(fp, old_size);
+			cur_info->FatalError("ZIP file too large (beyond 4 GB): %s\n", filename.c_str());
+		}
+
+		write_ok = WriteEntry(E, end_pos);
+
+		end_pos += need;
+	}
+
+	// the new central directory
+	std::vector<byte> dir;
+
+	for (k = 0 ; k < count && write_ok ; k++)
+	{
+		const entry_t& E = entries[k];
+
+		raw_zip_central_t central = E.central;
+
+		if (E.replaced)
+			central.local_pos = LE_U32(new_pos[k]);
+
+		const byte *raw = (const byte *)&central;
+
+		dir.insert(dir.end(), raw, raw + sizeof(central));
+		dir.insert(dir.end(), E.name.begin(), E.name.end());
+		dir.insert(dir.end(), E.central_extra.begin(), E.central_extra.end());
+	}
+
+	if (write_ok && end_pos + (int64_t)dir.size() > (int64_t)0xFFFFFFFF)
+	{
+		FileTruncate(fp, old_size);
+		cur_info->FatalError("ZIP file too large (beyond 4 GB): %s\n", filename.c_str());
+	}
+
+	raw_zip_end_t end;
+
+	end.magic        = LE_U32(ZIP_END_MAGIC);
+	end.disk         = LE_U16(0);
+	end.dir_disk     = LE_U16(0);
+	end.disk_entries = LE_U16((uint16_t)count);
+	end.num_entries  = LE_U16((uint16_t)count);
+	end.dir_size     = LE_U32((uint32_t)dir.size());
+	end.dir_start    = LE_U32((uint32_t)end_pos);
+	end.comment_len  = LE_U16((uint16_t)comment.size());
+
+	const byte *raw_end = (const byte *)&end;
+
+	dir.insert(dir.end(), raw_end, raw_end + sizeof(end));
+	dir.insert(dir.end(), comment.begin(), comment.end());
+
+	// the entries must be on the disk before anything refers to them
+	if (write_ok)
+		write_ok = FileSync(fp);
+
+	if (write_ok)
+		write_ok = FileWriteAt(fp, end_pos, dir.data(), dir.size());
+
+	if (! write_ok)
+	{
+		FileTruncate(fp, old_size);
+		FileSync(fp);
+
+		cur_info->FatalError("Error writing ZIP file: %s\n", filename.c_str());
+	}
+
+	// the end record must be at the very end of the file
+	if (! FileTruncate(fp, end_pos + (int64_t)dir.size()) || ! FileSync(fp))
+		cur_info->FatalError("Error writing ZIP file: %s\n", filename.c_str());
+
+	for (k = 0 ; k < count ; k++)
+	{
+		entry_t& E = entries[k];
+
+		if (! E.replaced)
+			continue;
+
+		E.central.local_pos = LE_U32(new_pos[k]);
+
+		E.replaced = false;
+		std::vector<byte>().swap(E.new_data);
+	}
+
+	dir_start  = end_pos;
+	total_size = end_pos + (int64_t)dir.size();
+}
+
+} // namespace elfbsp
+
+//--- editor settings ---
+// vi:ts=4:sw=4:noexpandtab
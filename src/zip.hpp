@@ -0,0 +1,126 @@
+//------------------------------------------------------------------------
+//  ZIP Reading / Writing
+//------------------------------------------------------------------------
+//
+//  ELFBSP  Copyright (C) 2025  Guilherme Miranda
+//
+//  This program is free software; you can redistribute it and/or
+//  modify it under the terms of the GNU General Public License
+//  as published by the Free Software Foundation; either version 2
+//  of the License, or (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//------------------------------------------------------------------------
+
+#ifndef __ELFBSP_ZIP_H__
+#define __ELFBSP_ZIP_H__
+
+#include <string>
+#include <vector>
+
+#include "raw_def.hpp"
+
+namespace elfbsp
+{
+
+// decompress raw DEFLATE data (without any zlib or gzip header).
+// 'size' is the expected size of the result.  returns false when
+// the data is corrupt.
+bool InflateData(const byte *data, size_t length, std::vector<byte>& out, size_t size);
+
+// compress data with raw DEFLATE.
+void DeflateData(const byte *data, size_t length, std::vector<byte>& out);
+
+
+class Zip_file
+{
+private:
+	std::string filename;
+
+	FILE * fp;
+
+	int64_t total_size;
+
+	struct entry_t
+	{
+		std::string name;
+
+		// the central directory entry, and the extra field and
+		// comment which follow it (in file order).
+		raw_zip_central_t central;
+		std::vector<byte> central_extra;
+
+		// set by ReplaceEntry(), the compressed data is written by
+		// Commit().
+		bool replaced;
+		std::vector<byte> new_data;
+	};
+
+	std::vector<entry_t> entries;
+
+	// position of the central directory
+	int64_t dir_start;
+
+	// the comment of the whole archive
+	std::vector<byte> comment;
+
+	// constructor is private
+	Zip_file(const char *_name, FILE * _fp);
+
+public:
+	~Zip_file();
+
+	// open a ZIP file for reading and writing.  returns NULL if the
+	// file cannot be opened or is not a ZIP file (or a kind which is
+	// not supported, like a ZIP64 or multi-part one).
+	static Zip_file * Open(const char *filename);
+
+	const char *PathName() const { return filename.c_str(); }
+
+	int NumEntries() const { return (int)entries.size(); }
+
+	// the full name of an entry, e.g. "maps/map01.wad"
+	const char *EntryName(int index) const;
+
+	// read and decompress the contents of an entry.  returns false
+	// when that fails, e.g. the entry is encrypted or compressed by
+	// an unsupported method.
+	bool ReadEntry(int index, std::vector<byte>& data);
+
+	// give new contents to an entry.  nothing is written until the
+	// Commit() method is called.
+	void ReplaceEntry(int index, const std::vector<byte>& data);
+
+	// write the replaced entries and a new central directory.  they
+	// are all written after the end of the file, so that the old
+	// contents stay valid until the new end record is on the disk.
+	// the space of the old entries and directory is not reused.
+	void Commit();
+
+private:
+	// read the central directory.  returns false on error.
+	bool ReadDirectory();
+
+	// find where the data of an entry begins.  returns -1 on error.
+	int64_t EntryDataPos(const entry_t& E);
+
+	// write an entry with its new data at the given position.
+	// returns false on error.
+	bool WriteEntry(entry_t& E, int64_t pos);
+
+private:
+	// deliberately don't implement these
+	Zip_file(const Zip_file& other);
+	Zip_file& operator= (const Zip_file& other);
+};
+
+} // namespace elfbsp
+
+#endif  /* __ELFBSP_ZIP_H__ */
+
+//--- editor settings ---
+// vi:ts=4:sw=4:noexpandtab